@@ -0,0 +1,976 @@
+/**
+* rvc fleet gateway
+*
+* This program keeps one persistent connection to each robot of a fleet,
+* merges their telemetry into one stream tagged by robot id and fans it out
+* to any number of subscribers. Commands of subscribers are routed back to
+* the robot they name.
+*
+* Robot side: the protocol of the robot service, 512 bytes frames on port 5000.
+* Subscriber side: frames delimited by "///" without padding.
+*   gateway -> subscriber : {"robot":"<id>","frame":<robot frame>}///
+*   subscriber -> gateway : {"robot":"<id>","cmd":<robot command>}///
+*   gateway -> subscriber : {"robot":"<id>","error":"offline"}///
+*   gateway -> subscriber : {"robot":"<id>","error":"refused"}///
+*
+* The connection to a robot is shared by all subscribers, so the commands which change
+* that connection (compress, resume, session, tx_policy, motion) are refused.
+*
+* The robot list is a text file with one "<id> <host> [port]" per line.
+*
+*   gcc -O2 -o rvc_gateway rvc_gateway.c
+*   ./rvc_gateway robots.conf [listen_port]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+//json packet size of the robot
+#define RVC_JSON_SIZE 512
+
+//server port number of the robot
+#define RVC_SERVER_PORT 5000
+
+//default port of the gateway for subscribers
+#define GW_LISTEN_PORT 5100
+
+//max size of the output buffer of a connection, a slower subscriber is disconnected
+#define GW_TX_LIMIT (256 * 1024)
+
+//max size of a command of a subscriber
+#define GW_SUB_RX_SIZE 4096
+
+//reconnect backoff of a robot in ms
+#define GW_BACKOFF_MIN_MS 1000
+#define GW_BACKOFF_MAX_MS 30000
+
+#define GW_MAX_EVENTS 256
+#define GW_ID_SIZE 64
+
+//commands which set up the connection they come on, a subscriber must not change the shared robot connection
+static const char* gw_refused_cmds[] = {"compress", "resume", "session", "tx_policy", "motion"};
+
+#define GW_LOG(fmt, ...) fprintf(stderr, "[rvc_gateway] " fmt "\n", ##__VA_ARGS__)
+
+typedef enum{
+	GW_CONN_LISTEN = 0,
+	GW_CONN_ROBOT,
+	GW_CONN_SUB,
+}gw_conn_type_e;
+
+typedef enum{
+	GW_ROBOT_DISCONNECTED = 0,
+	GW_ROBOT_CONNECTING,
+	GW_ROBOT_CONNECTED,
+}gw_robot_state_e;
+
+/**
+* This struct is an output buffer of a connection.
+*/
+typedef struct{
+	char* data;
+	int len;
+	int cap;
+}_gw_buf_s;
+
+/**
+* This struct has information of a robot.
+*/
+typedef struct{
+	gw_conn_type_e type;
+	int fd;
+
+	char id[GW_ID_SIZE];
+	struct sockaddr_in addr;
+
+	gw_robot_state_e state;
+	long long retry_at;
+	int backoff_ms;
+
+	char rx[RVC_JSON_SIZE];
+	int rx_len;
+	_gw_buf_s tx;
+
+	unsigned long long frames;
+}_gw_robot_s;
+
+/**
+* This struct has information of a subscriber.
+*/
+typedef struct{
+	gw_conn_type_e type;
+	int fd;
+	int index;
+
+	char rx[GW_SUB_RX_SIZE];
+	int rx_len;
+	_gw_buf_s tx;
+
+	void* next_dead;
+}_gw_sub_s;
+
+/**
+* This struct has instance information of the gateway.
+*/
+typedef struct{
+	int epoll_fd;
+
+	gw_conn_type_e listen_type;
+	int listen_fd;
+
+	_gw_robot_s* robots;		/* sorted by id */
+	int robot_count;
+	int disconnected;
+
+	_gw_sub_s** subs;
+	int sub_count;
+	int sub_cap;
+	_gw_sub_s* dead;		/* closed in this round, freed after it */
+}_gw_instance_s;
+
+static volatile sig_atomic_t g_run = true;
+
+/**
+* This function returns the monotonic time in ms.
+*/
+static long long
+gw_get_time_ms(void)
+{
+	struct timespec ts = {0,};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+gw_set_nonblock(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/**
+* This function appends data to an output buffer. It fails when the limit is exceeded.
+*/
+static bool
+gw_buf_append(_gw_buf_s* buf, const char* data, int len)
+{
+	char* grown = NULL;
+	int cap = 0;
+
+	if(buf->len + len > GW_TX_LIMIT){
+		return false;
+	}
+
+	if(buf->len + len > buf->cap){
+		cap = buf->cap ? buf->cap : 4096;
+		while(cap < buf->len + len){
+			cap *= 2;
+		}
+
+		grown = realloc(buf->data, cap);
+		if(grown == NULL){
+			return false;
+		}
+
+		buf->data = grown;
+		buf->cap = cap;
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+
+	return true;
+}
+
+/**
+* This function writes an output buffer without blocking.
+* It returns 0 when the buffer is empty, 1 when the socket is full and -1 on error.
+*/
+static int
+gw_buf_flush(_gw_buf_s* buf, int fd)
+{
+	ssize_t sent = 0;
+
+	while(buf->len > 0){
+		sent = send(fd, buf->data, buf->len, MSG_NOSIGNAL);
+
+		if(sent == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+		}
+
+		memmove(buf->data, buf->data + sent, buf->len - sent);
+		buf->len -= sent;
+	}
+
+	return 0;
+}
+
+/**
+* This function sets the events of a connection in the epoll set.
+*/
+static void
+gw_watch(_gw_instance_s* gw, int fd, void* conn, bool want_write, int op)
+{
+	struct epoll_event ev = {0,};
+
+	ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+	ev.data.ptr = conn;
+
+	epoll_ctl(gw->epoll_fd, op, fd, &ev);
+}
+
+/**
+* This function finds a robot by id.
+*/
+static _gw_robot_s*
+gw_find_robot(_gw_instance_s* gw, const char* id)
+{
+	int lo = 0;
+	int hi = gw->robot_count - 1;
+	int mid = 0;
+	int cmp = 0;
+
+	while(lo <= hi){
+		mid = (lo + hi) / 2;
+		cmp = strcmp(gw->robots[mid].id, id);
+
+		if(cmp == 0){
+			return &gw->robots[mid];
+		}else if(cmp < 0){
+			lo = mid + 1;
+		}else{
+			hi = mid - 1;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+gw_robot_compare(const void* a, const void* b)
+{
+	return strcmp(((const _gw_robot_s*)a)->id, ((const _gw_robot_s*)b)->id);
+}
+
+/**
+* This function loads the robot list.
+*/
+static bool
+gw_load_robots(_gw_instance_s* gw, const char* path)
+{
+	FILE* file = fopen(path, "r");
+	char line[256] = {0,};
+	char id[GW_ID_SIZE] = {0,};
+	char host[128] = {0,};
+	int port = 0;
+	int cap = 0;
+	int i;
+	_gw_robot_s* robot = NULL;
+	_gw_robot_s* grown = NULL;
+	struct addrinfo hints = {0,};
+	struct addrinfo* res = NULL;
+
+	if(file == NULL){
+		GW_LOG("cannot open %s", path);
+		return false;
+	}
+
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	while(fgets(line, sizeof(line), file) != NULL){
+		port = RVC_SERVER_PORT;
+
+		if(line[0] == '#' || sscanf(line, "%63s %127s %d", id, host, &port) < 2){
+			continue;
+		}
+
+		if(getaddrinfo(host, NULL, &hints, &res) != 0){
+			GW_LOG("cannot resolve %s of %s", host, id);
+			continue;
+		}
+
+		if(gw->robot_count == cap){
+			cap = cap ? cap * 2 : 64;
+			grown = realloc(gw->robots, cap * sizeof(_gw_robot_s));
+
+			if(grown == NULL){
+				GW_LOG("out of memory at robot %s", id);
+				freeaddrinfo(res);
+				fclose(file);
+				return false;
+			}
+
+			gw->robots = grown;
+		}
+
+		robot = &gw->robots[gw->robot_count++];
+		memset(robot, 0, sizeof(_gw_robot_s));
+		robot->type = GW_CONN_ROBOT;
+		robot->fd = -1;
+		snprintf(robot->id, GW_ID_SIZE, "%s", id);
+		memcpy(&robot->addr, res->ai_addr, sizeof(robot->addr));
+		robot->addr.sin_port = htons(port);
+		robot->backoff_ms = GW_BACKOFF_MIN_MS;
+
+		freeaddrinfo(res);
+	}
+
+	fclose(file);
+
+	qsort(gw->robots, gw->robot_count, sizeof(_gw_robot_s), gw_robot_compare);
+
+	//a command names its robot by id, it must not be ambiguous
+	for(i = 1; i < gw->robot_count; i++){
+		if(strcmp(gw->robots[i - 1].id, gw->robots[i].id) == 0){
+			GW_LOG("duplicate robot id %s", gw->robots[i].id);
+			return false;
+		}
+	}
+
+	gw->disconnected = gw->robot_count;
+
+	GW_LOG("%d robots loaded", gw->robot_count);
+
+	return gw->robot_count > 0;
+}
+
+/**
+* This function starts a non-blocking connection to a robot.
+*/
+static void
+gw_robot_connect(_gw_instance_s* gw, _gw_robot_s* robot)
+{
+	int on = 1;
+
+	robot->fd = socket(PF_INET, SOCK_STREAM, 0);
+
+	if(robot->fd == -1){
+		robot->retry_at = gw_get_time_ms() + robot->backoff_ms;
+		return;
+	}
+
+	gw_set_nonblock(robot->fd);
+	setsockopt(robot->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	setsockopt(robot->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+	if(connect(robot->fd, (struct sockaddr*)&robot->addr, sizeof(robot->addr)) == -1 && errno != EINPROGRESS){
+		close(robot->fd);
+		robot->fd = -1;
+		robot->retry_at = gw_get_time_ms() + robot->backoff_ms;
+		return;
+	}
+
+	robot->state = GW_ROBOT_CONNECTING;
+	gw->disconnected--;
+
+	gw_watch(gw, robot->fd, robot, true, EPOLL_CTL_ADD);
+}
+
+/**
+* This function closes the connection of a robot and schedules the reconnection.
+*/
+static void
+gw_robot_close(_gw_instance_s* gw, _gw_robot_s* robot)
+{
+	if(robot->state == GW_ROBOT_CONNECTED){
+		GW_LOG("robot %s is disconnected", robot->id);
+	}
+
+	if(robot->state != GW_ROBOT_DISCONNECTED){
+		gw->disconnected++;
+	}
+
+	if(robot->fd != -1){
+		close(robot->fd);
+		robot->fd = -1;
+	}
+
+	robot->state = GW_ROBOT_DISCONNECTED;
+	robot->rx_len = 0;
+	robot->tx.len = 0;
+	robot->retry_at = gw_get_time_ms() + robot->backoff_ms;
+
+	robot->backoff_ms *= 2;
+	if(robot->backoff_ms > GW_BACKOFF_MAX_MS){
+		robot->backoff_ms = GW_BACKOFF_MAX_MS;
+	}
+}
+
+/**
+* This function connects the robots whose backoff is expired.
+*/
+static void
+gw_robot_retry(_gw_instance_s* gw)
+{
+	long long now = gw_get_time_ms();
+	int i;
+
+	if(gw->disconnected == 0){
+		return;
+	}
+
+	for(i = 0; i < gw->robot_count; i++){
+		if(gw->robots[i].state == GW_ROBOT_DISCONNECTED && gw->robots[i].retry_at <= now){
+			gw_robot_connect(gw, &gw->robots[i]);
+		}
+	}
+}
+
+/**
+* This function closes the connection of a subscriber.
+* The memory is freed after the epoll round, an event of this round can still point to it.
+*/
+static void
+gw_sub_close(_gw_instance_s* gw, _gw_sub_s* sub)
+{
+	_gw_sub_s* last = NULL;
+
+	//already closed in this round, its index belongs to another subscriber now
+	if(sub->fd == -1){
+		return;
+	}
+
+	last = gw->subs[gw->sub_count - 1];
+
+	last->index = sub->index;
+	gw->subs[sub->index] = last;
+	gw->sub_count--;
+
+	close(sub->fd);
+	sub->fd = -1;
+
+	sub->next_dead = gw->dead;
+	gw->dead = sub;
+}
+
+/**
+* This function frees the subscribers closed in the last epoll round.
+*/
+static void
+gw_sub_free_dead(_gw_instance_s* gw)
+{
+	_gw_sub_s* sub = NULL;
+
+	while(gw->dead != NULL){
+		sub = gw->dead;
+		gw->dead = sub->next_dead;
+
+		free(sub->tx.data);
+		free(sub);
+	}
+}
+
+/**
+* This function queues a frame to a subscriber and writes it if the socket is not full.
+* It returns false when the subscriber is closed.
+*/
+static bool
+gw_sub_send(_gw_instance_s* gw, _gw_sub_s* sub, const char* data, int len)
+{
+	bool was_empty = (sub->tx.len == 0);
+	int ret = 0;
+
+	if(gw_buf_append(&sub->tx, data, len) == false){
+		GW_LOG("subscriber %d is too slow", sub->fd);
+		gw_sub_close(gw, sub);
+		return false;
+	}
+
+	if(was_empty){
+		ret = gw_buf_flush(&sub->tx, sub->fd);
+
+		if(ret == -1){
+			gw_sub_close(gw, sub);
+			return false;
+		}else if(ret == 1){
+			gw_watch(gw, sub->fd, sub, true, EPOLL_CTL_MOD);
+		}
+	}
+
+	return true;
+}
+
+/**
+* This function tags a frame of a robot with its id and fans it out to every subscriber.
+*/
+static void
+gw_fanout(_gw_instance_s* gw, _gw_robot_s* robot)
+{
+	char msg[RVC_JSON_SIZE + GW_ID_SIZE + 32] = {0,};
+	char* end = memmem(robot->rx, RVC_JSON_SIZE, "///", 3);
+	int json_len = end ? (int)(end - robot->rx) : (int)strnlen(robot->rx, RVC_JSON_SIZE);
+	int len = 0;
+	int i;
+
+	robot->frames++;
+
+	if(json_len == 0){
+		return;
+	}
+
+	len = snprintf(msg, sizeof(msg), "{\"robot\":\"%s\",\"frame\":%.*s}///", robot->id, json_len, robot->rx);
+
+	//gw_sub_send can remove the current subscriber, walk from the end
+	for(i = gw->sub_count - 1; i >= 0; i--){
+		gw_sub_send(gw, gw->subs[i], msg, len);
+	}
+}
+
+/**
+* This function handles the events of a robot connection.
+*/
+static void
+gw_robot_event(_gw_instance_s* gw, _gw_robot_s* robot, unsigned int events)
+{
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	ssize_t size = 0;
+	int ret = 0;
+
+	if(robot->state == GW_ROBOT_CONNECTING){
+		getsockopt(robot->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+
+		if(err != 0 || (events & (EPOLLERR | EPOLLHUP))){
+			gw_robot_close(gw, robot);
+			return;
+		}
+
+		robot->state = GW_ROBOT_CONNECTED;
+		robot->backoff_ms = GW_BACKOFF_MIN_MS;
+		GW_LOG("robot %s is connected", robot->id);
+	}
+
+	if(events & EPOLLIN){
+		while(true){
+			size = read(robot->fd, robot->rx + robot->rx_len, RVC_JSON_SIZE - robot->rx_len);
+
+			if(size > 0){
+				robot->rx_len += size;
+
+				if(robot->rx_len == RVC_JSON_SIZE){
+					gw_fanout(gw, robot);
+					robot->rx_len = 0;
+				}
+			}else if(size == -1 && errno == EINTR){
+				continue;
+			}else if(size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				break;
+			}else{
+				gw_robot_close(gw, robot);
+				return;
+			}
+		}
+	}
+
+	ret = gw_buf_flush(&robot->tx, robot->fd);
+
+	if(ret == -1){
+		gw_robot_close(gw, robot);
+		return;
+	}
+
+	gw_watch(gw, robot->fd, robot, ret == 1, EPOLL_CTL_MOD);
+}
+
+/**
+* This function finds the end of the JSON value which starts at text, -1 if it is not complete.
+*/
+static int
+gw_json_value_len(const char* text, int len)
+{
+	int depth = 0;
+	bool in_string = false;
+	int i;
+
+	for(i = 0; i < len; i++){
+		if(in_string){
+			if(text[i] == '\\'){
+				i++;
+			}else if(text[i] == '"'){
+				in_string = false;
+			}
+		}else if(text[i] == '"'){
+			in_string = true;
+		}else if(text[i] == '{' || text[i] == '['){
+			depth++;
+		}else if(text[i] == '}' || text[i] == ']'){
+			if(--depth == 0){
+				return i + 1;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/**
+* This function checks whether a command object has one of the refused members at its top level.
+*/
+static bool
+gw_cmd_refused(const char* cmd, int len)
+{
+	int depth = 0;
+	int key_len = 0;
+	const char* key = NULL;
+	int i, j;
+
+	for(i = 0; i < len; i++){
+		if(cmd[i] == '"'){
+			key = cmd + i + 1;
+
+			for(i++; i < len && cmd[i] != '"'; i++){
+				if(cmd[i] == '\\'){
+					i++;
+				}
+			}
+
+			if(depth != 1){
+				continue;
+			}
+
+			key_len = (int)(cmd + i - key);
+
+			//a member name is followed by a colon, a string value is not
+			for(j = i + 1; j < len && (cmd[j] == ' ' || cmd[j] == '\t' || cmd[j] == '\r' || cmd[j] == '\n'); j++);
+
+			if(j == len || cmd[j] != ':'){
+				continue;
+			}
+
+			for(j = 0; j < (int)(sizeof(gw_refused_cmds) / sizeof(gw_refused_cmds[0])); j++){
+				if((int)strlen(gw_refused_cmds[j]) == key_len && strncmp(key, gw_refused_cmds[j], key_len) == 0){
+					return true;
+				}
+			}
+		}else if(cmd[i] == '{' || cmd[i] == '['){
+			depth++;
+		}else if(cmd[i] == '}' || cmd[i] == ']'){
+			depth--;
+		}
+	}
+
+	return false;
+}
+
+/**
+* This function routes a command of a subscriber to the robot.
+* It returns false when the subscriber is closed.
+*/
+static bool
+gw_route_cmd(_gw_instance_s* gw, _gw_sub_s* sub, char* msg, int len)
+{
+	char id[GW_ID_SIZE] = {0,};
+	char frame[RVC_JSON_SIZE] = {0,};
+	char reply[GW_ID_SIZE + 64] = {0,};
+	char* pos = NULL;
+	int cmd_len = 0;
+	int ret = 0;
+	_gw_robot_s* robot = NULL;
+
+	msg[len] = '\0';
+
+	pos = strstr(msg, "\"robot\"");
+	if(pos == NULL || sscanf(pos, "\"robot\" : \"%63[^\"]\"", id) != 1){
+		return true;
+	}
+
+	pos = strstr(msg, "\"cmd\"");
+	if(pos == NULL || (pos = strchr(pos + 5, '{')) == NULL){
+		return true;
+	}
+
+	cmd_len = gw_json_value_len(pos, msg + len - pos);
+	if(cmd_len <= 0 || cmd_len >= RVC_JSON_SIZE){
+		return true;
+	}
+
+	if(gw_cmd_refused(pos, cmd_len)){
+		ret = snprintf(reply, sizeof(reply), "{\"robot\":\"%s\",\"error\":\"refused\"}///", id);
+		return gw_sub_send(gw, sub, reply, ret);
+	}
+
+	robot = gw_find_robot(gw, id);
+
+	if(robot == NULL || robot->state != GW_ROBOT_CONNECTED){
+		ret = snprintf(reply, sizeof(reply), "{\"robot\":\"%s\",\"error\":\"offline\"}///", id);
+		return gw_sub_send(gw, sub, reply, ret);
+	}
+
+	//the robot reads a command per fixed size frame
+	memcpy(frame, pos, cmd_len);
+
+	if(gw_buf_append(&robot->tx, frame, RVC_JSON_SIZE) == false){
+		gw_robot_close(gw, robot);
+		return true;
+	}
+
+	ret = gw_buf_flush(&robot->tx, robot->fd);
+
+	if(ret == -1){
+		gw_robot_close(gw, robot);
+	}else if(ret == 1){
+		gw_watch(gw, robot->fd, robot, true, EPOLL_CTL_MOD);
+	}
+
+	return true;
+}
+
+/**
+* This function handles the events of a subscriber connection.
+* It returns false when the subscriber is closed.
+*/
+static bool
+gw_sub_event(_gw_instance_s* gw, _gw_sub_s* sub, unsigned int events)
+{
+	ssize_t size = 0;
+	char* end = NULL;
+	int used = 0;
+	int ret = 0;
+
+	if(events & EPOLLIN){
+		while(true){
+			size = read(sub->fd, sub->rx + sub->rx_len, GW_SUB_RX_SIZE - 1 - sub->rx_len);
+
+			if(size > 0){
+				sub->rx_len += size;
+
+				//every complete command ends with the delimiter
+				while((end = memmem(sub->rx, sub->rx_len, "///", 3)) != NULL){
+					used = (int)(end - sub->rx) + 3;
+
+					//a reply which does not fit closes the subscriber
+					if(gw_route_cmd(gw, sub, sub->rx, used - 3) == false){
+						return false;
+					}
+
+					memmove(sub->rx, sub->rx + used, sub->rx_len - used);
+					sub->rx_len -= used;
+				}
+
+				if(sub->rx_len == GW_SUB_RX_SIZE - 1){
+					GW_LOG("subscriber %d sent a too long command", sub->fd);
+					gw_sub_close(gw, sub);
+					return false;
+				}
+			}else if(size == -1 && errno == EINTR){
+				continue;
+			}else if(size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				break;
+			}else{
+				gw_sub_close(gw, sub);
+				return false;
+			}
+		}
+	}
+
+	if(events & EPOLLOUT){
+		ret = gw_buf_flush(&sub->tx, sub->fd);
+
+		if(ret == -1){
+			gw_sub_close(gw, sub);
+			return false;
+		}
+
+		gw_watch(gw, sub->fd, sub, ret == 1, EPOLL_CTL_MOD);
+	}
+
+	return true;
+}
+
+/**
+* This function accepts the new subscribers.
+*/
+static void
+gw_accept(_gw_instance_s* gw)
+{
+	int fd = 0;
+	int on = 1;
+	_gw_sub_s* sub = NULL;
+	_gw_sub_s** grown = NULL;
+
+	while((fd = accept(gw->listen_fd, NULL, NULL)) != -1){
+		sub = calloc(1, sizeof(_gw_sub_s));
+
+		if(sub == NULL){
+			close(fd);
+			continue;
+		}
+
+		if(gw->sub_count == gw->sub_cap){
+			grown = realloc(gw->subs, (gw->sub_cap ? gw->sub_cap * 2 : 64) * sizeof(_gw_sub_s*));
+
+			if(grown == NULL){
+				GW_LOG("out of memory, subscriber %d is refused", fd);
+				free(sub);
+				close(fd);
+				continue;
+			}
+
+			gw->subs = grown;
+			gw->sub_cap = gw->sub_cap ? gw->sub_cap * 2 : 64;
+		}
+
+		gw_set_nonblock(fd);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		sub->type = GW_CONN_SUB;
+		sub->fd = fd;
+		sub->index = gw->sub_count;
+		gw->subs[gw->sub_count++] = sub;
+
+		gw_watch(gw, fd, sub, false, EPOLL_CTL_ADD);
+	}
+}
+
+/**
+* This function makes the socket for the subscribers.
+*/
+static bool
+gw_listen(_gw_instance_s* gw, int port)
+{
+	struct sockaddr_in addr = {0,};
+	int on = 1;
+
+	gw->listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+
+	if(gw->listen_fd == -1){
+		return false;
+	}
+
+	setsockopt(gw->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if(bind(gw->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(gw->listen_fd, 128)){
+		GW_LOG("cannot listen on %d", port);
+		return false;
+	}
+
+	gw_set_nonblock(gw->listen_fd);
+
+	gw->listen_type = GW_CONN_LISTEN;
+	gw_watch(gw, gw->listen_fd, &gw->listen_type, false, EPOLL_CTL_ADD);
+
+	return true;
+}
+
+/**
+* This function raises the limit of file descriptors for a large fleet.
+*/
+static void
+gw_raise_fd_limit(void)
+{
+	struct rlimit rl = {0,};
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static void
+gw_signal(int sig)
+{
+	(void)sig;
+	g_run = false;
+}
+
+int main(int argc, char* argv[])
+{
+	_gw_instance_s gw;
+	struct epoll_event events[GW_MAX_EVENTS];
+	int port = GW_LISTEN_PORT;
+	int count = 0;
+	int i;
+
+	if(argc < 2){
+		fprintf(stderr, "usage: %s <robots.conf> [listen_port]\n", argv[0]);
+		return 1;
+	}
+
+	if(argc > 2){
+		port = atoi(argv[2]);
+	}
+
+	memset(&gw, 0, sizeof(gw));
+
+	signal(SIGINT, gw_signal);
+	signal(SIGTERM, gw_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	gw_raise_fd_limit();
+
+	gw.epoll_fd = epoll_create1(0);
+
+	if(gw.epoll_fd == -1 || gw_load_robots(&gw, argv[1]) == false || gw_listen(&gw, port) == false){
+		return 1;
+	}
+
+	while(g_run){
+		gw_robot_retry(&gw);
+
+		count = epoll_wait(gw.epoll_fd, events, GW_MAX_EVENTS, 200);
+
+		for(i = 0; i < count; i++){
+			gw_conn_type_e type = *(gw_conn_type_e*)events[i].data.ptr;
+
+			if(type == GW_CONN_LISTEN){
+				gw_accept(&gw);
+			}else if(type == GW_CONN_ROBOT){
+				_gw_robot_s* robot = (_gw_robot_s*)events[i].data.ptr;
+
+				//the robot can be closed by an earlier event of this round
+				if(robot->fd != -1){
+					gw_robot_event(&gw, robot, events[i].events);
+				}
+			}else{
+				_gw_sub_s* sub = (_gw_sub_s*)events[i].data.ptr;
+
+				if(sub->fd != -1){
+					gw_sub_event(&gw, sub, events[i].events);
+				}
+			}
+		}
+
+		gw_sub_free_dead(&gw);
+	}
+
+	for(i = gw.sub_count - 1; i >= 0; i--){
+		gw_sub_close(&gw, gw.subs[i]);
+	}
+	gw_sub_free_dead(&gw);
+
+	for(i = 0; i < gw.robot_count; i++){
+		if(gw.robots[i].fd != -1){
+			close(gw.robots[i].fd);
+		}
+		free(gw.robots[i].tx.data);
+	}
+
+	free(gw.robots);
+	free(gw.subs);
+	close(gw.listen_fd);
+	close(gw.epoll_fd);
+
+	return 0;
+}
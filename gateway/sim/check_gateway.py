@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""
+Runs the rvc fleet gateway against simulated robots on localhost and checks it.
+
+  gcc -O2 -o rvc_gateway ../rvc_gateway.c
+  python3 check_gateway.py ./rvc_gateway [robots] [subscribers]
+
+- every subscriber gets the frames of every robot, tagged by its id
+- a command reaches the robot it names as one 512 bytes frame
+- an unknown robot is answered with "offline"
+- the commands which change the shared robot connection are answered with "refused"
+- a subscriber which does not read while it floods commands is dropped, the others keep working
+
+It exits with 1 when a check fails.
+"""
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+from rvc_robot_sim import start_fleet
+
+GW_PORT = 25100
+ROBOT_BASE_PORT = 26000
+
+
+class Subscriber:
+	def __init__(self, port):
+		self.sock = socket.create_connection(("127.0.0.1", port))
+		self.sock.settimeout(0.1)
+		self.rx = b""
+
+	def send(self, robot_id, cmd):
+		self.sock.sendall(('{"robot":"%s","cmd":%s}///' % (robot_id, cmd)).encode())
+
+	def frames(self, duration):
+		out = []
+		end = time.time() + duration
+		while time.time() < end:
+			try:
+				data = self.sock.recv(65536)
+				if not data:
+					break
+				self.rx += data
+			except socket.timeout:
+				continue
+			while b"///" in self.rx:
+				frame, self.rx = self.rx.split(b"///", 1)
+				out.append(frame.decode())
+		return out
+
+	def close(self):
+		self.sock.close()
+
+
+def check(name, ok, detail=""):
+	print("%s %s %s" % ("ok  " if ok else "FAIL", name, detail))
+	return ok
+
+
+def main():
+	if len(sys.argv) < 2:
+		sys.stderr.write("usage: %s <rvc_gateway> [robots] [subscribers]\n" % sys.argv[0])
+		return 1
+
+	count = int(sys.argv[2]) if len(sys.argv) > 2 else 200
+	sub_count = int(sys.argv[3]) if len(sys.argv) > 3 else 3
+	conf = os.path.join(tempfile.mkdtemp(), "robots.conf")
+	passed = True
+
+	fleet = start_fleet(count, ROBOT_BASE_PORT, conf, rate_hz=20.0)
+	gateway = subprocess.Popen([sys.argv[1], conf, str(GW_PORT)], stderr=subprocess.DEVNULL)
+
+	try:
+		time.sleep(1.5)
+		subs = [Subscriber(GW_PORT) for _ in range(sub_count)]
+
+		for i, sub in enumerate(subs):
+			seen = set()
+			for frame in sub.frames(2.0):
+				if '"frame":{"robot_sim"' in frame:
+					seen.add(frame.split('"robot":"', 1)[1].split('"', 1)[0])
+			passed &= check("subscriber %d sees every robot" % i, len(seen) == count, "%d/%d" % (len(seen), count))
+
+		subs[0].send("r1", '{"mode":3}')
+		subs[0].send("r1", '{"compress":{"on":1}}')
+		subs[0].send("r1", '{"id":7,"session":{"resume":1}}')
+		subs[0].send("nobody", '{"mode":1}')
+		replies = [f for f in subs[0].frames(1.0) if '"error"' in f]
+		passed &= check("command reaches its robot", fleet[1].received() == ['{"mode":3}'], str(fleet[1].received()))
+		passed &= check("no other robot gets it", all(not r.received() for r in fleet if r is not fleet[1]))
+		passed &= check("connection commands are refused", replies.count('{"robot":"r1","error":"refused"}') == 2, str(replies))
+		passed &= check("unknown robot is offline", '{"robot":"nobody","error":"offline"}' in replies, str(replies))
+		passed &= check("robots got whole frames", all(r.bad_frames == 0 for r in fleet))
+
+		#the slow subscriber fills its output buffer, the offline replies then close it while its commands are routed
+		slow = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		slow.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+		slow.connect(("127.0.0.1", GW_PORT))
+		slow.settimeout(0.5)
+		flood = b'{"robot":"nobody","cmd":{"mode":1}}///' * 2000
+		end = time.time() + 10
+		dropped = False
+		while time.time() < end and not dropped:
+			try:
+				slow.sendall(flood)
+			except (socket.timeout, OSError):
+				dropped = True
+			time.sleep(0.05)
+		slow.close()
+
+		alive = check("gateway is alive after the slow subscriber", gateway.poll() is None)
+		passed &= alive
+		if alive:
+			late = Subscriber(GW_PORT)
+			frames = late.frames(1.0)
+			passed &= check("a new subscriber still gets frames", any('"frame":' in f for f in frames), "%d frames" % len(frames))
+	finally:
+		gateway.terminate()
+		gateway.wait()
+
+	return 0 if passed else 1
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""
+Simulated robots for the rvc fleet gateway.
+
+Every robot listens on its own localhost port and speaks the robot side of the
+protocol: it sends a 512 bytes zero padded telemetry frame ending with "///"
+at a fixed rate, and reads commands as 512 bytes frames. The commands each
+robot received are kept for the checks.
+
+  python3 rvc_robot_sim.py <count> <base_port> <robots.conf> [rate_hz]
+
+writes the robot list for the gateway and serves until interrupted.
+"""
+import socket
+import sys
+import threading
+import time
+
+RVC_JSON_SIZE = 512
+
+
+class SimRobot(threading.Thread):
+	def __init__(self, robot_id, port, rate_hz):
+		threading.Thread.__init__(self, daemon=True)
+		self.robot_id = robot_id
+		self.port = port
+		self.period = 1.0 / rate_hz
+		self.commands = []
+		self.bad_frames = 0
+		self.connections = 0
+		self.lock = threading.Lock()
+		self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		self.listener.bind(("127.0.0.1", port))
+		self.listener.listen(1)
+
+	def frame(self, seq):
+		data = ('{"robot_sim":"%s","seq":%d}///' % (self.robot_id, seq)).encode()
+		return data.ljust(RVC_JSON_SIZE, b"\0")
+
+	def serve(self, conn):
+		conn.settimeout(self.period)
+		rx = b""
+		seq = 0
+		while True:
+			try:
+				conn.sendall(self.frame(seq))
+			except OSError:
+				return
+			seq += 1
+
+			try:
+				data = conn.recv(65536)
+				if not data:
+					return
+				rx += data
+			except socket.timeout:
+				pass
+			except OSError:
+				return
+
+			#the gateway pads every command to one frame
+			while len(rx) >= RVC_JSON_SIZE:
+				cmd, rx = rx[:RVC_JSON_SIZE], rx[RVC_JSON_SIZE:]
+				text = cmd.rstrip(b"\0")
+				with self.lock:
+					if not text.startswith(b"{") or b"\0" in text:
+						self.bad_frames += 1
+					else:
+						self.commands.append(text.decode())
+
+	def run(self):
+		while True:
+			conn, _ = self.listener.accept()
+			conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+			with self.lock:
+				self.connections += 1
+			self.serve(conn)
+			conn.close()
+
+	def received(self):
+		with self.lock:
+			return list(self.commands)
+
+
+def start_fleet(count, base_port, conf_path, rate_hz=5.0):
+	robots = [SimRobot("r%d" % i, base_port + i, rate_hz) for i in range(count)]
+
+	with open(conf_path, "w") as conf:
+		for robot in robots:
+			conf.write("%s 127.0.0.1 %d\n" % (robot.robot_id, robot.port))
+
+	for robot in robots:
+		robot.start()
+
+	return robots
+
+
+if __name__ == "__main__":
+	if len(sys.argv) < 4:
+		sys.stderr.write("usage: %s <count> <base_port> <robots.conf> [rate_hz]\n" % sys.argv[0])
+		sys.exit(1)
+
+	fleet = start_fleet(int(sys.argv[1]), int(sys.argv[2]), sys.argv[3],
+			float(sys.argv[4]) if len(sys.argv) > 4 else 5.0)
+
+	try:
+		while True:
+			time.sleep(1)
+	except KeyboardInterrupt:
+		for robot in fleet:
+			print("%s connections=%d commands=%s" % (robot.robot_id, robot.connections, robot.received()))
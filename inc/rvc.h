@@ -2,11 +2,58 @@
 #define __rvc_H__
 
 #include <dlog.h>
+#include <stdint.h>
 
 #ifdef  LOG_TAG
 #undef  LOG_TAG
 #endif
 #define LOG_TAG "rvc_sample"
 
+//unix-domain control socket of the on-device helpers, in the data directory of the service
+//which nobody else can write, so that no other user can take the name first
+#define RVC_LOCAL_SOCKET_DIR "/opt/usr/home/owner/apps_rw/org.sample.rvc/data"
+#define RVC_LOCAL_SOCKET_PATH RVC_LOCAL_SOCKET_DIR "/.rvc_control"
+
+/**
+* The command types, shared by the JSON and the binary commands.
+*/
+typedef enum{
+	RVC_CMD_NONE = 0,
+	RVC_CMD_MODE = 1,
+	RVC_CMD_CONTROL = 2,
+	RVC_CMD_TIME = 3,
+	RVC_CMD_VOICE = 4,
+	RVC_CMD_LIN_ANG_VEL = 5,
+	RVC_CMD_SUCTION = 6,
+	RVC_CMD_WHEEL_VEL = 7,
+	RVC_CMD_RESERVE = 8,
+}rvc_cmd_type_e;
+
+/**
+* This struct is a binary command on the local control socket, one per SOCK_SEQPACKET message.
+* Only the fields of the command type are used, as in the JSON command of the same name.
+*/
+typedef struct{
+	uint32_t id;		/* returned in the reply */
+	uint16_t type;		/* rvc_cmd_type_e */
+	uint16_t reserved;
+	int32_t value;		/* mode, control, voice, suction or the type of reserve */
+	int32_t on;
+	int32_t hour;
+	int32_t minute;
+	int32_t left;
+	int32_t right;
+	float lin;
+	float ang;
+}_rvc_local_cmd_s;
+
+/**
+* This struct is the reply to a binary command.
+*/
+typedef struct{
+	uint32_t id;
+	int32_t result;		/* result of the rvc_set call, -1 for an invalid command */
+	int64_t exec_us;
+}_rvc_local_reply_s;
 
 #endif /* __rvc_H__ */
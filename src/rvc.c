@@ -1,3 +1,6 @@
+//struct ucred of SO_PEERCRED
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <tizen.h>
 #include <stdlib.h>
@@ -6,6 +9,11 @@
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
 #include <service_app.h>
 #include <json-glib/json-glib.h>
 #include <json-glib/json-gobject.h>
@@ -14,8 +22,15 @@
 #include <efl_extension.h>
 
 #include <string.h>
+#include <limits.h>
 #include <math.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <sys/types.h>
 #include <sys/ipc.h>
@@ -26,17 +41,247 @@
 #include <download.h>
 #include <tts.h>
 #include <sound_manager.h>
+#include <audio_io.h>
+#include <zlib.h>
 
 #include "rvc.h"
 
 //json packet size
 #define RVC_JSON_SIZE 512
 
+//max age of a sample in a state frame in ms
+#define RVC_AGE_MAX_MS 99999
+
+//limits of the values of a state frame, the frame must fit in RVC_JSON_SIZE with every value at its limit
+#define RVC_STATE_INT_MAX 99999
+#define RVC_STATE_TIME_MAX 99
+#define RVC_STATE_FLAG_MAX 9
+#define RVC_STATE_POS_MAX 9999.999f
+#define RVC_STATE_VEL_MAX 99.999f
+
 //server port number
 #define RVC_SERVER_PORT 5000
 
 #define BUFF_SIZE 512
 
+//receive buffer size of a client, a few pipelined commands fit in it
+#define RVC_RX_BUFF_SIZE (RVC_JSON_SIZE * 4)
+
+//max number of connected clients
+#define RVC_MAX_CLIENTS 4
+
+//telemetry periods in ms: moving or in error, with an active client, idle
+#define RVC_TX_PERIOD_FAST_MS 100
+#define RVC_TX_PERIOD_MS 500
+#define RVC_TX_PERIOD_IDLE_MS 10000
+
+//a client is active for this time after its last command in ms
+#define RVC_TX_ACTIVE_MS 10000
+
+//wait for a full socket to become writable in ms
+#define RVC_TX_POLL_MS 100
+
+//a heartbeat is sent when nothing else was sent for this time in ms
+#define RVC_HEARTBEAT_MS 15000
+
+//shortest heartbeat and idle timeout a client can set and the longest of both in ms, 0 turns them off
+#define RVC_HEARTBEAT_MIN_MS 1000
+#define RVC_IDLE_MIN_MS 3000
+#define RVC_SESSION_MAX_MS (24 * 3600 * 1000)
+
+//tcp keepalive of a connection: idle time and probe interval in s, number of probes
+#define RVC_KEEPALIVE_IDLE 5
+#define RVC_KEEPALIVE_INTVL 2
+#define RVC_KEEPALIVE_CNT 3
+
+//time sent data may stay unacknowledged before the connection is closed in ms
+#define RVC_TCP_USER_TIMEOUT_MS 10000
+
+//max number of sessions, there are more than clients so that closed ones can be resumed
+#define RVC_MAX_SESSIONS (RVC_MAX_CLIENTS * 2)
+
+//time a session can be resumed after its connection is closed in ms
+#define RVC_SESSION_TTL_MS 60000
+
+//number of state snapshots kept for the resume of a session
+#define RVC_STATE_HISTORY 256
+
+//time to live of a motion command with a ts but without a ttl_ms in ms
+#define RVC_MOTION_TTL_MS 500
+
+//shortest and longest time to live of the motion commands a client can set in ms
+#define RVC_MOTION_TTL_MIN_MS 50
+#define RVC_MOTION_TTL_MAX_MS 10000
+
+//shortest and longest motion watchdog a client can set in ms, 0 turns it off
+#define RVC_WATCHDOG_MIN_MS 100
+#define RVC_WATCHDOG_MAX_MS 60000
+
+//max magnitude of the ts of a motion command and of the clock offset of a client in us, about 300 years
+#define RVC_MOTION_MAX_CLOCK_US 10000000000000000LL
+
+//rvc_control_dir_e of the control command which stops the robot
+#define RVC_CONTROL_STOP 0
+
+//result of a motion command which is dropped because it is too old
+#define RVC_RESULT_STALE -2
+
+//result of a member which is not a command
+#define RVC_RESULT_UNKNOWN -3
+
+//max length of the command name echoed in an ack
+#define RVC_ACK_NAME_SIZE 64
+
+//max number of aggregation windows
+#define RVC_AGG_MAX_WINDOWS 4
+
+//default aggregation windows in ms
+#define RVC_AGG_WINDOW_SHORT_MS 1000
+#define RVC_AGG_WINDOW_LONG_MS 10000
+
+//range of an aggregation window in ms
+#define RVC_AGG_WINDOW_MIN_MS 100
+#define RVC_AGG_WINDOW_MAX_MS (60 * 60 * 1000)
+
+//a pose step longer than this in m is a relocalization, it is not counted as motion
+#define RVC_AGG_MAX_STEP 0.5f
+
+//max number of clients of the local control socket
+#define RVC_LOCAL_MAX_CLIENTS 4
+
+//SCHED_FIFO priority of the control threads, 0 keeps the default scheduling
+#define RVC_CTL_PRIORITY 10
+
+//highest SCHED_FIFO priority a client can set, it stays below the kernel threads which handle interrupts
+#define RVC_CTL_PRIORITY_MAX 20
+
+//cpu the control threads are pinned to, -1 for any cpu
+#define RVC_CTL_CPU -1
+
+//number of commands which can wait for the control thread
+#define RVC_CTL_QUEUE_LEN 16
+
+//buckets of the command latency histogram, bucket i counts [2^i, 2^(i+1)) us and the last one the rest
+#define RVC_CTL_HIST_BUCKETS 16
+
+//nice value of the media, logging and telemetry threads
+#define RVC_BACKGROUND_NICE 10
+
+//number of messages held for the log thread and their max length
+#define RVC_LOG_RING 256
+#define RVC_LOG_SIZE 192
+
+//number of frames which can be queued for a client
+#define RVC_TX_QUEUE_LEN 16
+
+//number of shared frame buffers, every queue slot can hold a frame of its own and the producers hold a few more
+#define RVC_FRAME_POOL (RVC_MAX_CLIENTS * RVC_TX_QUEUE_LEN + 16)
+
+//default time a client may stall before the slow client policy is applied
+#define RVC_SLOW_CLIENT_TIMEOUT_MS 3000
+
+//default multicast group, port and ttl of the telemetry publisher
+#define RVC_MCAST_GROUP "239.255.50.1"
+#define RVC_MCAST_PORT 5001
+#define RVC_MCAST_TTL 1
+
+//udp datagram size
+#define RVC_MCAST_SIZE (RVC_JSON_SIZE + 32)
+
+//max number of waypoints of a path
+#define RVC_PATH_MAX_POINTS 64
+
+//control period of the waypoint follower in ms
+#define RVC_PATH_PERIOD_MS 50
+
+//period of the path progress events in ms
+#define RVC_PATH_PROGRESS_MS 500
+
+//default speed (m/s), lookahead distance (m) and goal tolerance (m) of a path
+#define RVC_PATH_SPEED 0.2f
+#define RVC_PATH_LOOKAHEAD 0.3f
+#define RVC_PATH_TOLERANCE 0.05f
+
+//max angular velocity of the waypoint follower (rad/s)
+#define RVC_PATH_MAX_ANG 1.5f
+
+//max linear velocity of the HAL (m/s), a faster path speed is clamped to it
+#define RVC_PATH_MAX_SPEED 0.5f
+
+//time motion commands are refused after a stop or backoff reflex in ms
+#define RVC_REFLEX_HOLD_MS 300
+
+//reverse speed of the backoff reflex (m/s)
+#define RVC_REFLEX_BACKOFF_SPEED 0.1f
+
+//deflate window and memory level of a compressed connection, about 24KB per client
+#define RVC_ZLIB_WINDOW_BITS 12
+#define RVC_ZLIB_MEM_LEVEL 4
+
+//size of a compressed frame, a stored block of a frame fits in it
+#define RVC_ZLIB_FRAME_SIZE (RVC_JSON_SIZE + 64)
+
+//default backoff distance of the bumper and cliff reflexes (m)
+#define RVC_REFLEX_BUMPER_BACKOFF 0.03f
+#define RVC_REFLEX_CLIFF_BACKOFF 0.05f
+
+//max number of no-go zones and walls, and of their edges
+#define RVC_NOGO_MAX_SHAPES 1024
+#define RVC_NOGO_MAX_EDGES 16384
+
+//cell size of the no-go grid (m) and max number of cells, the cells grow to fit
+#define RVC_NOGO_CELL 0.5f
+#define RVC_NOGO_MAX_CELLS 65536
+
+//the motion is predicted over this time in ms, but at least over the distance (m)
+#define RVC_NOGO_HORIZON_MS 1000
+#define RVC_NOGO_MIN_DIST 0.1f
+
+//number of steps of the predicted motion
+#define RVC_NOGO_STEPS 8
+
+//sample rate of the clip bank and the mixer, clips are kept as 16 bit mono
+#define RVC_AUDIO_RATE 16000
+
+//sample rates of the wav files which are resampled to RVC_AUDIO_RATE
+#define RVC_AUDIO_MIN_RATE 8000
+#define RVC_AUDIO_MAX_RATE 48000
+
+//mixer period in samples, 20 ms
+#define RVC_AUDIO_PERIOD 320
+
+//max number of clips in the bank and of clips played at the same time
+#define RVC_AUDIO_MAX_CLIPS 16
+#define RVC_AUDIO_MAX_VOICES 4
+
+//default memory budget of the decoded clips in bytes, about 32 s of sound
+#define RVC_AUDIO_BUDGET (1024 * 1024)
+
+//max memory budget of the decoded clips a client can set in bytes
+#define RVC_AUDIO_MAX_BUDGET (4 * RVC_AUDIO_BUDGET)
+
+//max size of a wav file to be decoded
+#define RVC_AUDIO_MAX_FILE (8 * 1024 * 1024)
+
+//directory of the clips, a client names a file in it
+//it is the private data directory of the local socket, nobody else can put a file there
+#define RVC_AUDIO_DIR RVC_LOCAL_SOCKET_DIR
+
+//max gain of a voice in percent, the mixer multiplies a sample by it in 8.8 fixed point
+#define RVC_AUDIO_MAX_GAIN 400
+
+//ring of a streamed wav file in samples, 4 s
+#define RVC_STREAM_RING (RVC_AUDIO_RATE * 4)
+
+//sound buffered before a stream starts or resumes after an underrun in ms
+#define RVC_STREAM_PREBUFFER_MS 500
+
+//max size of the http and wav headers of a stream
+#define RVC_STREAM_HEADER_SIZE 4096
+
+//connect, send and receive timeout of a stream in ms
+#define RVC_STREAM_TIMEOUT_MS 10000
+
 typedef struct _msg_data {
   long data_type;
   long data_num;
@@ -59,9 +304,12 @@ static bool g_enable_shot = true;
 static bool g_enable_focus = true;
 
 
-//json format
+//json format, ts is the monotonic time of the robot in us and the ages of the samples are in ms,
+//in the order status, wheel_vel, pose, bumper, cliff, lift and lin_ang_vel
 static const char *rvc_json_object =
 "{"
+  "\"ts\":%lld,"
+  "\"ages\":[%lld,%lld,%lld,%lld,%lld,%lld,%lld],"
   "\"mode\":%d,"
   "\"error\":%d,"
   "\"magnet\":%d,"
@@ -85,9 +333,9 @@ static const char *rvc_json_object =
     "\"right\":%d"
   "},"
   "\"pose\":{"
-    "\"x\":%f,"
-    "\"y\":%f,"
-    "\"q\":%f"
+    "\"x\":%.3f,"
+    "\"y\":%.3f,"
+    "\"q\":%.3f"
   "},"
   "\"bumper\":{"
     "\"left\":%d,"
@@ -103,11 +351,123 @@ static const char *rvc_json_object =
     "\"right\":%d"
   "},"
   "\"lin_ang_vel\":{"
-    "\"lin\":%f,"
-    "\"ang\":%f"
+    "\"lin\":%.3f,"
+    "\"ang\":%.3f"
+  "}"
+"}///";
+
+//event json formats
+static const char *rvc_error_event_object =
+"{\"event\":{\"type\":\"error\",\"error\":%d,\"ts\":%lld}}///";
+
+static const char *rvc_bumper_event_object =
+"{\"event\":{\"type\":\"bumper\",\"left\":%d,\"right\":%d,\"ts\":%lld}}///";
+
+static const char *rvc_cliff_event_object =
+"{\"event\":{\"type\":\"cliff\",\"left\":%d,\"center\":%d,\"right\":%d,\"ts\":%lld}}///";
+
+static const char *rvc_lift_event_object =
+"{\"event\":{\"type\":\"lift\",\"left\":%d,\"right\":%d,\"ts\":%lld}}///";
+
+//startup report json format, all values are in ms
+static const char *rvc_startup_object =
+"{"
+  "\"startup\":{"
+    "\"hal\":%lld,"
+    "\"callback\":%lld,"
+    "\"socket\":%lld,"
+    "\"msgq\":%lld,"
+    "\"ready\":%lld,"
+    "\"info\":%lld,"
+    "\"volume\":%lld,"
+    "\"tts\":%lld,"
+    "\"total\":%lld"
+  "}"
+"}///";
+
+//reflex json formats
+static const char *rvc_reflex_event_object =
+"{\"event\":{\"type\":\"reflex\",\"trigger\":\"%s\",\"action\":\"%s\",\"latency_us\":%lld}}///";
+
+//no-go event json format
+static const char *rvc_nogo_event_object =
+"{\"event\":{\"type\":\"nogo\",\"shape\":\"%s\",\"id\":%d,\"action\":\"%s\",\"x\":%f,\"y\":%f}}///";
+
+static const char *rvc_reflex_object =
+"{"
+  "\"reflex\":{"
+    "\"enable\":%d,"
+    "\"fired\":%u,"
+    "\"rejected\":%u,"
+    "\"last_us\":%lld,"
+    "\"max_us\":%lld,"
+    "\"mean_us\":%lld"
   "}"
 "}///";
 
+//compress json format, raw and wire are the bytes before and after the compression
+static const char *rvc_compress_object =
+"{\"compress\":{\"on\":%d,\"dict\":1,\"raw\":%llu,\"wire\":%llu,\"ratio\":%f}}///";
+
+//ack json format, the first value is ack or nack
+static const char *rvc_ack_object =
+"{\"%s\":{\"id\":%lld,\"cmd\":\"%s\",\"result\":%d,\"exec_us\":%lld}}///";
+
+//telemetry scheduler json format
+static const char *rvc_telemetry_object =
+"{\"telemetry\":{\"period_ms\":%d,\"wakeups\":%u,\"wakeups_per_min\":%u,"
+  "\"pool\":{\"size\":%d,\"used\":%d,\"used_max\":%d,\"exhausted\":%u}}}///";
+
+//no-go zones json format
+static const char *rvc_nogo_object =
+"{\"nogo\":{\"enable\":%d,\"zones\":%d,\"walls\":%d,\"cells\":%d,\"checks\":%u,\"check_max_us\":%lld,\"rejected\":%u,\"stopped\":%u}}///";
+
+//clip bank json format
+static const char *rvc_sound_object =
+"{\"sound\":{\"clips\":%d,\"used\":%d,\"budget\":%d,\"voices\":%d,\"played\":%u,\"latency_us\":%lld,\"latency_max_us\":%lld,"
+  "\"stream\":{\"playing\":%d,\"buffered_ms\":%d,\"received\":%lld,\"underruns\":%u,\"first_sound_ms\":%lld}}}///";
+
+//session json format
+static const char *rvc_session_object =
+"{\"session\":{\"token\":\"%016llx\",\"resumed\":%d,\"heartbeat_ms\":%d,\"idle_ms\":%d}}///";
+
+//heartbeat json format
+static const char *rvc_heartbeat_object =
+"{\"heartbeat\":{\"ts\":%lld}}///";
+
+//clock sync json format, t0 is the time of the client, t1 and t2 are the receive and send times of the robot
+static const char *rvc_pong_object =
+"{\"pong\":{\"t0\":%lld,\"t1\":%lld,\"t2\":%lld}}///";
+
+//aggregation summary json format, a value is [min, max, time weighted mean] over the window
+static const char *rvc_summary_object =
+"{\"summary\":{\"window_ms\":%d,\"ts\":%lld,\"span_ms\":%lld,\"samples\":%u,"
+  "\"wheel_vel\":{\"left\":[%.0f,%.0f,%.1f],\"right\":[%.0f,%.0f,%.1f]},"
+  "\"lin_ang_vel\":{\"lin\":[%.3f,%.3f,%.3f],\"ang\":[%.3f,%.3f,%.3f]},"
+  "\"distance\":%.3f,\"rotation\":%.3f,"
+  "\"events\":{\"bumper\":%u,\"cliff\":%u,\"lift\":%u}}}///";
+
+//motion command json format, stale and reordered are the commands dropped for this connection
+static const char *rvc_motion_object =
+"{\"motion\":{\"ttl_ms\":%d,\"watchdog_ms\":%d,\"offset_us\":%lld,\"stale\":%u,\"reordered\":%u,\"watchdog_stops\":%u}}///";
+
+//motion watchdog event json format, idle_ms is the time since the last motion command
+static const char *rvc_watchdog_event_object =
+"{\"event\":{\"type\":\"watchdog\",\"idle_ms\":%d,\"ts\":%lld}}///";
+
+//control thread json format, the percentiles are the upper bounds of their histogram buckets
+static const char *rvc_control_object =
+"{\"realtime\":{\"rt\":%d,\"priority\":%d,\"cpu\":%d,\"cmds\":%u,\"p50_us\":%lld,\"p99_us\":%lld,\"max_us\":%lld,"
+  "\"hist\":[%s],\"log_dropped\":%u}}///";
+
+//aggregation settings json format, the windows and the subscriptions are lists of ms
+static const char *rvc_aggregate_object =
+"{\"aggregate\":{\"windows\":[%s],\"subscribed\":[%s],\"sent\":%u}}///";
+
+//path event json format
+static const char *rvc_path_event_object =
+"{\"path\":{\"state\":\"%s\",\"index\":%d,\"count\":%d,\"remaining\":%f}}///";
+
 /**
 * This struct has tx information.
 */
@@ -141,749 +501,6585 @@ typedef struct{
 
 	int wheel_vel_left;
 	int wheel_vel_right;
+
+	//monotonic time in us when the callbacks have fired, 0 before the first one
+	long long status_us;
+	long long wheel_us;
+	long long pose_us;
+	long long bumper_us;
+	long long cliff_us;
+	long long lift_us;
+	long long lin_ang_us;
 }_rvc_tx_s;
 
+typedef enum{
+	RVC_FRAME_STATE = 0,	/* periodic state, only the latest one matters */
+	RVC_FRAME_EVENT,		/* error, bumper, cliff... must not be lost */
+}rvc_frame_type_e;
+
+typedef enum{
+	RVC_SLOW_POLICY_DISCONNECT = 0,	/* close the connection of a stalled client */
+	RVC_SLOW_POLICY_DROP,			/* keep the connection, drop events which do not fit */
+}rvc_slow_policy_e;
+
+typedef enum{
+	RVC_ZSTREAM_KEEP = 0,
+	RVC_ZSTREAM_START,		/* the frames after this one are compressed */
+	RVC_ZSTREAM_END,		/* this frame ends the compressed stream */
+}rvc_zstream_e;
+
+typedef struct _rvc_buf _rvc_buf_s;
+
 /**
-* This struct has instance information of application.
+* This struct is a frame buffer of the pool. A frame is made once and shared by the send queues
+* of the clients, it goes back to the pool when the last reference is dropped.
+*/
+struct _rvc_buf{
+	int refs;
+	_rvc_buf_s* next;		/* next free buffer */
+	char data[RVC_JSON_SIZE+1];
+};
+
+/**
+* This struct has the frame buffers.
 */
 typedef struct{
-	_rvc_tx_s tx_data;
+	pthread_mutex_t lock;
+	_rvc_buf_s bufs[RVC_FRAME_POOL];
+	_rvc_buf_s* free;
+	int used;
+	int used_max;
+	unsigned int exhausted;
+}_rvc_pool_s;
 
-	int server_socket;
-	int client_socket;
+/**
+* This struct is a frame in the send queue of a client.
+*/
+typedef struct{
+	rvc_frame_type_e type;
+	rvc_zstream_e zstream;
+	_rvc_buf_s* buf;		/* the queue holds a reference */
+}_rvc_frame_s;
+
+/**
+* This struct has the time spent in each startup phase in ms, -1 if not finished yet.
+*/
+typedef struct{
+	long long hal_ms;
+	long long callback_ms;
+	long long socket_ms;
+	long long msgq_ms;
+	long long ready_ms;		/* until the control port is live */
+	long long info_ms;
+	long long volume_ms;
+	long long tts_ms;
+	long long total_ms;		/* until the background initialization is finished */
+}_rvc_startup_s;
+
+typedef struct _rvc_instance _rvc_instance_s;
+
+typedef struct{
+	float x;
+	float y;
+}_rvc_point_s;
+
+/**
+* This struct has information of a connected client.
+*/
+typedef struct{
+	_rvc_instance_s* instance;
+
+	int in_use;
+	int socket;
+	unsigned int serial;	/* changes every time the slot is taken */
 
 	pthread_t rx_thread;
 	pthread_t tx_thread;
 
 	int tx_run;
-	int rx_run;
 
-#ifdef _DEVICE_TEST_
-	player_h player;
-	camera_h camera;
-#endif
-}_rvc_instance_s;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	_rvc_frame_s queue[RVC_TX_QUEUE_LEN];
+	int q_head;
+	int q_count;
+	int head_sent;		/* bytes of the head frame already written */
+	int state_slot;		/* queued state frame which is not being sent yet, -1 if none */
+
+	const char* wire_data;	/* head frame as it goes on the wire, NULL if not made yet */
+	int wire_len;
+
+	z_stream zs;
+	int z_on;
+	int z_level;
+	char z_frame[RVC_ZLIB_FRAME_SIZE];
+	unsigned long long raw_bytes;
+	unsigned long long wire_bytes;
+
+	rvc_slow_policy_e slow_policy;
+	int slow_timeout_ms;
+	int overflow;
+	long long last_progress;
+
+	unsigned int state_replaced;
+	unsigned int events_dropped;
+
+	long long rx_us;		/* monotonic time the last data was received */
+	long long tx_ms;		/* monotonic time the last frame was queued */
+	int heartbeat_ms;
+	int idle_ms;			/* 0: the connection is not closed when the client is silent */
+	int session;
+
+	unsigned int agg_mask;	/* aggregation windows sent to the client, guarded by the client lock of the instance */
+
+	long long clock_offset_us;	/* the robot clock minus the clock of the client */
+	int motion_ttl_ms;
+	int watchdog_ms;
+	long long motion_ts;		/* ts of the last motion command executed, in the robot clock */
+	unsigned int motion_stale;
+	unsigned int motion_reordered;
+}_rvc_client_s;
 
 /**
-* This function will be called when the mode type of the rvc is changed.
+* This struct has the settings of a connection, which are kept for a while after it is closed.
 */
-static void
-rvc_mode_callback(rvc_mode_type_get_e mode, void* data)
-{
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+typedef struct{
+	unsigned long long token;
+	int attached;
+	long long detached_ms;
+
+	int slow_policy;
+	int slow_timeout_ms;
+	int z_level;
+	int heartbeat_ms;
+	int idle_ms;
+	unsigned int agg_mask;
+	long long clock_offset_us;
+	int motion_ttl_ms;
+	int watchdog_ms;
+}_rvc_session_s;
+
+typedef enum{
+	RVC_REFLEX_BUMPER_LEFT = 0,
+	RVC_REFLEX_BUMPER_RIGHT,
+	RVC_REFLEX_CLIFF_LEFT,
+	RVC_REFLEX_CLIFF_CENTER,
+	RVC_REFLEX_CLIFF_RIGHT,
+	RVC_REFLEX_LIFT_LEFT,
+	RVC_REFLEX_LIFT_RIGHT,
+	RVC_REFLEX_TRIGGER_MAX,
+}rvc_reflex_trigger_e;
+
+static const char *rvc_reflex_trigger_names[RVC_REFLEX_TRIGGER_MAX] = {
+	"bumper_left", "bumper_right", "cliff_left", "cliff_center", "cliff_right", "lift_left", "lift_right",
+};
+
+typedef enum{
+	RVC_REFLEX_NONE = 0,
+	RVC_REFLEX_STOP,		/* stop the motion */
+	RVC_REFLEX_BACKOFF,		/* stop and reverse the distance of the rule */
+	RVC_REFLEX_HALT,		/* stop and refuse motion until the trigger is cleared */
+	RVC_REFLEX_ACTION_MAX,
+}rvc_reflex_action_e;
+
+static const char *rvc_reflex_action_names[RVC_REFLEX_ACTION_MAX] = {
+	"none", "stop", "backoff", "halt",
+};
 
-	if(instance == NULL){
-		return;
-	}
+typedef struct{
+	rvc_reflex_action_e action;
+	float distance;
+}_rvc_reflex_rule_s;
 
-	instance->tx_data.mode = (unsigned char)mode;
+/**
+* This struct has the reflex rules and their state.
+* The lock is held by every motion command so that a reflex cannot be overridden.
+*/
+typedef struct{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int run;
+
+	int enable;
+	_rvc_reflex_rule_s rules[RVC_REFLEX_TRIGGER_MAX];
+
+	int halted;					/* bit mask of the triggers holding a halt */
+	long long backoff_until;	/* end of the backoff motion in ms, 0 if none */
+	long long hold_until;		/* motion commands are refused until then */
+	long long watchdog_until;	/* the motion is stopped then unless a fresh command comes, 0 if not armed */
+	int watchdog_ms;
+	_rvc_client_s* watchdog_owner;	/* the client which armed the watchdog, only it can disarm it */
+	unsigned int watchdog_serial;
+
+	unsigned int fired;
+	unsigned int rejected;
+	unsigned int watchdog_stops;
+	long long latency_last_us;
+	long long latency_max_us;
+	long long latency_sum_us;
+}_rvc_reflex_s;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_mode_callback = %d", mode);
-}
+/**
+* This struct has a no-go zone or a virtual wall, its edges are contiguous in the index.
+*/
+typedef struct{
+	int id;
+	int wall;
+	int first;
+	int count;
+	float min_x, min_y, max_x, max_y;
+}_rvc_nogo_shape_s;
 
 /**
-* This function will be called when error condition of the rvc is changed.
+* This struct has an edge of a zone or a segment of a wall.
 */
-static void
-rvc_error_callback(rvc_device_error_type_e error, void* data)
-{
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+typedef struct{
+	int shape;
+	_rvc_point_s a;
+	_rvc_point_s b;
+}_rvc_nogo_edge_s;
 
-	if(instance == NULL){
-		return;
-	}
+/**
+* This struct has the no-go zones and walls in a uniform grid.
+* It is not changed once it is built, a new set replaces it.
+*/
+typedef struct{
+	_rvc_nogo_shape_s* shapes;
+	int shape_count;
+	int zones;
+	int walls;
+
+	_rvc_nogo_edge_s* edges;
+	int edge_count;
+
+	float origin_x;
+	float origin_y;
+	float cell;
+	int cols;
+	int rows;
+
+	int* edge_start;	/* the edges of cell i are edge_items[edge_start[i]] to edge_items[edge_start[i + 1] - 1] */
+	int* edge_items;
+	int* zone_start;	/* the zones whose box overlaps the cell */
+	int* zone_items;
+}_rvc_nogo_index_s;
 
-	instance->tx_data.error = (unsigned char)error;
+/**
+* This struct has the no-go state of the robot.
+*/
+typedef struct{
+	pthread_mutex_t lock;
+	int enable;
+	_rvc_nogo_index_s* index;
+	int violating;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_error_callback = %d", error);
-}
+	unsigned int checks;
+	long long check_max_us;
+	unsigned int rejected;
+	unsigned int stopped;
+}_rvc_nogo_s;
 
 /**
-* This function will be called when the wheel velocity of the rvc is changed.
+* This struct is a command of the rvc decoded from a client.
 */
-static void
-rvc_wheel_callback(signed short wheel_vel_left, signed short wheel_vel_right, void* data)
-{
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+typedef struct{
+	rvc_cmd_type_e type;
+	int value;		/* mode, control, voice, suction or the type of reserve */
+	int on;
+	int hour;
+	int minute;
+	int left;
+	int right;
+	float lin;
+	float ang;
+	int watchdog_ms;	/* the motion is stopped when no other motion command comes in time, 0 for never */
+	_rvc_client_s* client;	/* the client which sent the command, NULL for the local socket */
+}_rvc_cmd_s;
 
-	if(instance == NULL){
-		return;
-	}
+/**
+* This struct has the path followed by the robot itself.
+*/
+typedef struct{
+	pthread_mutex_t ctl_lock;	/* serializes start and stop */
+	pthread_mutex_t lock;
+	pthread_t thread;
+	int started;
+	int run;
+
+	_rvc_point_s points[RVC_PATH_MAX_POINTS];
+	int count;
+	int target;			/* end point of the segment being followed */
+	float remaining;
+
+	float speed;
+	float lookahead;
+	float tolerance;
+
+	_rvc_client_s* owner;
+	unsigned int owner_serial;
+	unsigned long long owner_token;	/* a resumed session takes the path over */
+}_rvc_path_s;
 
-	instance->tx_data.wheel_vel_left = wheel_vel_left;
-	instance->tx_data.wheel_vel_right = wheel_vel_right;
+/**
+* This struct has a clip of the bank decoded to the format of the mixer.
+*/
+typedef struct{
+	char name[32];
+	short* pcm;
+	int samples;
+}_rvc_clip_s;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_wheel_callback = %d, %d", wheel_vel_left, wheel_vel_right);
-}
+/**
+* This struct has a clip being played.
+*/
+typedef struct{
+	_rvc_clip_s* clip;		/* NULL when the voice is free */
+	int pos;
+	int gain;			/* 8.8 fixed point */
+	long long start_us;
+}_rvc_voice_s;
 
 /**
-* This function will be called when the pose of the rvc is changed.
+* This struct has a remote wav file played while it is received.
 */
-static void
-rvc_pose_callback(float pose_x, float pose_y, float pose_q, void* data)
-{
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+typedef struct{
+	pthread_t thread;
+	pthread_cond_t space;		/* the mixer has taken samples from the ring */
+	int started;
+	int run;
+	int socket;
+	char url[256];
+
+	int format;
+	int channels;
+	int bits;
+	int step;			/* source frames per sample of the mixer, 16.16 fixed point */
+	int phase;
+	int prev;
+
+	short* ring;
+	int head;
+	int count;
+	int prebuffer;
+	int playing;			/* false while buffering */
+	int eof;
+
+	unsigned int underruns;
+	long long received;
+	long long start_us;
+	long long first_sound_us;
+}_rvc_stream_s;
 
-	if(instance == NULL){
-		return;
-	}
+/**
+* This struct has the clip bank and the mixer.
+*/
+typedef struct{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int run;
 
-	instance->tx_data.pose_x = pose_x;
-	instance->tx_data.pose_y = pose_y;
-	instance->tx_data.pose_q = pose_q;
+	audio_out_h out;
+	int prepared;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_pose_callback = %f, %f, %f", pose_x, pose_y, pose_q);
-}
+	_rvc_clip_s clips[RVC_AUDIO_MAX_CLIPS];
+	int used;			/* decoded bytes */
+	int budget;
+
+	_rvc_voice_s voices[RVC_AUDIO_MAX_VOICES];
+	int active;
+	unsigned int played;
+
+	long long latency_last_us;	/* from the command to the first mixed period */
+	long long latency_max_us;
+
+	_rvc_stream_s stream;
+}_rvc_audio_s;
 
 /**
-* This function will be called when the bumper sensor level of the rvc is changed.
+* This struct has a clip of the default set.
 */
-static void
-rvc_bumper_callback(unsigned char bumper_left, unsigned char bumper_right, void* data)
-{
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
-
-	if(instance == NULL){
-		return;
-	}
+typedef struct{
+	const char* name;
+	const char* path;
+}_rvc_clip_file_s;
+
+//clips preloaded at startup
+static const _rvc_clip_file_s rvc_audio_clips[] = {
+	{"alarm", RVC_AUDIO_DIR "/alarm.wav"},
+	{NULL, NULL}
+};
+
+typedef enum{
+	RVC_AGG_WHEEL_LEFT = 0,
+	RVC_AGG_WHEEL_RIGHT,
+	RVC_AGG_LIN,
+	RVC_AGG_ANG,
+	RVC_AGG_STAT_MAX,
+}rvc_agg_stat_e;
+
+typedef enum{
+	RVC_AGG_BUMPER = 0,
+	RVC_AGG_CLIFF,
+	RVC_AGG_LIFT,
+	RVC_AGG_EVENT_MAX,
+}rvc_agg_event_e;
 
-	instance->tx_data.bumper_left = bumper_left;
-	instance->tx_data.bumper_right = bumper_right;
+/**
+* This struct has the min, max and time weighted mean of a value over a window.
+*/
+typedef struct{
+	float value;		/* the last sample, it holds until the next one */
+	long long since;	/* time of the last sample or of the window start in us */
+	float min;
+	float max;
+	double area;		/* the value integrated over the time of the window */
+}_rvc_agg_stat_s;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_bumper_callback = %d, %d", bumper_left, bumper_right);
-}
+/**
+* This struct has an aggregation window.
+*/
+typedef struct{
+	int period_ms;
+	long long start_us;
+	unsigned int samples;
+	_rvc_agg_stat_s stats[RVC_AGG_STAT_MAX];
+	float distance;
+	float rotation;
+	unsigned int events[RVC_AGG_EVENT_MAX];
+}_rvc_agg_window_s;
 
 /**
-* This function will be called when the cliff value of the rvc is changed.
+* This struct has the windowed aggregation of the telemetry.
+* The callbacks feed every window, a window is sent to its subscribers when it ends.
 */
-static void
-rvc_cliff_callback(unsigned char cliff_left, unsigned char cliff_center, unsigned char cliff_right, void* data)
-{
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+typedef struct{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int run;
+	int kick;
 
-	if(instance == NULL){
-		return;
-	}
+	_rvc_agg_window_s windows[RVC_AGG_MAX_WINDOWS];
+	int count;
 
-	instance->tx_data.cliff_left = cliff_left;
-	instance->tx_data.cliff_center = cliff_center;
-	instance->tx_data.cliff_right = cliff_right;
+	int has_pose;
+	float pose_x;
+	float pose_y;
+	float pose_q;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_cliff_callback = %d, %d, %d", cliff_left, cliff_center, cliff_right);
-}
+	unsigned int sent;
+}_rvc_agg_s;
 
 /**
-* This function will be called when the lift value of the rvc is changed.
+* This struct is a command waiting for the control thread, it is on the stack of the caller.
 */
-static void
-rvc_lift_callback(unsigned char lift_left, unsigned char lift_right, void* data)
-{
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+typedef struct{
+	const _rvc_cmd_s* cmd;
+	int result;
+	int done;
+	long long queued_us;
+}_rvc_ctl_req_s;
 
-	if(instance == NULL){
-		return;
-	}
+/**
+* This struct has the control thread, which executes the commands of every client
+* on the real time priority.
+*/
+typedef struct{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* a command is queued */
+	pthread_cond_t done;		/* a command is executed */
+	pthread_t thread;
+	int run;
 
-	instance->tx_data.lift_left = lift_left;
-	instance->tx_data.lift_right = lift_right;
+	_rvc_ctl_req_s* queue[RVC_CTL_QUEUE_LEN];
+	int head;
+	int count;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_lift_callback = %d, %d", lift_left, lift_right);
-}
+	int priority;
+	int cpu;
+	int rt;				/* the real time priority is in effect */
+
+	unsigned int cmds;
+	unsigned int hist[RVC_CTL_HIST_BUCKETS];
+	long long latency_max_us;
+}_rvc_ctl_s;
 
 /**
-* This function will be called when the magnetic sensor level of the rvc is changed.
+* This struct is a message for the log thread.
 */
-static void
-rvc_magnet_callback(unsigned char magnet, void* data)
-{
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+typedef struct{
+	log_priority prio;
+	char text[RVC_LOG_SIZE];
+}_rvc_log_entry_s;
 
-	if(instance == NULL){
-		return;
-	}
+/**
+* This struct has the messages which are written to dlog by the log thread,
+* so that the control path does not wait for the log daemon.
+*/
+typedef struct{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int run;
 
-	instance->tx_data.magnet =  magnet;
+	_rvc_log_entry_s ring[RVC_LOG_RING];
+	int head;
+	int count;
+	unsigned int dropped;
+}_rvc_log_s;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_magnet_callback = %d", magnet);
-}
+static _rvc_log_s rvc_logger = {PTHREAD_MUTEX_INITIALIZER,};
 
 /**
-* This function will be called when the suction level of the rvc is changed.
+* This struct has the state sent in a state frame and the ts of the frame.
 */
-static void
-rvc_suction_callback(rvc_suction_state_e state, void* data)
-{
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+typedef struct{
+	long long ts;
+	_rvc_tx_s tx;
+}_rvc_snapshot_s;
 
-	if(instance == NULL){
-		return;
-	}
+/**
+* This struct has instance information of application.
+*/
+struct _rvc_instance{
+	_rvc_tx_s tx_data;
 
-	instance->tx_data.suction = (unsigned char)state;
+	int server_socket;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_suction_callback = %d", state);
-}
+	pthread_t rx_thread;
+
+	int rx_run;
+
+	pthread_mutex_t client_lock;
+	_rvc_client_s clients[RVC_MAX_CLIENTS];
+	_rvc_session_s sessions[RVC_MAX_SESSIONS];
+
+	_rvc_pool_s pool;
+
+	pthread_mutex_t history_lock;
+	_rvc_snapshot_s history[RVC_STATE_HISTORY];
+	int history_head;
+	int history_count;
+
+	pthread_mutex_t mcast_lock;
+	int mcast_socket;
+	int mcast_run;
+	struct sockaddr_in mcast_addr;
+	unsigned int mcast_seq;
+
+	pthread_t init_thread;
+	_rvc_startup_s startup;
+
+	int local_socket;
+	int local_pipe[2];
+	int local_run;
+	pthread_t local_thread;
+	unsigned int local_cmds;
+
+	pthread_mutex_t tick_lock;
+	pthread_cond_t tick_cond;
+	pthread_t tick_thread;
+	int tick_run;
+	int tick_kick;
+	int tx_period_ms;
+	long long last_activity_ms;
+
+	unsigned int wakeups;
+	unsigned int wakeup_window_base;
+	long long wakeup_window_start;
+	unsigned int wakeups_per_min;
+
+	_rvc_path_s path;
+	_rvc_reflex_s reflex;
+	_rvc_nogo_s nogo;
+	_rvc_audio_s audio;
+	_rvc_agg_s agg;
+	_rvc_ctl_s ctl;
+
+#ifdef _DEVICE_TEST_
+	player_h player;
+	camera_h camera;
+#endif
+};
 
 /**
-* This function will be called when the battery level of the rvc is changed.
+* This struct is passed to the members of a received JSON object.
 */
-static void
-rvc_batt_callback(rvc_batt_level_e level, void* data){
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+typedef struct{
+	_rvc_client_s* client;
+	int has_id;
+	long long id;
+	int has_ts;
+	long long ts;		/* time the motion commands of the object were sent, in the clock of the client */
+	int ttl_ms;
+}_rvc_parse_ctx_s;
 
-	if(instance == NULL){
-		return;
-	}
+static void rvc_broadcast_event(_rvc_instance_s* instance, const char* format, ...);
+static void rvc_path_abort(_rvc_instance_s* instance, const char* reason);
 
-	instance->tx_data.battery = (unsigned char)level;
+/**
+* This function returns the monotonic time in ms.
+*/
+static long long
+rvc_get_time_ms(void)
+{
+	struct timespec ts = {0,};
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_batt_callback = %d", level);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /**
-* This function will be called when the voice type of the rvc is changed.
+* This function returns the monotonic time in us.
 */
-static void
-rvc_voice_callback(rvc_voice_type_e type, void* data)
+static long long
+rvc_get_time_us(void)
 {
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
-
-	if(instance == NULL){
-		return;
-	}
+	struct timespec ts = {0,};
 
-	instance->tx_data.voice = (unsigned char)type;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_voice_callback = %d", type);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /**
-* This function will be called when the rvc is the low battery condition.
+* This function waits on the condition for at most timeout_ms. The lock must be held.
 */
 static void
-rvc_batt_low_callback(void* data)
+rvc_cond_wait_ms(pthread_cond_t* cond, pthread_mutex_t* lock, int timeout_ms)
 {
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	struct timespec ts = {0,};
 
-	if(instance == NULL){
-		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if(ts.tv_nsec >= 1000000000){
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
 	}
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_batt_low_callback");
+	pthread_cond_timedwait(cond, lock, &ts);
 }
 
 /**
-* This function will be called when linear or angular velocity of the rvc is changed.
+* This function makes a mutex which lends the priority of a real time waiter to its holder.
 */
 static void
-rvc_lin_ang_callback(float lin, float ang, void* user_data)
+rvc_mutex_init_pi(pthread_mutex_t* lock)
 {
-	_rvc_instance_s* instance = (_rvc_instance_s*)user_data;
-
-	if(instance == NULL){
-		return;
-	}
-
-	instance->tx_data.lin_vel = lin;
-	instance->tx_data.ang_vel = ang;
+	pthread_mutexattr_t attr;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_lin_ang_callback = %f, %f", lin, ang);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(lock, &attr);
+	pthread_mutexattr_destroy(&attr);
 }
 
 /**
-* This function will be called when reservation state of the rvc is changed.
+* This function puts a thread of the control path on the real time priority and the cpu of the control path.
+* It returns false when the real time priority is off or not allowed, the thread has the default scheduling then.
 */
-static void
-rvc_reservation_callback(rvc_reserve_type_e reserve_type, unsigned char is_on, unsigned char reserve_hh, unsigned char reserve_mm, void* user_data)
+static bool
+rvc_thread_control(pthread_t thread, int priority, int cpu)
 {
-	_rvc_instance_s* instance = (_rvc_instance_s*)user_data;
+	struct sched_param param = {0,};
+	cpu_set_t set;
+	int ret = 0;
+	int i;
+
+	CPU_ZERO(&set);
+	if(cpu >= 0 && cpu < CPU_SETSIZE){
+		CPU_SET(cpu, &set);
+	}else{
+		for(i = 0; i < sysconf(_SC_NPROCESSORS_CONF) && i < CPU_SETSIZE; i++){
+			CPU_SET(i, &set);
+		}
+	}
 
-	if(instance == NULL){
-		return;
+	if(pthread_setaffinity_np(thread, sizeof(set), &set) != 0){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "cpu %d cannot be set", cpu);
 	}
 
-	if(reserve_type == RVC_RESERVE_TYPE_ONCE){
-		instance->tx_data.once_on = is_on;
-		instance->tx_data.once_hour = reserve_hh;
-		instance->tx_data.once_minute = reserve_mm;
-	}else{
-		instance->tx_data.daily_on = is_on;
-		instance->tx_data.daily_hour = reserve_hh;
-		instance->tx_data.daily_minute = reserve_mm;
+	param.sched_priority = priority > 0 ? priority : 0;
+	ret = pthread_setschedparam(thread, priority > 0 ? SCHED_FIFO : SCHED_OTHER, &param);
+
+	if(ret != 0){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "SCHED_FIFO %d is not allowed, ret = %d", priority, ret);
+		return false;
 	}
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_reservation_callback = %d, %d, %d, %d", reserve_type, is_on, reserve_hh, reserve_mm);
+	return priority > 0;
 }
 
 /**
-* This function registers handler which handles the rvc event.
+* This function lowers the priority of the calling thread.
+* It is called by the media, logging and telemetry threads, which must not delay the control path.
 */
 static void
-rvc_register_callback(_rvc_instance_s* instance)
+rvc_thread_background(void)
 {
-	if(instance == NULL){
-		return;
-	}
-
-	rvc_set_mode_evt_cb(rvc_mode_callback, instance);
-	rvc_set_error_evt_cb(rvc_error_callback, instance);
-	rvc_set_wheel_vel_evt_cb(rvc_wheel_callback, instance);
-	rvc_set_pose_evt_cb(rvc_pose_callback, instance);
-	rvc_set_bumper_evt_cb(rvc_bumper_callback, instance);
-	rvc_set_cliff_evt_cb(rvc_cliff_callback, instance);
-	rvc_set_lift_evt_cb(rvc_lift_callback, instance);
-	rvc_set_magnet_evt_cb(rvc_magnet_callback, instance);
-	rvc_set_suction_evt_cb(rvc_suction_callback, instance);
-	rvc_set_batt_evt_cb(rvc_batt_callback, instance);
-	rvc_set_voice_evt_cb(rvc_voice_callback, instance);
-	rvc_set_batt_low_evt_cb(rvc_batt_low_callback, instance);
-	rvc_set_lin_ang_evt_cb(rvc_lin_ang_callback, instance);
-	rvc_set_reservation_evt_cb(rvc_reservation_callback, instance);
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), RVC_BACKGROUND_NICE);
 }
 
 /**
-* This function is to get the robot information.
+* This function hands a message to the log thread. The message is dropped when the ring is full,
+* the caller is never blocked by the log daemon. It is written at once while the log thread is not running.
 */
 static void
-get_rvc_info(_rvc_instance_s* instance)
+rvc_log(log_priority prio, const char* format, ...)
 {
-	if(instance == NULL){
+	_rvc_log_s* log = &rvc_logger;
+	_rvc_log_entry_s* entry = NULL;
+	va_list args;
+
+	va_start(args, format);
+
+	pthread_mutex_lock(&log->lock);
+
+	if(log->run == false){
+		pthread_mutex_unlock(&log->lock);
+		dlog_vprint(prio, LOG_TAG, format, args);
+		va_end(args);
 		return;
 	}
 
-	rvc_get_mode((rvc_mode_type_get_e*)&instance->tx_data.mode);
-	rvc_get_error((rvc_device_error_type_e*)&instance->tx_data.error);
-	rvc_get_wheel_vel((signed short*)&instance->tx_data.wheel_vel_left, (signed short*)&instance->tx_data.wheel_vel_right);
-	rvc_get_bumper((unsigned char*)&instance->tx_data.bumper_left, (unsigned char*)&instance->tx_data.bumper_right);
-	rvc_get_pose(&instance->tx_data.pose_x, &instance->tx_data.pose_y, &instance->tx_data.pose_q);
-	rvc_get_cliff((unsigned char*)&instance->tx_data.cliff_left, (unsigned char*)&instance->tx_data.cliff_center, (unsigned char*)&instance->tx_data.cliff_right);
-	rvc_get_lift((unsigned char*)&instance->tx_data.lift_left, (unsigned char*)&instance->tx_data.lift_right);
-	rvc_get_magnet((unsigned char*)&instance->tx_data.magnet);
-	rvc_get_suction_state((rvc_suction_state_e *)&instance->tx_data.suction);
-	rvc_get_reserve(RVC_RESERVE_TYPE_ONCE, (unsigned char*)&instance->tx_data.once_on, (unsigned char*)&instance->tx_data.once_hour, (unsigned char*)&instance->tx_data.once_minute);
-	rvc_get_reserve(RVC_RESERVE_TYPE_DAILY, (unsigned char*)&instance->tx_data.daily_on, (unsigned char*)&instance->tx_data.daily_hour, (unsigned char*)&instance->tx_data.daily_minute);
-	rvc_get_lin_ang_vel(&instance->tx_data.lin_vel, &instance->tx_data.ang_vel);
-	rvc_get_battery_level((rvc_batt_level_e*)&instance->tx_data.battery);
-	rvc_get_voice_type((rvc_voice_type_e*)&instance->tx_data.voice);
+	if(log->count == RVC_LOG_RING){
+		log->dropped++;
+	}else{
+		entry = &log->ring[(log->head + log->count) % RVC_LOG_RING];
+		entry->prio = prio;
+		vsnprintf(entry->text, RVC_LOG_SIZE, format, args);
+		log->count++;
+		pthread_cond_signal(&log->cond);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	va_end(args);
 }
 
 /**
-* This function transmits the robot information to a mobile.
+* This function writes the queued messages to dlog on a low priority.
 */
 static void*
-tx_thread_run(void *data)
+log_thread_run(void *data)
 {
-	_rvc_instance_s* instance = (_rvc_instance_s*)data;
-    char msg[RVC_JSON_SIZE+1] = {0,};
-    struct timeval tv = {0,};
-    _rvc_tx_s* tx = &instance->tx_data;
-
-	if(instance == NULL){
-		service_app_exit();
-		return NULL;
-	}
+	_rvc_log_s* log = (_rvc_log_s*)data;
+	_rvc_log_entry_s entry;
 
-    memset(&tv, 0, sizeof(struct timeval));
+	rvc_thread_background();
 
-    tv.tv_sec = 5;
+	pthread_mutex_lock(&log->lock);
 
-    setsockopt(instance->client_socket, SOL_SOCKET, SO_SNDTIMEO, (struct timeval *)&tv, sizeof(struct timeval));
-
-	while(instance->tx_run){
-		if(instance->client_socket == 0){
-			break;
+	//the messages queued before the stop are written as well
+	while(log->run || log->count > 0){
+		if(log->count == 0){
+			pthread_cond_wait(&log->cond, &log->lock);
+			continue;
 		}
 
-		memset(msg, 0, RVC_JSON_SIZE+1);
-		snprintf(msg, RVC_JSON_SIZE, rvc_json_object \
-				,tx->mode \
-				,tx->error \
-				,tx->magnet \
-				,tx->suction \
-				,tx->battery \
-				,tx->voice \
-				,tx->once_on, tx->once_hour, tx->once_minute \
-				,tx->daily_on, tx->daily_hour, tx->daily_minute \
-				,tx->wheel_vel_left, tx->wheel_vel_right \
-				,tx->pose_x, tx->pose_y, tx->pose_q \
-				,tx->bumper_left, tx->bumper_right \
-				,tx->cliff_left, tx->cliff_center, tx->cliff_right \
-				,tx->lift_left, tx->lift_right \
-				,tx->lin_vel, tx->ang_vel \
-				);
-
-		if(write(instance->client_socket , (char*)msg , RVC_JSON_SIZE) == -1){
-		    close(instance->client_socket);
-			instance->client_socket = 0;
-			break;
-		}else{
-			dlog_print(DLOG_DEBUG, LOG_TAG, "msg = %s", msg);
-			usleep(500 * 1000);
-		}
-/*
-		float x, y, q;
+		entry = log->ring[log->head];
+		log->head = (log->head + 1) % RVC_LOG_RING;
+		log->count--;
 
-		msg_data mq_msg;
-		rvc_get_pose(&x, &y, &q);
-		mq_msg.data_type = 1;
-		mq_msg.data_num = 200;
-		sprintf(mq_msg.data_buff, "pose = (%f, %f, %f)", x, y, q);
-		if (-1 == msgsnd(mqid, &mq_msg, sizeof(msg_data) - sizeof(long), 0)) {
-			perror("msgsnd() failed.");
-		}
-		*/
+		pthread_mutex_unlock(&log->lock);
+		dlog_print(entry.prio, LOG_TAG, "%s", entry.text);
+		pthread_mutex_lock(&log->lock);
 	}
 
-	instance->tx_run = false;
-    return NULL;
+	pthread_mutex_unlock(&log->lock);
+
+	return NULL;
 }
 
-static void wav_play_completed (int id, void *user_data) {
-	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: wav play done");
+/**
+* This function starts the log thread.
+*/
+static void
+start_log(void)
+{
+	_rvc_log_s* log = &rvc_logger;
+
+	rvc_mutex_init_pi(&log->lock);
+	pthread_cond_init(&log->cond, NULL);
+
+	log->run = true;
+
+	if(pthread_create(&log->thread, NULL, log_thread_run, (void*)log) != 0){
+		log->run = false;
+		dlog_print(DLOG_DEBUG, LOG_TAG, "log_thread is failed!");
+	}
 }
 
-static  void download_cb (int download_id, download_state_e state, void *user_data) {
-	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG DOWNLOAD:%d", state);
-	if (state != DOWNLOAD_STATE_COMPLETED) {
+/**
+* This function stops the log thread, the later messages are written at once.
+*/
+static void
+stop_log(void)
+{
+	_rvc_log_s* log = &rvc_logger;
+
+	if(log->run == false){
 		return;
 	}
-	int wav_id;
-	int res = wav_player_start("/tmp/voice.wav", SOUND_TYPE_MEDIA, wav_play_completed, NULL, &wav_id);
-	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: wav_id %d, res %d", wav_id, res);
-}
 
-static void progress_cb(int download_id, unsigned long long received, void *user_data) {
-	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG DOWNLOAD PROG:%f", received/1000.0);
+	pthread_mutex_lock(&log->lock);
+	log->run = false;
+	pthread_cond_signal(&log->cond);
+	pthread_mutex_unlock(&log->lock);
+
+	pthread_join(log->thread, NULL);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "log: %u messages dropped", log->dropped);
 }
 
-typedef struct {
-	char *language;
-	int voice_type;
-} tts_voice_s;
+/**
+* This function counts a wakeup of the telemetry threads.
+*/
+static void
+rvc_count_wakeup(_rvc_instance_s* instance)
+{
+	__sync_fetch_and_add(&instance->wakeups, 1);
+}
 
-typedef struct {
-	char *text;
-	int utt_id;
-} tts_text_s;
+/**
+* This function brings the next telemetry tick forward, it is called on a state change.
+*/
+static void
+rvc_tx_kick(_rvc_instance_s* instance)
+{
+	if(instance->tick_run == false){
+		return;
+	}
 
-static tts_h g_tts;
-static GList *g_tts_voice_list = NULL;
-static tts_voice_s *g_current_voice = NULL;
-static tts_state_e g_current_state;
-static GList *g_tts_text_list = NULL;
+	pthread_mutex_lock(&instance->tick_lock);
+	instance->tick_kick = true;
+	pthread_cond_signal(&instance->tick_cond);
+	pthread_mutex_unlock(&instance->tick_lock);
+}
 
+/**
+* This function records a command of a user. An idle tick thread is woken up,
+* it would sleep up to RVC_TX_PERIOD_IDLE_MS before it takes the active rate.
+*/
 static void
-__tts_state_changed_cb(tts_h tts, tts_state_e previous, tts_state_e current, void* user_data)
+rvc_tx_activity(_rvc_instance_s* instance)
 {
-	dlog_print(DLOG_DEBUG, LOG_TAG, "== State is changed (%d) to (%d)", previous, current);
-	if (TTS_STATE_CREATED == previous && TTS_STATE_READY == current) {
+	long long now = rvc_get_time_ms();
+	long long last = instance->last_activity_ms;
+
+	instance->last_activity_ms = now;
 
+	if(now - last >= RVC_TX_ACTIVE_MS){
+		rvc_tx_kick(instance);
 	}
-	g_current_state = current;
 }
 
-static void
-__tts_utterance_completed_cb(tts_h tts, int utt_id, void* user_data)
+/**
+* This function checks whether the rvc is moving or about to move.
+*/
+static bool
+rvc_is_moving(_rvc_instance_s* instance)
 {
+	_rvc_tx_s* tx = &instance->tx_data;
 
+	return tx->wheel_vel_left != 0 || tx->wheel_vel_right != 0 || tx->lin_vel != 0 || tx->ang_vel != 0
+			|| instance->path.run || instance->reflex.backoff_until != 0;
 }
 
-static void __supported_voice (tts_h tts, const char *language, int voice_type, void *user_data) {
-	dlog_print(DLOG_DEBUG, LOG_TAG, "Lang support: %s, type: %d", language, voice_type);
+/**
+* This function checks whether motion commands are allowed. The reflex lock must be held.
+*/
+static bool
+rvc_reflex_allows_motion(_rvc_reflex_s* reflex)
+{
+	if(reflex->enable == false){
+		return true;
+	}
+
+	return reflex->halted == 0 && reflex->backoff_until == 0 && rvc_get_time_ms() >= reflex->hold_until;
 }
 
-static int
-init_tts(void *ad)
+/**
+* This function runs the reflex of the trigger on the callback path.
+* It is called with the previous and the new sensor value.
+*/
+static void
+rvc_reflex_update(_rvc_instance_s* instance, rvc_reflex_trigger_e trigger, int prev, int value)
 {
-	if (0 != tts_create(&g_tts)) {
-		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to tts create");
-		return -1;
+	_rvc_reflex_s* reflex = &instance->reflex;
+	_rvc_reflex_rule_s* rule = &reflex->rules[trigger];
+	long long start = rvc_get_time_us();
+	long long latency = 0;
+	long long now = 0;
+
+	if(reflex->enable == false || rule->action == RVC_REFLEX_NONE){
+		return;
 	}
 
-	if (0 != tts_set_state_changed_cb(g_tts, __tts_state_changed_cb, ad)) {
-		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to set state changed cb");
-		tts_destroy(g_tts);
-		return -1;
+	pthread_mutex_lock(&reflex->lock);
+
+	if(value == 0){
+		//the halt is released when the trigger is cleared
+		reflex->halted &= ~(1 << trigger);
+		pthread_mutex_unlock(&reflex->lock);
+		return;
 	}
 
-	if (0 != tts_set_utterance_completed_cb(g_tts, __tts_utterance_completed_cb, ad)) {
-		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to set utt completed cb");
-		tts_destroy(g_tts);
-		return -1;
+	if(prev != 0){
+		pthread_mutex_unlock(&reflex->lock);
+		return;
 	}
 
-	char *language = NULL;
-	int voice_type;
+	now = rvc_get_time_ms();
+
+	switch(rule->action){
+	case RVC_REFLEX_BACKOFF:
+		rvc_set_lin_ang(-RVC_REFLEX_BACKOFF_SPEED, 0);
+		reflex->backoff_until = now + (long long)(rule->distance / RVC_REFLEX_BACKOFF_SPEED * 1000);
+		reflex->hold_until = reflex->backoff_until + RVC_REFLEX_HOLD_MS;
+		pthread_cond_signal(&reflex->cond);
+		break;
+	case RVC_REFLEX_HALT:
+		rvc_set_lin_ang(0, 0);
+		reflex->halted |= (1 << trigger);
+		break;
+	default:
+		rvc_set_lin_ang(0, 0);
+		reflex->hold_until = now + RVC_REFLEX_HOLD_MS;
+		break;
+	}
 
+	latency = rvc_get_time_us() - start;
 
-	tts_foreach_supported_voices (g_tts, __supported_voice, NULL);
-	if (0 != tts_get_default_voice(g_tts, &language, &voice_type)) {
-		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to get default voice");
-		tts_destroy(g_tts);
-		return -1;
+	reflex->fired++;
+	reflex->latency_last_us = latency;
+	reflex->latency_sum_us += latency;
+	if(latency > reflex->latency_max_us){
+		reflex->latency_max_us = latency;
 	}
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "language: %s", language);
-	free(language);
-	language = "ko_KR";
-	if (NULL != language) {
-		g_current_voice = (tts_voice_s *)calloc(1, sizeof(tts_voice_s));
-		if (NULL == g_current_voice) {
-			dlog_print(DLOG_ERROR, LOG_TAG, "Fail to memory allocation");
-		} else {
-			g_current_voice->language = strdup(language);
-			g_current_voice->voice_type = voice_type;
+	pthread_mutex_unlock(&reflex->lock);
+
+	rvc_path_abort(instance, "reflex");
+
+	rvc_broadcast_event(instance, rvc_reflex_event_object, rvc_reflex_trigger_names[trigger],
+			rvc_reflex_action_names[rule->action], latency);
+}
+
+/**
+* This function ends the backoff motion of the reflexes and the motion of a silent client in time.
+*/
+static void*
+reflex_thread_run(void *data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	_rvc_reflex_s* reflex = &instance->reflex;
+	long long now = 0;
+	long long wake = 0;
+	int idle_ms = 0;
+
+	pthread_mutex_lock(&reflex->lock);
+
+	while(reflex->run){
+		now = rvc_get_time_ms();
+
+		if(reflex->backoff_until != 0 && now >= reflex->backoff_until){
+			rvc_set_lin_ang(0, 0);
+			reflex->backoff_until = 0;
+		}
+
+		//no fresh motion command has come in time, the client may be gone
+		if(reflex->watchdog_until != 0 && now >= reflex->watchdog_until){
+			rvc_set_lin_ang(0, 0);
+			idle_ms = (int)(now - reflex->watchdog_until) + reflex->watchdog_ms;
+			reflex->watchdog_until = 0;
+			reflex->watchdog_owner = NULL;
+			reflex->watchdog_stops++;
+
+			pthread_mutex_unlock(&reflex->lock);
+			rvc_broadcast_event(instance, rvc_watchdog_event_object, idle_ms, rvc_get_time_us());
+			pthread_mutex_lock(&reflex->lock);
+			continue;
+		}
+
+		wake = reflex->backoff_until;
+		if(reflex->watchdog_until != 0 && (wake == 0 || reflex->watchdog_until < wake)){
+			wake = reflex->watchdog_until;
+		}
+
+		if(wake != 0){
+			rvc_cond_wait_ms(&reflex->cond, &reflex->lock, (int)(wake - now));
+		}else{
+			pthread_cond_wait(&reflex->cond, &reflex->lock);
 		}
 	}
 
-	if (0 != tts_prepare(g_tts)) {
-		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to tts prepare");
-		tts_destroy(g_tts);
-		return -1;
+	pthread_mutex_unlock(&reflex->lock);
+
+	return NULL;
+}
+
+/**
+* This function sets the default rules and starts the reflex thread.
+*/
+static void
+start_reflex(_rvc_instance_s* instance)
+{
+	_rvc_reflex_s* reflex = &instance->reflex;
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
+
+	//the hal may call back on the thread which is setting the motion
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&reflex->lock, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&reflex->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	reflex->rules[RVC_REFLEX_BUMPER_LEFT].action = RVC_REFLEX_BACKOFF;
+	reflex->rules[RVC_REFLEX_BUMPER_LEFT].distance = RVC_REFLEX_BUMPER_BACKOFF;
+	reflex->rules[RVC_REFLEX_BUMPER_RIGHT].action = RVC_REFLEX_BACKOFF;
+	reflex->rules[RVC_REFLEX_BUMPER_RIGHT].distance = RVC_REFLEX_BUMPER_BACKOFF;
+	reflex->rules[RVC_REFLEX_CLIFF_LEFT].action = RVC_REFLEX_BACKOFF;
+	reflex->rules[RVC_REFLEX_CLIFF_LEFT].distance = RVC_REFLEX_CLIFF_BACKOFF;
+	reflex->rules[RVC_REFLEX_CLIFF_CENTER].action = RVC_REFLEX_BACKOFF;
+	reflex->rules[RVC_REFLEX_CLIFF_CENTER].distance = RVC_REFLEX_CLIFF_BACKOFF;
+	reflex->rules[RVC_REFLEX_CLIFF_RIGHT].action = RVC_REFLEX_BACKOFF;
+	reflex->rules[RVC_REFLEX_CLIFF_RIGHT].distance = RVC_REFLEX_CLIFF_BACKOFF;
+	reflex->rules[RVC_REFLEX_LIFT_LEFT].action = RVC_REFLEX_HALT;
+	reflex->rules[RVC_REFLEX_LIFT_RIGHT].action = RVC_REFLEX_HALT;
+
+	reflex->enable = true;
+	reflex->run = true;
+
+	if(pthread_create(&reflex->thread, NULL, reflex_thread_run, (void*)instance) != 0){
+		reflex->run = false;
+		dlog_print(DLOG_DEBUG, LOG_TAG, "reflex_thread is failed!");
+	}else{
+		rvc_thread_control(reflex->thread, instance->ctl.priority, instance->ctl.cpu);
 	}
+}
 
-	return 0;
+/**
+* This function stops the reflex thread.
+*/
+static void
+stop_reflex(_rvc_instance_s* instance)
+{
+	_rvc_reflex_s* reflex = &instance->reflex;
+
+	if(reflex->run == false){
+		return;
+	}
+
+	pthread_mutex_lock(&reflex->lock);
+	reflex->run = false;
+	pthread_cond_signal(&reflex->cond);
+	pthread_mutex_unlock(&reflex->lock);
+
+	pthread_join(reflex->thread, NULL);
 }
 
+/**
+* This function frees a no-go index.
+*/
 static void
-deinit_tts(void *ad)
+rvc_nogo_free(_rvc_nogo_index_s* index)
 {
-   // Destroy TTS handle (service disconnect is included)
-   if (0 != tts_destroy(g_tts))
-   {
-      // Do something
-   }
+	if(index == NULL){
+		return;
+	}
+
+	free(index->shapes);
+	free(index->edges);
+	free(index->edge_start);
+	free(index->edge_items);
+	free(index->zone_start);
+	free(index->zone_items);
+	free(index);
 }
 
+/**
+* This function clamps a coordinate to a column or a row of the grid.
+*/
+static int
+rvc_nogo_cell(float v, float origin, float cell, int max)
+{
+	int i = (int)floorf((v - origin) / cell);
+
+	return i < 0 ? 0 : (i >= max ? max - 1 : i);
+}
+
+/**
+* This function puts an item in every cell its box overlaps.
+* With items NULL the items of the cells are only counted.
+*/
 static void
-__tts_add_text(const char* text, const char* lang)
+rvc_nogo_grid_put(_rvc_nogo_index_s* index, int* start, int* items, int* fill,
+		float x0, float y0, float x1, float y1, int item)
 {
-	if (NULL != text) {
-		dlog_print(DLOG_DEBUG, LOG_TAG, "Add text (%s)", text);
-		int utt_id;
-		if (NULL != g_current_voice) {
-			if (NULL != g_current_voice->language) {
-				if (0 != tts_add_text(g_tts, text, lang, g_current_voice->voice_type, TTS_SPEED_AUTO, &utt_id)) {
-					dlog_print(DLOG_DEBUG, LOG_TAG, "Fail to add text");
-				} else {
-					tts_text_s *tmp = (tts_text_s *)calloc(1, sizeof(tts_text_s));
-					if (NULL == tmp) {
-						dlog_print(DLOG_ERROR, LOG_TAG, "Fail to memory allocation");
-					} else {
-						tmp->text = strdup(text);
-						tmp->utt_id = utt_id;
-						g_tts_text_list = g_list_append(g_tts_text_list, tmp);
-					}
+	int c0 = rvc_nogo_cell(x0, index->origin_x, index->cell, index->cols);
+	int r0 = rvc_nogo_cell(y0, index->origin_y, index->cell, index->rows);
+	int c1 = rvc_nogo_cell(x1, index->origin_x, index->cell, index->cols);
+	int r1 = rvc_nogo_cell(y1, index->origin_y, index->cell, index->rows);
+	int c, r, cell;
+
+	for(r = r0; r <= r1; r++){
+		for(c = c0; c <= c1; c++){
+			cell = r * index->cols + c;
+
+			if(items == NULL){
+				start[cell + 1]++;
+			}else{
+				items[start[cell] + fill[cell]++] = item;
+			}
+		}
+	}
+}
+
+/**
+* This function reads a zone or a wall of a nogo command into the index.
+* A zone is a closed polygon and a wall is an open polyline.
+* A point which is not finite or is out of the range of the pose fails the shape, the grid could not be sized for it.
+*/
+static bool
+rvc_nogo_add_shape(_rvc_nogo_index_s* index, JsonObject* obj, int wall, int id)
+{
+	_rvc_nogo_shape_s* shape = &index->shapes[index->shape_count];
+	_rvc_nogo_edge_s* edges = &index->edges[index->edge_count];
+	JsonArray* points = NULL;
+	JsonObject* point = NULL;
+	int count = 0;
+	double x, y;
+	int i;
+
+	if(obj == NULL){
+		return false;
+	}
+
+	points = json_object_has_member(obj, "points") ? json_object_get_array_member(obj, "points") : NULL;
+	count = points ? (int)json_array_get_length(points) : 0;
+
+	shape->id = json_object_has_member(obj, "id") ? (int)json_object_get_int_member(obj, "id") : id;
+	shape->wall = wall;
+	shape->first = index->edge_count;
+	shape->count = wall ? count - 1 : count;
+
+	//a zone needs three points, a wall two
+	if(count < 3 - wall || index->edge_count + count > RVC_NOGO_MAX_EDGES){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "nogo: invalid %s %d", wall ? "wall" : "zone", shape->id);
+		return false;
+	}
+
+	for(i = 0; i < count; i++){
+		point = json_array_get_object_element(points, i);
+		if(point == NULL || json_object_has_member(point, "x") == false || json_object_has_member(point, "y") == false){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "nogo: invalid point %d of %s %d", i, wall ? "wall" : "zone", shape->id);
+			return false;
+		}
+
+		x = json_object_get_double_member(point, "x");
+		y = json_object_get_double_member(point, "y");
+		if(isfinite(x) == false || isfinite(y) == false || fabs(x) > RVC_STATE_POS_MAX || fabs(y) > RVC_STATE_POS_MAX){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "nogo: invalid point %d of %s %d", i, wall ? "wall" : "zone", shape->id);
+			return false;
+		}
+
+		edges[i].shape = index->shape_count;
+		edges[i].a.x = (float)x;
+		edges[i].a.y = (float)y;
+
+		if(i == 0){
+			shape->min_x = shape->max_x = edges[i].a.x;
+			shape->min_y = shape->max_y = edges[i].a.y;
+		}
+
+		shape->min_x = fminf(shape->min_x, edges[i].a.x);
+		shape->min_y = fminf(shape->min_y, edges[i].a.y);
+		shape->max_x = fmaxf(shape->max_x, edges[i].a.x);
+		shape->max_y = fmaxf(shape->max_y, edges[i].a.y);
+	}
+
+	//the end of an edge is the start of the next one, the last edge of a zone closes it
+	for(i = 0; i < shape->count; i++){
+		edges[i].b = edges[(i + 1) % count].a;
+	}
+
+	index->edge_count += shape->count;
+	index->shape_count++;
+
+	if(wall){
+		index->walls++;
+	}else{
+		index->zones++;
+	}
+
+	return true;
+}
+
+/**
+* This function builds a no-go index from the zones and walls of a nogo command.
+* The edges and the zones are put in a uniform grid, a lookup only tests the items of a few cells.
+*/
+static _rvc_nogo_index_s*
+rvc_nogo_build(JsonArray* zones, JsonArray* walls)
+{
+	_rvc_nogo_index_s* index = NULL;
+	_rvc_nogo_shape_s* shape = NULL;
+	_rvc_nogo_edge_s* edge = NULL;
+	int zone_count = zones ? (int)json_array_get_length(zones) : 0;
+	int wall_count = walls ? (int)json_array_get_length(walls) : 0;
+	int* edge_fill = NULL;
+	int* zone_fill = NULL;
+	float min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+	int cells = 0;
+	int pass, i;
+
+	if(zone_count + wall_count > RVC_NOGO_MAX_SHAPES){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "nogo: too many shapes %d", zone_count + wall_count);
+		return NULL;
+	}
+
+	index = (_rvc_nogo_index_s*)calloc(1, sizeof(_rvc_nogo_index_s));
+	if(index == NULL){
+		return NULL;
+	}
+
+	index->shapes = (_rvc_nogo_shape_s*)calloc(zone_count + wall_count + 1, sizeof(_rvc_nogo_shape_s));
+	index->edges = (_rvc_nogo_edge_s*)calloc(RVC_NOGO_MAX_EDGES, sizeof(_rvc_nogo_edge_s));
+	if(index->shapes == NULL || index->edges == NULL){
+		rvc_nogo_free(index);
+		return NULL;
+	}
+
+	for(i = 0; i < zone_count + wall_count; i++){
+		if(rvc_nogo_add_shape(index, json_array_get_object_element(i < zone_count ? zones : walls, i < zone_count ? i : i - zone_count),
+				i >= zone_count, i < zone_count ? i : i - zone_count) == false){
+			rvc_nogo_free(index);
+			return NULL;
+		}
+	}
+
+	for(i = 0; i < index->shape_count; i++){
+		shape = &index->shapes[i];
+
+		if(i == 0){
+			min_x = shape->min_x;
+			min_y = shape->min_y;
+			max_x = shape->max_x;
+			max_y = shape->max_y;
+		}
+
+		min_x = fminf(min_x, shape->min_x);
+		min_y = fminf(min_y, shape->min_y);
+		max_x = fmaxf(max_x, shape->max_x);
+		max_y = fmaxf(max_y, shape->max_y);
+	}
+
+	//the cells are made larger until the grid fits
+	index->origin_x = min_x;
+	index->origin_y = min_y;
+	index->cell = RVC_NOGO_CELL;
+
+	while(true){
+		index->cols = (int)((max_x - min_x) / index->cell) + 1;
+		index->rows = (int)((max_y - min_y) / index->cell) + 1;
+
+		if((long long)index->cols * index->rows <= RVC_NOGO_MAX_CELLS){
+			break;
+		}
+		index->cell *= 2;
+	}
+
+	cells = index->cols * index->rows;
+
+	index->edge_start = (int*)calloc(cells + 1, sizeof(int));
+	index->zone_start = (int*)calloc(cells + 1, sizeof(int));
+	edge_fill = (int*)calloc(cells, sizeof(int));
+	zone_fill = (int*)calloc(cells, sizeof(int));
+
+	//the first pass counts the items of each cell, the second one fills them in
+	for(pass = 0; pass < 2 && index->edge_start && index->zone_start && edge_fill && zone_fill; pass++){
+		for(i = 0; i < index->edge_count; i++){
+			edge = &index->edges[i];
+			rvc_nogo_grid_put(index, index->edge_start, index->edge_items, edge_fill, fminf(edge->a.x, edge->b.x),
+					fminf(edge->a.y, edge->b.y), fmaxf(edge->a.x, edge->b.x), fmaxf(edge->a.y, edge->b.y), i);
+		}
+
+		//walls have no inside, only zones are looked up by point
+		for(i = 0; i < index->shape_count; i++){
+			shape = &index->shapes[i];
+			if(shape->wall == false){
+				rvc_nogo_grid_put(index, index->zone_start, index->zone_items, zone_fill,
+						shape->min_x, shape->min_y, shape->max_x, shape->max_y, i);
+			}
+		}
+
+		if(pass == 0){
+			for(i = 0; i < cells; i++){
+				index->edge_start[i + 1] += index->edge_start[i];
+				index->zone_start[i + 1] += index->zone_start[i];
+			}
+
+			index->edge_items = (int*)malloc((index->edge_start[cells] + 1) * sizeof(int));
+			index->zone_items = (int*)malloc((index->zone_start[cells] + 1) * sizeof(int));
+			if(index->edge_items == NULL || index->zone_items == NULL){
+				break;
+			}
+		}
+	}
+
+	free(edge_fill);
+	free(zone_fill);
+
+	if(pass != 2){
+		rvc_nogo_free(index);
+		return NULL;
+	}
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "nogo: %d zones, %d walls, %d edges, %dx%d cells of %f m",
+			index->zones, index->walls, index->edge_count, index->cols, index->rows, index->cell);
+
+	return index;
+}
+
+/**
+* This function finds the zone the point is in. It returns the shape, or -1.
+*/
+static int
+rvc_nogo_zone_at(const _rvc_nogo_index_s* index, float x, float y)
+{
+	const _rvc_nogo_shape_s* shape = NULL;
+	const _rvc_nogo_edge_s* edge = NULL;
+	int cell = 0;
+	int inside = 0;
+	int i, j;
+
+	if(x < index->origin_x || y < index->origin_y
+			|| x >= index->origin_x + index->cols * index->cell || y >= index->origin_y + index->rows * index->cell){
+		return -1;
+	}
+
+	cell = rvc_nogo_cell(y, index->origin_y, index->cell, index->rows) * index->cols
+			+ rvc_nogo_cell(x, index->origin_x, index->cell, index->cols);
+
+	for(i = index->zone_start[cell]; i < index->zone_start[cell + 1]; i++){
+		shape = &index->shapes[index->zone_items[i]];
+
+		if(x < shape->min_x || x > shape->max_x || y < shape->min_y || y > shape->max_y){
+			continue;
+		}
+
+		//crossings of a ray to +x
+		inside = 0;
+		for(j = shape->first; j < shape->first + shape->count; j++){
+			edge = &index->edges[j];
+			if((edge->a.y > y) != (edge->b.y > y)
+					&& x < edge->a.x + (y - edge->a.y) * (edge->b.x - edge->a.x) / (edge->b.y - edge->a.y)){
+				inside = !inside;
+			}
+		}
+
+		if(inside){
+			return index->zone_items[i];
+		}
+	}
+
+	return -1;
+}
+
+/**
+* This function checks whether the segments a-b and c-d cross.
+*/
+static bool
+rvc_nogo_segments_cross(_rvc_point_s a, _rvc_point_s b, _rvc_point_s c, _rvc_point_s d)
+{
+	float d1 = (d.x - c.x) * (a.y - c.y) - (d.y - c.y) * (a.x - c.x);
+	float d2 = (d.x - c.x) * (b.y - c.y) - (d.y - c.y) * (b.x - c.x);
+	float d3 = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+	float d4 = (b.x - a.x) * (d.y - a.y) - (b.y - a.y) * (d.x - a.x);
+
+	return ((d1 > 0) != (d2 > 0) || d1 == 0 || d2 == 0) && ((d3 > 0) != (d4 > 0) || d3 == 0 || d4 == 0)
+			&& fminf(a.x, b.x) <= fmaxf(c.x, d.x) && fminf(c.x, d.x) <= fmaxf(a.x, b.x)
+			&& fminf(a.y, b.y) <= fmaxf(c.y, d.y) && fminf(c.y, d.y) <= fmaxf(a.y, b.y);
+}
+
+/**
+* This function finds an edge crossed by the move a-b, the edges of the zone skip are ignored.
+* It returns the shape of the edge, or -1.
+*/
+static int
+rvc_nogo_cross(const _rvc_nogo_index_s* index, _rvc_point_s a, _rvc_point_s b, int skip)
+{
+	const _rvc_nogo_edge_s* edge = NULL;
+	int c0 = rvc_nogo_cell(fminf(a.x, b.x), index->origin_x, index->cell, index->cols);
+	int r0 = rvc_nogo_cell(fminf(a.y, b.y), index->origin_y, index->cell, index->rows);
+	int c1 = rvc_nogo_cell(fmaxf(a.x, b.x), index->origin_x, index->cell, index->cols);
+	int r1 = rvc_nogo_cell(fmaxf(a.y, b.y), index->origin_y, index->cell, index->rows);
+	int c, r, i, cell;
+
+	for(r = r0; r <= r1; r++){
+		for(c = c0; c <= c1; c++){
+			cell = r * index->cols + c;
+
+			for(i = index->edge_start[cell]; i < index->edge_start[cell + 1]; i++){
+				edge = &index->edges[index->edge_items[i]];
+
+				if(edge->shape != skip && rvc_nogo_segments_cross(a, b, edge->a, edge->b)){
+					return edge->shape;
 				}
 			}
 		}
 	}
+
+	return -1;
+}
+
+/**
+* This function predicts the motion from the pose with the velocities and checks it against the index.
+* Leaving the zone the robot is in is allowed. It returns the shape which is entered or crossed, or -1.
+*/
+static int
+rvc_nogo_predict(const _rvc_nogo_index_s* index, float x, float y, float q, float lin, float ang)
+{
+	_rvc_point_s from = {x, y};
+	_rvc_point_s to = {x, y};
+	float horizon = RVC_NOGO_HORIZON_MS / 1000.0f;
+	float dt = 0;
+	int start = -1;
+	int hit = -1;
+	int i;
+
+	//turning in place does not move the robot into anything
+	if(lin == 0){
+		return -1;
+	}
+
+	//slow motion is checked over a minimum distance
+	horizon = fmaxf(horizon, RVC_NOGO_MIN_DIST / fabsf(lin));
+	dt = horizon / RVC_NOGO_STEPS;
+
+	start = rvc_nogo_zone_at(index, x, y);
+
+	for(i = 0; i < RVC_NOGO_STEPS; i++){
+		q += ang * dt / 2;
+		to.x = from.x + lin * dt * cosf(q);
+		to.y = from.y + lin * dt * sinf(q);
+		q += ang * dt / 2;
+
+		hit = rvc_nogo_cross(index, from, to, start);
+		if(hit < 0){
+			hit = rvc_nogo_zone_at(index, to.x, to.y);
+			hit = (hit == start) ? -1 : hit;
+		}
+
+		if(hit >= 0){
+			return hit;
+		}
+
+		from = to;
+	}
+
+	return -1;
+}
+
+/**
+* This function checks a motion command against the no-go zones and walls.
+* It returns false when the command must be refused.
+*/
+static bool
+rvc_nogo_allows(_rvc_instance_s* instance, float lin, float ang)
+{
+	_rvc_nogo_s* nogo = &instance->nogo;
+	_rvc_tx_s* tx = &instance->tx_data;
+	long long start = 0;
+	long long elapsed = 0;
+	int hit = -1;
+	_rvc_nogo_shape_s shape;
+
+	if(nogo->enable == false){
+		return true;
+	}
+
+	pthread_mutex_lock(&nogo->lock);
+
+	if(nogo->index != NULL){
+		start = rvc_get_time_us();
+		hit = rvc_nogo_predict(nogo->index, tx->pose_x, tx->pose_y, tx->pose_q, lin, ang);
+		elapsed = rvc_get_time_us() - start;
+
+		nogo->checks++;
+		if(elapsed > nogo->check_max_us){
+			nogo->check_max_us = elapsed;
+		}
+
+		if(hit >= 0){
+			shape = nogo->index->shapes[hit];
+			nogo->rejected++;
+		}
+	}
+
+	pthread_mutex_unlock(&nogo->lock);
+
+	if(hit >= 0){
+		rvc_broadcast_event(instance, rvc_nogo_event_object, shape.wall ? "wall" : "zone", shape.id, "refused",
+				tx->pose_x, tx->pose_y);
+		return false;
+	}
+
+	return true;
 }
 
+/**
+* This function checks the motion of the robot on every pose update.
+* The robot is stopped when it is about to enter a zone or to cross a wall.
+*/
 static void
-__tts_play() {
-	if (TTS_STATE_READY == g_current_state || TTS_STATE_PAUSED == g_current_state) {
-		if (0 != tts_play(g_tts)) {
-			dlog_print(DLOG_ERROR, LOG_TAG, "Fail to start");
+rvc_nogo_update(_rvc_instance_s* instance)
+{
+	_rvc_nogo_s* nogo = &instance->nogo;
+	_rvc_tx_s* tx = &instance->tx_data;
+	long long start = 0;
+	long long elapsed = 0;
+	int hit = -1;
+	bool stop = false;
+	_rvc_nogo_shape_s shape;
+
+	if(nogo->enable == false || rvc_is_moving(instance) == false){
+		nogo->violating = false;
+		return;
+	}
+
+	pthread_mutex_lock(&nogo->lock);
+
+	if(nogo->index != NULL){
+		start = rvc_get_time_us();
+		hit = rvc_nogo_predict(nogo->index, tx->pose_x, tx->pose_y, tx->pose_q, tx->lin_vel, tx->ang_vel);
+		elapsed = rvc_get_time_us() - start;
+
+		nogo->checks++;
+		if(elapsed > nogo->check_max_us){
+			nogo->check_max_us = elapsed;
 		}
+
+		//the robot is stopped once per violation
+		if(hit >= 0 && nogo->violating == false){
+			shape = nogo->index->shapes[hit];
+			nogo->stopped++;
+			stop = true;
+		}
+	}
+
+	nogo->violating = (hit >= 0);
+
+	pthread_mutex_unlock(&nogo->lock);
+
+	if(stop){
+		rvc_set_lin_ang(0, 0);
+		rvc_path_abort(instance, "nogo");
+		rvc_broadcast_event(instance, rvc_nogo_event_object, shape.wall ? "wall" : "zone", shape.id, "stopped",
+				tx->pose_x, tx->pose_y);
+	}
+}
+
+/**
+* This function replaces the no-go zones and walls.
+*/
+static int
+rvc_nogo_set(_rvc_instance_s* instance, JsonObject* obj)
+{
+	_rvc_nogo_s* nogo = &instance->nogo;
+	_rvc_nogo_index_s* index = NULL;
+	_rvc_nogo_index_s* old = NULL;
+	JsonArray* zones = json_object_has_member(obj, "zones") ? json_object_get_array_member(obj, "zones") : NULL;
+	JsonArray* walls = json_object_has_member(obj, "walls") ? json_object_get_array_member(obj, "walls") : NULL;
+
+	//an empty set clears the index
+	if((zones && json_array_get_length(zones) > 0) || (walls && json_array_get_length(walls) > 0)){
+		index = rvc_nogo_build(zones, walls);
+		if(index == NULL){
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&nogo->lock);
+	old = nogo->index;
+	nogo->index = index;
+	nogo->violating = false;
+	pthread_mutex_unlock(&nogo->lock);
+
+	rvc_nogo_free(old);
+
+	return 0;
+}
+
+/**
+* These functions set the motion of the rvc for the clients and the path follower.
+* They are refused while a reflex holds the robot, or when the motion enters a no-go zone.
+*/
+static int
+rvc_motion_set_lin_ang(_rvc_instance_s* instance, float lin, float ang)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&instance->reflex.lock);
+	if(rvc_reflex_allows_motion(&instance->reflex) == false){
+		instance->reflex.rejected++;
+	}else if(rvc_nogo_allows(instance, lin, ang)){
+		ret = rvc_set_lin_ang(lin, ang);
+	}else{
+		//the robot stops instead of keeping the previous motion
+		rvc_set_lin_ang(0, 0);
+		rvc_path_abort(instance, "nogo");
+	}
+	pthread_mutex_unlock(&instance->reflex.lock);
+
+	return ret;
+}
+
+/**
+* This function arms the motion watchdog after a motion command of a client, or disarms it when the robot is told to stop.
+* The watchdog is kept for the client which armed it, the commands of the others without a watchdog do not disarm it.
+*/
+static void
+rvc_motion_watchdog(_rvc_instance_s* instance, _rvc_client_s* client, int timeout_ms, bool moving)
+{
+	_rvc_reflex_s* reflex = &instance->reflex;
+
+	pthread_mutex_lock(&reflex->lock);
+
+	if(client != NULL && timeout_ms > 0 && moving){
+		reflex->watchdog_ms = timeout_ms;
+		reflex->watchdog_until = rvc_get_time_ms() + timeout_ms;
+		reflex->watchdog_owner = client;
+		reflex->watchdog_serial = client->serial;
+		pthread_cond_signal(&reflex->cond);
+	}else if(client != NULL && client == reflex->watchdog_owner && client->serial == reflex->watchdog_serial){
+		reflex->watchdog_until = 0;
+		reflex->watchdog_owner = NULL;
+	}
+
+	pthread_mutex_unlock(&reflex->lock);
+}
+
+/**
+* This function disarms the motion watchdog whoever armed it.
+*/
+static void
+rvc_motion_watchdog_clear(_rvc_instance_s* instance)
+{
+	pthread_mutex_lock(&instance->reflex.lock);
+	instance->reflex.watchdog_until = 0;
+	instance->reflex.watchdog_owner = NULL;
+	pthread_mutex_unlock(&instance->reflex.lock);
+}
+
+static int
+rvc_motion_set_wheel_vel(_rvc_instance_s* instance, unsigned short left, unsigned short right)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&instance->reflex.lock);
+	if(rvc_reflex_allows_motion(&instance->reflex)){
+		ret = rvc_set_wheel_vel(left, right);
+	}else{
+		instance->reflex.rejected++;
+	}
+	pthread_mutex_unlock(&instance->reflex.lock);
+
+	return ret;
+}
+
+static int
+rvc_motion_set_control(_rvc_instance_s* instance, rvc_control_dir_e control)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&instance->reflex.lock);
+	if(rvc_reflex_allows_motion(&instance->reflex)){
+		ret = rvc_set_control(control);
+	}else{
+		instance->reflex.rejected++;
+	}
+	pthread_mutex_unlock(&instance->reflex.lock);
+
+	return ret;
+}
+
+
+/**
+* This function starts a stat of a window with the value which holds at the start.
+*/
+static void
+rvc_agg_stat_reset(_rvc_agg_stat_s* stat, float value, long long now)
+{
+	stat->value = value;
+	stat->since = now;
+	stat->min = value;
+	stat->max = value;
+	stat->area = 0;
+}
+
+/**
+* This function adds a sample to a stat. The previous value is weighted by the time it has held.
+*/
+static void
+rvc_agg_stat_put(_rvc_agg_stat_s* stat, float value, long long now)
+{
+	stat->area += (double)stat->value * (now - stat->since);
+	stat->value = value;
+	stat->since = now;
+	stat->min = fminf(stat->min, value);
+	stat->max = fmaxf(stat->max, value);
+}
+
+/**
+* This function returns the time weighted mean of a stat over a window.
+*/
+static float
+rvc_agg_stat_mean(const _rvc_agg_stat_s* stat, long long start, long long end)
+{
+	if(end <= start){
+		return stat->value;
+	}
+
+	return (float)((stat->area + (double)stat->value * (end - stat->since)) / (end - start));
+}
+
+/**
+* This function restarts a window from the current robot information.
+*/
+static void
+rvc_agg_window_reset(_rvc_agg_window_s* window, const _rvc_tx_s* tx, long long now)
+{
+	window->start_us = now;
+	window->samples = 0;
+	window->distance = 0;
+	window->rotation = 0;
+	memset(window->events, 0, sizeof(window->events));
+
+	rvc_agg_stat_reset(&window->stats[RVC_AGG_WHEEL_LEFT], tx->wheel_vel_left, now);
+	rvc_agg_stat_reset(&window->stats[RVC_AGG_WHEEL_RIGHT], tx->wheel_vel_right, now);
+	rvc_agg_stat_reset(&window->stats[RVC_AGG_LIN], tx->lin_vel, now);
+	rvc_agg_stat_reset(&window->stats[RVC_AGG_ANG], tx->ang_vel, now);
+}
+
+/**
+* This function adds the two values of a callback to every window.
+*/
+static void
+rvc_agg_put(_rvc_instance_s* instance, rvc_agg_stat_e a, float a_value, rvc_agg_stat_e b, float b_value)
+{
+	_rvc_agg_s* agg = &instance->agg;
+	long long now = rvc_get_time_us();
+	int i;
+
+	pthread_mutex_lock(&agg->lock);
+
+	for(i = 0; i < agg->count; i++){
+		rvc_agg_stat_put(&agg->windows[i].stats[a], a_value, now);
+		rvc_agg_stat_put(&agg->windows[i].stats[b], b_value, now);
+		agg->windows[i].samples++;
+	}
+
+	pthread_mutex_unlock(&agg->lock);
+}
+
+/**
+* This function adds the distance and the rotation since the previous pose to every window.
+*/
+static void
+rvc_agg_pose(_rvc_instance_s* instance, float x, float y, float q)
+{
+	_rvc_agg_s* agg = &instance->agg;
+	float step = 0;
+	float turn = 0;
+	int i;
+
+	pthread_mutex_lock(&agg->lock);
+
+	if(agg->has_pose){
+		step = hypotf(x - agg->pose_x, y - agg->pose_y);
+		turn = fabsf(remainderf(q - agg->pose_q, 2 * (float)M_PI));
+
+		if(step > RVC_AGG_MAX_STEP){
+			step = 0;
+			turn = 0;
+		}
+
+		for(i = 0; i < agg->count; i++){
+			agg->windows[i].distance += step;
+			agg->windows[i].rotation += turn;
+			agg->windows[i].samples++;
+		}
+	}
+
+	agg->has_pose = true;
+	agg->pose_x = x;
+	agg->pose_y = y;
+	agg->pose_q = q;
+
+	pthread_mutex_unlock(&agg->lock);
+}
+
+/**
+* This function counts a bumper, cliff or lift event in every window.
+*/
+static void
+rvc_agg_event(_rvc_instance_s* instance, rvc_agg_event_e event)
+{
+	_rvc_agg_s* agg = &instance->agg;
+	int i;
+
+	pthread_mutex_lock(&agg->lock);
+
+	for(i = 0; i < agg->count; i++){
+		agg->windows[i].events[event]++;
+	}
+
+	pthread_mutex_unlock(&agg->lock);
+}
+
+/**
+* This function wakes the aggregation thread up to time the windows again.
+*/
+static void
+rvc_agg_kick(_rvc_instance_s* instance)
+{
+	pthread_mutex_lock(&instance->agg.lock);
+	instance->agg.kick = true;
+	pthread_cond_signal(&instance->agg.cond);
+	pthread_mutex_unlock(&instance->agg.lock);
+}
+
+/**
+* This function will be called when the mode type of the rvc is changed.
+*/
+static void
+rvc_mode_callback(rvc_mode_type_get_e mode, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.status_us = rvc_get_time_us();
+
+	instance->tx_data.mode = (unsigned char)mode;
+
+	rvc_tx_kick(instance);
+
+	rvc_log(DLOG_DEBUG, "rvc_mode_callback = %d", mode);
+}
+
+/**
+* This function will be called when error condition of the rvc is changed.
+*/
+static void
+rvc_error_callback(rvc_device_error_type_e error, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.status_us = rvc_get_time_us();
+
+	instance->tx_data.error = (unsigned char)error;
+
+	rvc_broadcast_event(instance, rvc_error_event_object, instance->tx_data.error, instance->tx_data.status_us);
+
+	rvc_tx_kick(instance);
+
+	rvc_log(DLOG_DEBUG, "rvc_error_callback = %d", error);
+}
+
+/**
+* This function will be called when the wheel velocity of the rvc is changed.
+*/
+static void
+rvc_wheel_callback(signed short wheel_vel_left, signed short wheel_vel_right, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	bool was_moving = false;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.wheel_us = rvc_get_time_us();
+
+	was_moving = rvc_is_moving(instance);
+
+	instance->tx_data.wheel_vel_left = wheel_vel_left;
+	instance->tx_data.wheel_vel_right = wheel_vel_right;
+
+	rvc_agg_put(instance, RVC_AGG_WHEEL_LEFT, wheel_vel_left, RVC_AGG_WHEEL_RIGHT, wheel_vel_right);
+
+	//the rate goes up as soon as the robot starts to move
+	if(was_moving != rvc_is_moving(instance)){
+		rvc_tx_kick(instance);
+	}
+
+	rvc_log(DLOG_DEBUG, "rvc_wheel_callback = %d, %d", wheel_vel_left, wheel_vel_right);
+}
+
+/**
+* This function will be called when the pose of the rvc is changed.
+*/
+static void
+rvc_pose_callback(float pose_x, float pose_y, float pose_q, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.pose_us = rvc_get_time_us();
+
+	instance->tx_data.pose_x = pose_x;
+	instance->tx_data.pose_y = pose_y;
+	instance->tx_data.pose_q = pose_q;
+
+	rvc_nogo_update(instance);
+	rvc_agg_pose(instance, pose_x, pose_y, pose_q);
+
+	rvc_log(DLOG_DEBUG, "rvc_pose_callback = %f, %f, %f", pose_x, pose_y, pose_q);
+}
+
+/**
+* This function will be called when the bumper sensor level of the rvc is changed.
+*/
+static void
+rvc_bumper_callback(unsigned char bumper_left, unsigned char bumper_right, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.bumper_us = rvc_get_time_us();
+
+	rvc_reflex_update(instance, RVC_REFLEX_BUMPER_LEFT, instance->tx_data.bumper_left, bumper_left);
+	rvc_reflex_update(instance, RVC_REFLEX_BUMPER_RIGHT, instance->tx_data.bumper_right, bumper_right);
+
+	//a new contact on either side is one event
+	if((bumper_left && !instance->tx_data.bumper_left) || (bumper_right && !instance->tx_data.bumper_right)){
+		rvc_agg_event(instance, RVC_AGG_BUMPER);
+	}
+
+	instance->tx_data.bumper_left = bumper_left;
+	instance->tx_data.bumper_right = bumper_right;
+
+	rvc_broadcast_event(instance, rvc_bumper_event_object, bumper_left, bumper_right, instance->tx_data.bumper_us);
+
+	rvc_log(DLOG_DEBUG, "rvc_bumper_callback = %d, %d", bumper_left, bumper_right);
+}
+
+/**
+* This function will be called when the cliff value of the rvc is changed.
+*/
+static void
+rvc_cliff_callback(unsigned char cliff_left, unsigned char cliff_center, unsigned char cliff_right, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.cliff_us = rvc_get_time_us();
+
+	rvc_reflex_update(instance, RVC_REFLEX_CLIFF_LEFT, instance->tx_data.cliff_left, cliff_left);
+	rvc_reflex_update(instance, RVC_REFLEX_CLIFF_CENTER, instance->tx_data.cliff_center, cliff_center);
+	rvc_reflex_update(instance, RVC_REFLEX_CLIFF_RIGHT, instance->tx_data.cliff_right, cliff_right);
+
+	if((cliff_left && !instance->tx_data.cliff_left) || (cliff_center && !instance->tx_data.cliff_center)
+			|| (cliff_right && !instance->tx_data.cliff_right)){
+		rvc_agg_event(instance, RVC_AGG_CLIFF);
+	}
+
+	instance->tx_data.cliff_left = cliff_left;
+	instance->tx_data.cliff_center = cliff_center;
+	instance->tx_data.cliff_right = cliff_right;
+
+	rvc_broadcast_event(instance, rvc_cliff_event_object, cliff_left, cliff_center, cliff_right, instance->tx_data.cliff_us);
+
+	rvc_log(DLOG_DEBUG, "rvc_cliff_callback = %d, %d, %d", cliff_left, cliff_center, cliff_right);
+}
+
+/**
+* This function will be called when the lift value of the rvc is changed.
+*/
+static void
+rvc_lift_callback(unsigned char lift_left, unsigned char lift_right, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.lift_us = rvc_get_time_us();
+
+	rvc_reflex_update(instance, RVC_REFLEX_LIFT_LEFT, instance->tx_data.lift_left, lift_left);
+	rvc_reflex_update(instance, RVC_REFLEX_LIFT_RIGHT, instance->tx_data.lift_right, lift_right);
+
+	if((lift_left && !instance->tx_data.lift_left) || (lift_right && !instance->tx_data.lift_right)){
+		rvc_agg_event(instance, RVC_AGG_LIFT);
+	}
+
+	instance->tx_data.lift_left = lift_left;
+	instance->tx_data.lift_right = lift_right;
+
+	rvc_broadcast_event(instance, rvc_lift_event_object, lift_left, lift_right, instance->tx_data.lift_us);
+
+	rvc_log(DLOG_DEBUG, "rvc_lift_callback = %d, %d", lift_left, lift_right);
+}
+
+/**
+* This function will be called when the magnetic sensor level of the rvc is changed.
+*/
+static void
+rvc_magnet_callback(unsigned char magnet, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.status_us = rvc_get_time_us();
+
+	instance->tx_data.magnet =  magnet;
+
+	rvc_log(DLOG_DEBUG, "rvc_magnet_callback = %d", magnet);
+}
+
+/**
+* This function will be called when the suction level of the rvc is changed.
+*/
+static void
+rvc_suction_callback(rvc_suction_state_e state, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.status_us = rvc_get_time_us();
+
+	instance->tx_data.suction = (unsigned char)state;
+
+	rvc_tx_kick(instance);
+
+	rvc_log(DLOG_DEBUG, "rvc_suction_callback = %d", state);
+}
+
+/**
+* This function will be called when the battery level of the rvc is changed.
+*/
+static void
+rvc_batt_callback(rvc_batt_level_e level, void* data){
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.status_us = rvc_get_time_us();
+
+	instance->tx_data.battery = (unsigned char)level;
+
+	rvc_tx_kick(instance);
+
+	rvc_log(DLOG_DEBUG, "rvc_batt_callback = %d", level);
+}
+
+/**
+* This function will be called when the voice type of the rvc is changed.
+*/
+static void
+rvc_voice_callback(rvc_voice_type_e type, void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.status_us = rvc_get_time_us();
+
+	instance->tx_data.voice = (unsigned char)type;
+
+	rvc_tx_kick(instance);
+
+	rvc_log(DLOG_DEBUG, "rvc_voice_callback = %d", type);
+}
+
+/**
+* This function will be called when the rvc is the low battery condition.
+*/
+static void
+rvc_batt_low_callback(void* data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	rvc_log(DLOG_DEBUG, "rvc_batt_low_callback");
+}
+
+/**
+* This function will be called when linear or angular velocity of the rvc is changed.
+*/
+static void
+rvc_lin_ang_callback(float lin, float ang, void* user_data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)user_data;
+	bool was_moving = false;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.lin_ang_us = rvc_get_time_us();
+
+	was_moving = rvc_is_moving(instance);
+
+	instance->tx_data.lin_vel = lin;
+	instance->tx_data.ang_vel = ang;
+
+	rvc_agg_put(instance, RVC_AGG_LIN, lin, RVC_AGG_ANG, ang);
+
+	if(was_moving != rvc_is_moving(instance)){
+		rvc_tx_kick(instance);
+	}
+
+	rvc_log(DLOG_DEBUG, "rvc_lin_ang_callback = %f, %f", lin, ang);
+}
+
+/**
+* This function will be called when reservation state of the rvc is changed.
+*/
+static void
+rvc_reservation_callback(rvc_reserve_type_e reserve_type, unsigned char is_on, unsigned char reserve_hh, unsigned char reserve_mm, void* user_data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)user_data;
+
+	if(instance == NULL){
+		return;
+	}
+
+	instance->tx_data.status_us = rvc_get_time_us();
+
+	if(reserve_type == RVC_RESERVE_TYPE_ONCE){
+		instance->tx_data.once_on = is_on;
+		instance->tx_data.once_hour = reserve_hh;
+		instance->tx_data.once_minute = reserve_mm;
+	}else{
+		instance->tx_data.daily_on = is_on;
+		instance->tx_data.daily_hour = reserve_hh;
+		instance->tx_data.daily_minute = reserve_mm;
+	}
+
+	rvc_tx_kick(instance);
+
+	rvc_log(DLOG_DEBUG, "rvc_reservation_callback = %d, %d, %d, %d", reserve_type, is_on, reserve_hh, reserve_mm);
+}
+
+/**
+* This function registers handler which handles the rvc event.
+*/
+static void
+rvc_register_callback(_rvc_instance_s* instance)
+{
+	if(instance == NULL){
+		return;
+	}
+
+	rvc_set_mode_evt_cb(rvc_mode_callback, instance);
+	rvc_set_error_evt_cb(rvc_error_callback, instance);
+	rvc_set_wheel_vel_evt_cb(rvc_wheel_callback, instance);
+	rvc_set_pose_evt_cb(rvc_pose_callback, instance);
+	rvc_set_bumper_evt_cb(rvc_bumper_callback, instance);
+	rvc_set_cliff_evt_cb(rvc_cliff_callback, instance);
+	rvc_set_lift_evt_cb(rvc_lift_callback, instance);
+	rvc_set_magnet_evt_cb(rvc_magnet_callback, instance);
+	rvc_set_suction_evt_cb(rvc_suction_callback, instance);
+	rvc_set_batt_evt_cb(rvc_batt_callback, instance);
+	rvc_set_voice_evt_cb(rvc_voice_callback, instance);
+	rvc_set_batt_low_evt_cb(rvc_batt_low_callback, instance);
+	rvc_set_lin_ang_evt_cb(rvc_lin_ang_callback, instance);
+	rvc_set_reservation_evt_cb(rvc_reservation_callback, instance);
+}
+
+/**
+* This function is to get the robot information.
+*/
+static void
+get_rvc_info(_rvc_instance_s* instance)
+{
+	if(instance == NULL){
+		return;
+	}
+
+	rvc_get_mode((rvc_mode_type_get_e*)&instance->tx_data.mode);
+	rvc_get_error((rvc_device_error_type_e*)&instance->tx_data.error);
+	rvc_get_wheel_vel((signed short*)&instance->tx_data.wheel_vel_left, (signed short*)&instance->tx_data.wheel_vel_right);
+	rvc_get_bumper((unsigned char*)&instance->tx_data.bumper_left, (unsigned char*)&instance->tx_data.bumper_right);
+	rvc_get_pose(&instance->tx_data.pose_x, &instance->tx_data.pose_y, &instance->tx_data.pose_q);
+	rvc_get_cliff((unsigned char*)&instance->tx_data.cliff_left, (unsigned char*)&instance->tx_data.cliff_center, (unsigned char*)&instance->tx_data.cliff_right);
+	rvc_get_lift((unsigned char*)&instance->tx_data.lift_left, (unsigned char*)&instance->tx_data.lift_right);
+	rvc_get_magnet((unsigned char*)&instance->tx_data.magnet);
+	rvc_get_suction_state((rvc_suction_state_e *)&instance->tx_data.suction);
+	rvc_get_reserve(RVC_RESERVE_TYPE_ONCE, (unsigned char*)&instance->tx_data.once_on, (unsigned char*)&instance->tx_data.once_hour, (unsigned char*)&instance->tx_data.once_minute);
+	rvc_get_reserve(RVC_RESERVE_TYPE_DAILY, (unsigned char*)&instance->tx_data.daily_on, (unsigned char*)&instance->tx_data.daily_hour, (unsigned char*)&instance->tx_data.daily_minute);
+	rvc_get_lin_ang_vel(&instance->tx_data.lin_vel, &instance->tx_data.ang_vel);
+	rvc_get_battery_level((rvc_batt_level_e*)&instance->tx_data.battery);
+	rvc_get_voice_type((rvc_voice_type_e*)&instance->tx_data.voice);
+
+	//the polled values are as fresh as a callback
+	instance->tx_data.status_us = instance->tx_data.wheel_us = instance->tx_data.pose_us = rvc_get_time_us();
+	instance->tx_data.bumper_us = instance->tx_data.cliff_us = instance->tx_data.lift_us = instance->tx_data.pose_us;
+	instance->tx_data.lin_ang_us = instance->tx_data.pose_us;
+}
+
+/**
+* This function returns the age of a sample in ms, or -1 when there is no sample yet.
+* It is capped to keep the state frame in RVC_JSON_SIZE.
+*/
+static long long
+rvc_age_ms(long long now, long long stamp)
+{
+	if(stamp == 0){
+		return -1;
+	}
+
+	return (now - stamp) / 1000 < RVC_AGE_MAX_MS ? (now - stamp) / 1000 : RVC_AGE_MAX_MS;
+}
+
+static int
+rvc_state_int(int value, int max)
+{
+	return value > max ? max : (value < -max ? -max : value);
+}
+
+static double
+rvc_state_float(float value, float max)
+{
+	if(isnan(value)){
+		return 0.0;
+	}
+
+	return value > max ? max : (value < -max ? -max : value);
+}
+
+/**
+* This function makes a state frame from the robot information.
+* Every value is clamped to its limit so that the frame is never truncated, it returns the length.
+*/
+static int
+rvc_format_state(const _rvc_tx_s* tx, long long now, char* msg)
+{
+	int len = 0;
+
+	memset(msg, 0, RVC_JSON_SIZE);
+	len = snprintf(msg, RVC_JSON_SIZE, rvc_json_object \
+			,now \
+			,rvc_age_ms(now, tx->status_us), rvc_age_ms(now, tx->wheel_us), rvc_age_ms(now, tx->pose_us) \
+			,rvc_age_ms(now, tx->bumper_us), rvc_age_ms(now, tx->cliff_us), rvc_age_ms(now, tx->lift_us) \
+			,rvc_age_ms(now, tx->lin_ang_us) \
+			,rvc_state_int(tx->mode, RVC_STATE_INT_MAX) \
+			,rvc_state_int(tx->error, RVC_STATE_INT_MAX) \
+			,rvc_state_int(tx->magnet, RVC_STATE_FLAG_MAX) \
+			,rvc_state_int(tx->suction, RVC_STATE_INT_MAX) \
+			,rvc_state_int(tx->battery, RVC_STATE_INT_MAX) \
+			,rvc_state_int(tx->voice, RVC_STATE_INT_MAX) \
+			,rvc_state_int(tx->once_on, RVC_STATE_FLAG_MAX), rvc_state_int(tx->once_hour, RVC_STATE_TIME_MAX) \
+			,rvc_state_int(tx->once_minute, RVC_STATE_TIME_MAX) \
+			,rvc_state_int(tx->daily_on, RVC_STATE_FLAG_MAX), rvc_state_int(tx->daily_hour, RVC_STATE_TIME_MAX) \
+			,rvc_state_int(tx->daily_minute, RVC_STATE_TIME_MAX) \
+			,rvc_state_int(tx->wheel_vel_left, RVC_STATE_INT_MAX), rvc_state_int(tx->wheel_vel_right, RVC_STATE_INT_MAX) \
+			,rvc_state_float(tx->pose_x, RVC_STATE_POS_MAX), rvc_state_float(tx->pose_y, RVC_STATE_POS_MAX) \
+			,rvc_state_float(tx->pose_q, RVC_STATE_VEL_MAX) \
+			,rvc_state_int(tx->bumper_left, RVC_STATE_FLAG_MAX), rvc_state_int(tx->bumper_right, RVC_STATE_FLAG_MAX) \
+			,rvc_state_int(tx->cliff_left, RVC_STATE_FLAG_MAX), rvc_state_int(tx->cliff_center, RVC_STATE_FLAG_MAX) \
+			,rvc_state_int(tx->cliff_right, RVC_STATE_FLAG_MAX) \
+			,rvc_state_int(tx->lift_left, RVC_STATE_FLAG_MAX), rvc_state_int(tx->lift_right, RVC_STATE_FLAG_MAX) \
+			,rvc_state_float(tx->lin_vel, RVC_STATE_VEL_MAX), rvc_state_float(tx->ang_vel, RVC_STATE_VEL_MAX) \
+			);
+
+	if(len >= RVC_JSON_SIZE){
+		dlog_print(DLOG_ERROR, LOG_TAG, "state frame is truncated, %d bytes", len);
+	}
+
+	return len;
+}
+
+/**
+* This function formats the longest state frame, every value at its negative limit and the largest ts.
+* It fails when that frame does not fit in RVC_JSON_SIZE.
+*/
+static bool
+rvc_format_check(void)
+{
+	char msg[RVC_JSON_SIZE+1] = {0,};
+	_rvc_tx_s tx;
+	int len = 0;
+
+	memset(&tx, 0, sizeof(tx));
+
+	tx.mode = tx.error = tx.battery = tx.voice = -RVC_STATE_INT_MAX;
+	tx.wheel_vel_left = tx.wheel_vel_right = -RVC_STATE_INT_MAX;
+	tx.suction = -RVC_STATE_INT_MAX;
+	tx.magnet = tx.once_on = tx.daily_on = -RVC_STATE_FLAG_MAX;
+	tx.once_hour = tx.once_minute = tx.daily_hour = tx.daily_minute = -RVC_STATE_TIME_MAX;
+	tx.bumper_left = tx.bumper_right = -RVC_STATE_FLAG_MAX;
+	tx.cliff_left = tx.cliff_center = tx.cliff_right = -RVC_STATE_FLAG_MAX;
+	tx.lift_left = tx.lift_right = -RVC_STATE_FLAG_MAX;
+	tx.pose_x = tx.pose_y = -RVC_STATE_POS_MAX;
+	tx.pose_q = tx.lin_vel = tx.ang_vel = -RVC_STATE_VEL_MAX;
+	tx.status_us = tx.wheel_us = tx.pose_us = tx.bumper_us = tx.cliff_us = tx.lift_us = tx.lin_ang_us = 1;
+
+	len = rvc_format_state(&tx, LLONG_MAX, msg);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "longest state frame is %d bytes", len);
+
+	return len < RVC_JSON_SIZE;
+}
+
+/**
+* This function makes the free list of the frame pool.
+*/
+static void
+rvc_pool_init(_rvc_pool_s* pool)
+{
+	int i;
+
+	rvc_mutex_init_pi(&pool->lock);
+
+	pool->free = NULL;
+	for(i = RVC_FRAME_POOL - 1; i >= 0; i--){
+		pool->bufs[i].refs = 0;
+		pool->bufs[i].next = pool->free;
+		pool->free = &pool->bufs[i];
+	}
+
+	pool->used = 0;
+	pool->used_max = 0;
+}
+
+/**
+* This function takes a cleared buffer with one reference from the pool, NULL when the pool is empty.
+*/
+static _rvc_buf_s*
+rvc_buf_get(_rvc_pool_s* pool)
+{
+	_rvc_buf_s* buf = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+
+	buf = pool->free;
+
+	if(buf == NULL){
+		pool->exhausted++;
+	}else{
+		pool->free = buf->next;
+		pool->used++;
+		if(pool->used > pool->used_max){
+			pool->used_max = pool->used;
+		}
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if(buf == NULL){
+		rvc_log(DLOG_DEBUG, "frame pool is empty!");
+		return NULL;
+	}
+
+	buf->refs = 1;
+	memset(buf->data, 0, sizeof(buf->data));
+
+	return buf;
+}
+
+static void
+rvc_buf_ref(_rvc_buf_s* buf)
+{
+	__sync_add_and_fetch(&buf->refs, 1);
+}
+
+/**
+* This function drops a reference of a buffer, the last one gives it back to the pool.
+*/
+static void
+rvc_buf_unref(_rvc_pool_s* pool, _rvc_buf_s* buf)
+{
+	if(__sync_sub_and_fetch(&buf->refs, 1) > 0){
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	buf->next = pool->free;
+	pool->free = buf;
+	pool->used--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+* This function puts a shared frame into the send queue of a client, the queue takes its own reference.
+* A state frame which is not being sent yet is replaced by the newer one,
+* event frames are kept in order.
+*/
+static void
+rvc_client_queue_buf(_rvc_client_s* client, rvc_frame_type_e type, _rvc_buf_s* buf, rvc_zstream_e zstream)
+{
+	_rvc_buf_s* old = NULL;
+	int idx;
+
+	pthread_mutex_lock(&client->lock);
+
+	if(client->tx_run == false){
+		pthread_mutex_unlock(&client->lock);
+		return;
+	}
+
+	client->tx_ms = rvc_get_time_ms();
+
+	if(type == RVC_FRAME_STATE && client->state_slot >= 0){
+		old = client->queue[client->state_slot].buf;
+		rvc_buf_ref(buf);
+		client->queue[client->state_slot].buf = buf;
+		client->state_replaced++;
+	}else if(client->q_count == RVC_TX_QUEUE_LEN){
+		if(type == RVC_FRAME_EVENT){
+			client->events_dropped++;
+
+			if(client->slow_policy == RVC_SLOW_POLICY_DISCONNECT){
+				client->overflow = true;
+			}
+		}
+	}else{
+		idx = (client->q_head + client->q_count) % RVC_TX_QUEUE_LEN;
+
+		rvc_buf_ref(buf);
+		client->queue[idx].type = type;
+		client->queue[idx].zstream = zstream;
+		client->queue[idx].buf = buf;
+		client->q_count++;
+
+		if(type == RVC_FRAME_STATE){
+			client->state_slot = idx;
+		}
+	}
+
+	pthread_cond_signal(&client->cond);
+	pthread_mutex_unlock(&client->lock);
+
+	if(old != NULL){
+		rvc_buf_unref(&client->instance->pool, old);
+	}
+}
+
+static void
+rvc_client_put_buf(_rvc_client_s* client, rvc_frame_type_e type, _rvc_buf_s* buf)
+{
+	rvc_client_queue_buf(client, type, buf, RVC_ZSTREAM_KEEP);
+}
+
+/**
+* This function puts a frame made for one client into its send queue.
+*/
+static void
+rvc_client_queue_frame(_rvc_client_s* client, rvc_frame_type_e type, const char* data, rvc_zstream_e zstream)
+{
+	_rvc_pool_s* pool = &client->instance->pool;
+	_rvc_buf_s* buf = rvc_buf_get(pool);
+
+	if(buf == NULL){
+		return;
+	}
+
+	memcpy(buf->data, data, RVC_JSON_SIZE);
+
+	rvc_client_queue_buf(client, type, buf, zstream);
+	rvc_buf_unref(pool, buf);
+}
+
+static void
+rvc_client_put_frame(_rvc_client_s* client, rvc_frame_type_e type, const char* data)
+{
+	rvc_client_queue_frame(client, type, data, RVC_ZSTREAM_KEEP);
+}
+
+/**
+* This function puts an event frame made from the format into the send queue of a client.
+*/
+static void
+rvc_client_send(_rvc_client_s* client, const char* format, ...)
+{
+	char msg[RVC_JSON_SIZE] = {0,};
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(msg, RVC_JSON_SIZE, format, args);
+	va_end(args);
+
+	rvc_client_put_frame(client, RVC_FRAME_EVENT, msg);
+}
+
+/**
+* This function starts the compressed stream of a client. The lock must be held.
+* The dictionary is the event formats followed by the state format, a client
+* gives the same bytes to inflateSetDictionary.
+*/
+static void
+rvc_zstream_start(_rvc_client_s* client)
+{
+	static char dict[RVC_JSON_SIZE * 2] = {0,};
+
+	if(dict[0] == 0){
+		snprintf(dict, sizeof(dict), "%s%s%s%s%s", rvc_error_event_object, rvc_bumper_event_object,
+				rvc_cliff_event_object, rvc_lift_event_object, rvc_json_object);
+	}
+
+	memset(&client->zs, 0, sizeof(z_stream));
+
+	if(deflateInit2(&client->zs, client->z_level, Z_DEFLATED, RVC_ZLIB_WINDOW_BITS, RVC_ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK){
+		dlog_print(DLOG_ERROR, LOG_TAG, "deflateInit2 is failed!");
+		return;
+	}
+
+	deflateSetDictionary(&client->zs, (const Bytef*)dict, strlen(dict));
+
+	client->z_on = true;
+}
+
+/**
+* This function makes the head frame of a client ready for the wire. The lock must be held.
+* A compressed frame is flushed with Z_SYNC_FLUSH so that it can be decoded on arrival.
+*/
+static void
+rvc_client_wire_frame(_rvc_client_s* client, _rvc_frame_s* frame)
+{
+	if(client->z_on){
+		client->zs.next_in = (Bytef*)frame->buf->data;
+		client->zs.avail_in = RVC_JSON_SIZE;
+		client->zs.next_out = (Bytef*)client->z_frame;
+		client->zs.avail_out = RVC_ZLIB_FRAME_SIZE;
+
+		deflate(&client->zs, (frame->zstream == RVC_ZSTREAM_END) ? Z_FINISH : Z_SYNC_FLUSH);
+
+		client->wire_data = client->z_frame;
+		client->wire_len = RVC_ZLIB_FRAME_SIZE - client->zs.avail_out;
+
+		if(frame->zstream == RVC_ZSTREAM_END){
+			deflateEnd(&client->zs);
+			client->z_on = false;
+		}
+
+		//the frame is in the compression history, it cannot be replaced anymore
+		if(client->state_slot == client->q_head){
+			client->state_slot = -1;
+		}
+	}else{
+		client->wire_data = frame->buf->data;
+		client->wire_len = RVC_JSON_SIZE;
+	}
+
+	client->raw_bytes += RVC_JSON_SIZE;
+	client->wire_bytes += client->wire_len;
+}
+
+/**
+* This function writes the raw frames at the head of the queue with one call. The lock must be held.
+* The frames are not copied, the vector points to the shared buffers.
+*/
+static ssize_t
+rvc_client_gather(_rvc_client_s* client)
+{
+	struct iovec iov[RVC_TX_QUEUE_LEN];
+	struct msghdr hdr;
+	_rvc_frame_s* frame = NULL;
+	int count = 0;
+
+	while(count < client->q_count){
+		frame = &client->queue[(client->q_head + count) % RVC_TX_QUEUE_LEN];
+
+		iov[count].iov_base = frame->buf->data + (count == 0 ? client->head_sent : 0);
+		iov[count].iov_len = RVC_JSON_SIZE - (count == 0 ? client->head_sent : 0);
+		count++;
+
+		//the frames after this one are compressed
+		if(frame->zstream == RVC_ZSTREAM_START){
+			break;
+		}
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = count;
+
+	return sendmsg(client->socket, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/**
+* This function writes the queued frames of a client without blocking.
+* It returns 0 when the queue is empty, 1 when the socket is full and -1 on error.
+*/
+static int
+rvc_client_flush(_rvc_client_s* client)
+{
+	int ret = 0;
+	int len = 0;
+	int take = 0;
+	ssize_t sent = 0;
+	_rvc_frame_s* frame = NULL;
+
+	pthread_mutex_lock(&client->lock);
+
+	while(client->q_count > 0){
+		frame = &client->queue[client->q_head];
+
+		//a compressed frame is made for this connection alone, the raw frames go out of the shared buffers
+		if(client->z_on || client->wire_data != NULL){
+			if(client->wire_data == NULL){
+				rvc_client_wire_frame(client, frame);
+			}
+
+			sent = send(client->socket, client->wire_data + client->head_sent, client->wire_len - client->head_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		}else{
+			sent = rvc_client_gather(client);
+		}
+
+		if(sent == -1){
+			if(errno == EINTR){
+				continue;
+			}
+
+			ret = (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+			break;
+		}
+
+		client->last_progress = rvc_get_time_ms();
+
+		while(sent > 0){
+			frame = &client->queue[client->q_head];
+			len = (client->wire_data != NULL) ? client->wire_len : RVC_JSON_SIZE;
+			take = (sent < len - client->head_sent) ? (int)sent : len - client->head_sent;
+
+			//the frame is on the wire, a newer state frame must be queued behind it
+			if(client->state_slot == client->q_head){
+				client->state_slot = -1;
+			}
+
+			client->head_sent += take;
+			sent -= take;
+
+			if(client->head_sent < len){
+				break;
+			}
+
+			if(client->wire_data == NULL){
+				client->raw_bytes += RVC_JSON_SIZE;
+				client->wire_bytes += RVC_JSON_SIZE;
+			}
+
+			if(frame->zstream == RVC_ZSTREAM_START && client->z_on == false){
+				rvc_zstream_start(client);
+			}
+
+			rvc_buf_unref(&client->instance->pool, frame->buf);
+			frame->buf = NULL;
+
+			client->head_sent = 0;
+			client->wire_data = NULL;
+			client->q_head = (client->q_head + 1) % RVC_TX_QUEUE_LEN;
+			client->q_count--;
+		}
+	}
+
+	if(client->q_count == 0){
+		client->last_progress = rvc_get_time_ms();
+	}
+
+	pthread_mutex_unlock(&client->lock);
+
+	return ret;
+}
+
+/**
+* This function checks whether a client has to be disconnected by the slow client policy.
+*/
+static bool
+rvc_client_is_slow(_rvc_client_s* client)
+{
+	bool slow = false;
+
+	pthread_mutex_lock(&client->lock);
+
+	if(client->slow_policy == RVC_SLOW_POLICY_DISCONNECT){
+		if(client->overflow || rvc_get_time_ms() - client->last_progress > client->slow_timeout_ms){
+			slow = true;
+		}
+	}
+
+	pthread_mutex_unlock(&client->lock);
+
+	return slow;
+}
+
+/**
+* This function puts an event frame into the send queue of every client, it is made once and shared.
+*/
+static void
+rvc_broadcast_event(_rvc_instance_s* instance, const char* format, ...)
+{
+	_rvc_buf_s* buf = rvc_buf_get(&instance->pool);
+	va_list args;
+	int i;
+
+	if(buf == NULL){
+		return;
+	}
+
+	va_start(args, format);
+	vsnprintf(buf->data, RVC_JSON_SIZE, format, args);
+	va_end(args);
+
+	pthread_mutex_lock(&instance->client_lock);
+
+	for(i = 0; i < RVC_MAX_CLIENTS; i++){
+		if(instance->clients[i].in_use){
+			rvc_client_put_buf(&instance->clients[i], RVC_FRAME_EVENT, buf);
+		}
+	}
+
+	pthread_mutex_unlock(&instance->client_lock);
+
+	rvc_buf_unref(&instance->pool, buf);
+}
+
+/**
+* This function makes a session token which cannot be guessed by another client.
+*/
+static unsigned long long
+rvc_session_token(void)
+{
+	unsigned long long token = 0;
+	FILE* fp = fopen("/dev/urandom", "rb");
+
+	if(fp != NULL){
+		if(fread(&token, sizeof(token), 1, fp) != 1){
+			token = 0;
+		}
+		fclose(fp);
+	}
+
+	if(token == 0){
+		token = ((unsigned long long)rvc_get_time_us() << 16) ^ (unsigned long long)rand();
+	}
+
+	return token;
+}
+
+/**
+* This function bounds a heartbeat or idle timeout set by a client, 0 or less turns it off.
+*/
+static int
+rvc_session_ms(long long value, int min)
+{
+	if(value <= 0){
+		return 0;
+	}
+
+	return value < min ? min : (value > RVC_SESSION_MAX_MS ? RVC_SESSION_MAX_MS : (int)value);
+}
+
+/**
+* This function gives a new session to a client. The client lock of the instance must be held.
+* A free or expired session is taken first, then the session closed for the longest time.
+*/
+static int
+rvc_session_new(_rvc_instance_s* instance)
+{
+	_rvc_session_s* session = NULL;
+	long long now = rvc_get_time_ms();
+	int idx = -1;
+	int i;
+
+	for(i = 0; i < RVC_MAX_SESSIONS; i++){
+		session = &instance->sessions[i];
+
+		if(session->attached){
+			continue;
+		}
+
+		if(session->token == 0 || now - session->detached_ms >= RVC_SESSION_TTL_MS){
+			idx = i;
+			break;
+		}
+
+		if(idx < 0 || session->detached_ms < instance->sessions[idx].detached_ms){
+			idx = i;
+		}
+	}
+
+	//there are more sessions than clients, one is always free
+	session = &instance->sessions[idx];
+	memset(session, 0, sizeof(_rvc_session_s));
+	session->token = rvc_session_token();
+	session->attached = true;
+
+	return idx;
+}
+
+/**
+* This function keeps the settings of a closed connection for its resume.
+* The client lock of the instance must be held.
+*/
+static void
+rvc_session_detach(_rvc_client_s* client)
+{
+	_rvc_session_s* session = &client->instance->sessions[client->session];
+
+	session->slow_policy = client->slow_policy;
+	session->slow_timeout_ms = client->slow_timeout_ms;
+	session->z_level = client->z_level;
+	session->heartbeat_ms = client->heartbeat_ms;
+	session->idle_ms = client->idle_ms;
+	session->agg_mask = client->agg_mask;
+	session->clock_offset_us = client->clock_offset_us;
+	session->motion_ttl_ms = client->motion_ttl_ms;
+	session->watchdog_ms = client->watchdog_ms;
+	session->attached = false;
+	session->detached_ms = rvc_get_time_ms();
+}
+
+/**
+* This function enables the tcp keepalive of a connection, so that a dead peer is found
+* even while nothing is sent.
+*/
+static void
+rvc_socket_keepalive(int socket)
+{
+	int on = 1;
+	int idle = RVC_KEEPALIVE_IDLE;
+	int intvl = RVC_KEEPALIVE_INTVL;
+	int cnt = RVC_KEEPALIVE_CNT;
+	unsigned int timeout = RVC_TCP_USER_TIMEOUT_MS;
+
+	setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+	setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+
+#ifdef TCP_USER_TIMEOUT
+	//sent data which is not acknowledged in time closes the connection as well
+	setsockopt(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+#endif
+}
+
+/**
+* This function adds a state snapshot to the history used by the resume of a session.
+*/
+static void
+rvc_history_put(_rvc_instance_s* instance, const _rvc_snapshot_s* snapshot)
+{
+	pthread_mutex_lock(&instance->history_lock);
+
+	instance->history[(instance->history_head + instance->history_count) % RVC_STATE_HISTORY] = *snapshot;
+
+	if(instance->history_count < RVC_STATE_HISTORY){
+		instance->history_count++;
+	}else{
+		instance->history_head = (instance->history_head + 1) % RVC_STATE_HISTORY;
+	}
+
+	pthread_mutex_unlock(&instance->history_lock);
+}
+
+/**
+* This function appends a member to a delta frame. It returns false when the frame is full.
+*/
+static bool
+rvc_delta_append(char* msg, int* len, const char* format, ...)
+{
+	va_list args;
+	int n = 0;
+
+	va_start(args, format);
+	n = vsnprintf(msg + *len, RVC_JSON_SIZE - *len, format, args);
+	va_end(args);
+
+	if(n < 0 || *len + n >= RVC_JSON_SIZE){
+		return false;
+	}
+
+	*len += n;
+
+	return true;
+}
+
+/**
+* This function makes a frame with the fields which are different in the two snapshots.
+* It returns false when the changes do not fit in a frame.
+*/
+static bool
+rvc_format_delta(const _rvc_snapshot_s* old, const _rvc_snapshot_s* cur, char* msg)
+{
+	const _rvc_tx_s* a = &old->tx;
+	const _rvc_tx_s* b = &cur->tx;
+	int len = 0;
+	bool ok = true;
+
+	memset(msg, 0, RVC_JSON_SIZE);
+
+	ok = rvc_delta_append(msg, &len, "{\"delta\":{\"since\":%lld,\"ts\":%lld", old->ts, cur->ts);
+
+	if(a->mode != b->mode){
+		ok = ok && rvc_delta_append(msg, &len, ",\"mode\":%d", b->mode);
+	}
+	if(a->error != b->error){
+		ok = ok && rvc_delta_append(msg, &len, ",\"error\":%d", b->error);
+	}
+	if(a->magnet != b->magnet){
+		ok = ok && rvc_delta_append(msg, &len, ",\"magnet\":%d", b->magnet);
+	}
+	if(a->suction != b->suction){
+		ok = ok && rvc_delta_append(msg, &len, ",\"suction\":%d", b->suction);
+	}
+	if(a->battery != b->battery){
+		ok = ok && rvc_delta_append(msg, &len, ",\"battery\":%d", b->battery);
+	}
+	if(a->voice != b->voice){
+		ok = ok && rvc_delta_append(msg, &len, ",\"voice\":%d", b->voice);
+	}
+	if(a->once_on != b->once_on || a->once_hour != b->once_hour || a->once_minute != b->once_minute
+			|| a->daily_on != b->daily_on || a->daily_hour != b->daily_hour || a->daily_minute != b->daily_minute){
+		ok = ok && rvc_delta_append(msg, &len, ",\"reserve\":{\"once\":{\"on\":%d,\"hour\":%d,\"minute\":%d},\"daily\":{\"on\":%d,\"hour\":%d,\"minute\":%d}}",
+				b->once_on, b->once_hour, b->once_minute, b->daily_on, b->daily_hour, b->daily_minute);
+	}
+	if(a->wheel_vel_left != b->wheel_vel_left || a->wheel_vel_right != b->wheel_vel_right){
+		ok = ok && rvc_delta_append(msg, &len, ",\"wheel_vel\":{\"left\":%d,\"right\":%d}", b->wheel_vel_left, b->wheel_vel_right);
+	}
+	if(a->pose_x != b->pose_x || a->pose_y != b->pose_y || a->pose_q != b->pose_q){
+		ok = ok && rvc_delta_append(msg, &len, ",\"pose\":{\"x\":%.3f,\"y\":%.3f,\"q\":%.3f}", rvc_state_float(b->pose_x, RVC_STATE_POS_MAX),
+				rvc_state_float(b->pose_y, RVC_STATE_POS_MAX), rvc_state_float(b->pose_q, RVC_STATE_VEL_MAX));
+	}
+	if(a->bumper_left != b->bumper_left || a->bumper_right != b->bumper_right){
+		ok = ok && rvc_delta_append(msg, &len, ",\"bumper\":{\"left\":%d,\"right\":%d}", b->bumper_left, b->bumper_right);
+	}
+	if(a->cliff_left != b->cliff_left || a->cliff_center != b->cliff_center || a->cliff_right != b->cliff_right){
+		ok = ok && rvc_delta_append(msg, &len, ",\"cliff\":{\"left\":%d,\"center\":%d,\"right\":%d}", b->cliff_left, b->cliff_center, b->cliff_right);
+	}
+	if(a->lift_left != b->lift_left || a->lift_right != b->lift_right){
+		ok = ok && rvc_delta_append(msg, &len, ",\"lift\":{\"left\":%d,\"right\":%d}", b->lift_left, b->lift_right);
+	}
+	if(a->lin_vel != b->lin_vel || a->ang_vel != b->ang_vel){
+		ok = ok && rvc_delta_append(msg, &len, ",\"lin_ang_vel\":{\"lin\":%.3f,\"ang\":%.3f}", rvc_state_float(b->lin_vel, RVC_STATE_VEL_MAX),
+				rvc_state_float(b->ang_vel, RVC_STATE_VEL_MAX));
+	}
+
+	return ok && rvc_delta_append(msg, &len, "}}///");
+}
+
+/**
+* This function sends what has changed since the state frame the client has seen last.
+* When that frame is no longer in the history, the whole state is sent.
+*/
+static void
+rvc_session_catch_up(_rvc_client_s* client, long long since)
+{
+	_rvc_instance_s* instance = client->instance;
+	_rvc_snapshot_s* cur = NULL;
+	_rvc_snapshot_s* old = NULL;
+	char msg[RVC_JSON_SIZE+1] = {0,};
+	int i;
+
+	pthread_mutex_lock(&instance->history_lock);
+
+	if(instance->history_count == 0){
+		pthread_mutex_unlock(&instance->history_lock);
+		return;
+	}
+
+	cur = &instance->history[(instance->history_head + instance->history_count - 1) % RVC_STATE_HISTORY];
+
+	for(i = instance->history_count - 1; i >= 0; i--){
+		if(instance->history[(instance->history_head + i) % RVC_STATE_HISTORY].ts == since){
+			old = &instance->history[(instance->history_head + i) % RVC_STATE_HISTORY];
+			break;
+		}
+	}
+
+	if(old != NULL && rvc_format_delta(old, cur, msg)){
+		pthread_mutex_unlock(&instance->history_lock);
+		rvc_client_put_frame(client, RVC_FRAME_EVENT, msg);
+	}else{
+		rvc_format_state(&cur->tx, cur->ts, msg);
+		pthread_mutex_unlock(&instance->history_lock);
+		rvc_client_put_frame(client, RVC_FRAME_STATE, msg);
+	}
+}
+
+/**
+* This function moves a closed session to the client which presents its token.
+* The settings and the path of the session are resumed and the missed state is sent.
+*/
+static int
+rvc_session_resume(_rvc_client_s* client, const char* token_str, long long since)
+{
+	_rvc_instance_s* instance = client->instance;
+	_rvc_session_s* session = NULL;
+	_rvc_path_s* path = &instance->path;
+	unsigned long long token = 0;
+	int idx = -1;
+	int i;
+
+	if(token_str == NULL || sscanf(token_str, "%llx", &token) != 1 || token == 0){
+		return -1;
+	}
+
+	pthread_mutex_lock(&instance->client_lock);
+
+	for(i = 0; i < RVC_MAX_SESSIONS; i++){
+		session = &instance->sessions[i];
+
+		if(session->token == token && session->attached == false
+				&& rvc_get_time_ms() - session->detached_ms < RVC_SESSION_TTL_MS){
+			idx = i;
+			break;
+		}
+	}
+
+	if(idx < 0){
+		pthread_mutex_unlock(&instance->client_lock);
+		dlog_print(DLOG_DEBUG, LOG_TAG, "session %s cannot be resumed", token_str);
+		return -1;
+	}
+
+	//the session made for this connection is given up
+	memset(&instance->sessions[client->session], 0, sizeof(_rvc_session_s));
+	client->session = idx;
+	session->attached = true;
+
+	pthread_mutex_lock(&client->lock);
+	client->slow_policy = session->slow_policy;
+	client->slow_timeout_ms = session->slow_timeout_ms;
+	client->z_level = session->z_level;
+	client->heartbeat_ms = session->heartbeat_ms;
+	client->idle_ms = session->idle_ms;
+	pthread_mutex_unlock(&client->lock);
+
+	client->agg_mask = session->agg_mask;
+	client->clock_offset_us = session->clock_offset_us;
+	client->motion_ttl_ms = session->motion_ttl_ms;
+	client->watchdog_ms = session->watchdog_ms;
+
+	pthread_mutex_unlock(&instance->client_lock);
+
+	//the summaries of the session go on
+	if(client->agg_mask){
+		rvc_agg_kick(instance);
+	}
+
+	//the path events go to the new connection
+	pthread_mutex_lock(&path->lock);
+	if(path->run && path->owner_token == token){
+		path->owner = client;
+		path->owner_serial = client->serial;
+	}
+	pthread_mutex_unlock(&path->lock);
+
+	rvc_client_send(client, rvc_session_object, token, 1, client->heartbeat_ms, client->idle_ms);
+
+	rvc_session_catch_up(client, since);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "session %016llx is resumed since %lld", token, since);
+
+	return 0;
+}
+
+/**
+* This function returns how long the tx thread may sleep for the heartbeat and the idle timeout.
+* It returns -1 when neither is enabled. The client lock must be held.
+*/
+static int
+rvc_client_wait_ms(_rvc_client_s* client)
+{
+	long long now = rvc_get_time_ms();
+	long long wait = -1;
+
+	if(client->heartbeat_ms > 0){
+		wait = client->tx_ms + client->heartbeat_ms - now;
+	}
+
+	if(client->idle_ms > 0 && (wait < 0 || client->rx_us / 1000 + client->idle_ms - now < wait)){
+		wait = client->rx_us / 1000 + client->idle_ms - now;
+	}
+
+	return wait < 0 ? -1 : (int)(wait > 0 ? wait : 1);
+}
+
+/**
+* This function transmits the robot information to a mobile.
+* It sleeps until a frame is queued by the telemetry scheduler or an event.
+*/
+static void*
+tx_thread_run(void *data)
+{
+	_rvc_client_s* client = (_rvc_client_s*)data;
+	int ret = 0;
+	int wait_ms = 0;
+	long long now = 0;
+	struct pollfd pfd = {0,};
+
+	rvc_thread_background();
+
+	if(client == NULL){
+		service_app_exit();
+		return NULL;
+	}
+
+	while(client->tx_run){
+		ret = rvc_client_flush(client);
+
+		if(ret == -1 || rvc_client_is_slow(client)){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "client %d is disconnected, ret = %d", client->socket, ret);
+			break;
+		}
+
+		if(ret == 1){
+			pfd.fd = client->socket;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, RVC_TX_POLL_MS);
+		}else{
+			pthread_mutex_lock(&client->lock);
+			if(client->tx_run && client->q_count == 0){
+				wait_ms = rvc_client_wait_ms(client);
+
+				if(wait_ms > 0){
+					rvc_cond_wait_ms(&client->cond, &client->lock, wait_ms);
+				}else if(wait_ms < 0){
+					pthread_cond_wait(&client->cond, &client->lock);
+				}
+			}
+			pthread_mutex_unlock(&client->lock);
+		}
+
+		rvc_count_wakeup(client->instance);
+
+		now = rvc_get_time_ms();
+
+		if(client->idle_ms > 0 && now - client->rx_us / 1000 >= client->idle_ms){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "client %d is silent for %lld ms", client->socket, now - client->rx_us / 1000);
+			break;
+		}
+
+		if(client->heartbeat_ms > 0 && now - client->tx_ms >= client->heartbeat_ms){
+			rvc_client_send(client, rvc_heartbeat_object, rvc_get_time_us());
+		}
+	}
+
+	//wake the rx thread up, it releases the client
+	shutdown(client->socket, SHUT_RDWR);
+
+	return NULL;
+}
+
+/**
+* This function publishes a state frame to the multicast group.
+* Every datagram has a sequence number so that observers can detect a loss.
+*/
+static void
+rvc_mcast_publish(_rvc_instance_s* instance, const char* msg)
+{
+	char dgram[RVC_MCAST_SIZE] = {0,};
+	int len = 0;
+
+	pthread_mutex_lock(&instance->mcast_lock);
+
+	if(instance->mcast_run){
+		//the stream delimiter is not needed in a datagram
+		len = strlen(msg);
+		if(len >= 3 && strcmp(msg + len - 3, "///") == 0){
+			len -= 3;
+		}
+
+		len = snprintf(dgram, RVC_MCAST_SIZE, "{\"seq\":%u,\"state\":%.*s}", instance->mcast_seq++, len, msg);
+
+		if(sendto(instance->mcast_socket, dgram, len, MSG_DONTWAIT, (struct sockaddr*)&instance->mcast_addr, sizeof(instance->mcast_addr)) == -1){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "mcast send failed! errno = %d", errno);
+		}
+	}
+
+	pthread_mutex_unlock(&instance->mcast_lock);
+}
+
+/**
+* This function stops the multicast publisher. The mcast lock must be held.
+*/
+static void
+stop_mcast(_rvc_instance_s* instance)
+{
+	if(instance->mcast_run == false){
+		return;
+	}
+
+	instance->mcast_run = false;
+
+	close(instance->mcast_socket);
+	instance->mcast_socket = 0;
+}
+
+/**
+* This function starts the multicast publisher. The mcast lock must be held.
+* A broadcast address can be used as group as well.
+*/
+static bool
+start_mcast(_rvc_instance_s* instance, const char* group, int port)
+{
+	unsigned char ttl = RVC_MCAST_TTL;
+	int on = 1;
+
+	stop_mcast(instance);
+
+	memset(&instance->mcast_addr, 0, sizeof(instance->mcast_addr));
+	instance->mcast_addr.sin_family = AF_INET;
+	instance->mcast_addr.sin_port = htons(port);
+
+	if(group == NULL || inet_pton(AF_INET, group, &instance->mcast_addr.sin_addr) != 1){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "invalid mcast group %s", group);
+		return false;
+	}
+
+	instance->mcast_socket = socket(PF_INET, SOCK_DGRAM, 0);
+
+	if(instance->mcast_socket == -1){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "mcast create failed!");
+		instance->mcast_socket = 0;
+		return false;
+	}
+
+	if(IN_MULTICAST(ntohl(instance->mcast_addr.sin_addr.s_addr))){
+		setsockopt(instance->mcast_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	}else{
+		setsockopt(instance->mcast_socket, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+	}
+
+	instance->mcast_run = true;
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "mcast started %s:%d", group, port);
+
+	return true;
+}
+
+/**
+* This function picks the telemetry period from the state of the robot.
+* Motion and errors are sent fast, an idle robot without active clients is almost silent.
+*/
+static int
+rvc_tx_period_ms(_rvc_instance_s* instance)
+{
+	_rvc_tx_s* tx = &instance->tx_data;
+
+	if(tx->error != 0 || rvc_is_moving(instance)){
+		return RVC_TX_PERIOD_FAST_MS;
+	}
+
+	if(rvc_get_time_ms() - instance->last_activity_ms < RVC_TX_ACTIVE_MS){
+		return RVC_TX_PERIOD_MS;
+	}
+
+	return RVC_TX_PERIOD_IDLE_MS;
+}
+
+/**
+* This function formats the robot information once per tick into a shared buffer and hands it
+* to every client and to the multicast group. The tick is also brought forward by rvc_tx_kick.
+*/
+static void*
+tick_thread_run(void *data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	_rvc_buf_s* buf = NULL;
+	_rvc_snapshot_s snapshot;
+	long long now = 0;
+	int i;
+
+	rvc_thread_background();
+
+	pthread_mutex_lock(&instance->tick_lock);
+
+	while(instance->tick_run){
+		instance->tx_period_ms = rvc_tx_period_ms(instance);
+
+		if(instance->tick_kick == false){
+			rvc_cond_wait_ms(&instance->tick_cond, &instance->tick_lock, instance->tx_period_ms);
+		}
+
+		instance->tick_kick = false;
+
+		if(instance->tick_run == false){
+			break;
+		}
+
+		pthread_mutex_unlock(&instance->tick_lock);
+
+		rvc_count_wakeup(instance);
+
+		//the ts of the frame is the sequence number of the snapshot
+		snapshot.ts = rvc_get_time_us();
+		snapshot.tx = instance->tx_data;
+		rvc_history_put(instance, &snapshot);
+
+		buf = rvc_buf_get(&instance->pool);
+
+		if(buf != NULL){
+			rvc_format_state(&snapshot.tx, snapshot.ts, buf->data);
+
+			pthread_mutex_lock(&instance->client_lock);
+			for(i = 0; i < RVC_MAX_CLIENTS; i++){
+				if(instance->clients[i].in_use){
+					rvc_client_put_buf(&instance->clients[i], RVC_FRAME_STATE, buf);
+				}
+			}
+			pthread_mutex_unlock(&instance->client_lock);
+
+			rvc_mcast_publish(instance, buf->data);
+
+			dlog_print(DLOG_DEBUG, LOG_TAG, "msg = %s", buf->data);
+
+			rvc_buf_unref(&instance->pool, buf);
+		}
+/*
+		float x, y, q;
+
+		msg_data mq_msg;
+		rvc_get_pose(&x, &y, &q);
+		mq_msg.data_type = 1;
+		mq_msg.data_num = 200;
+		sprintf(mq_msg.data_buff, "pose = (%f, %f, %f)", x, y, q);
+		if (-1 == msgsnd(mqid, &mq_msg, sizeof(msg_data) - sizeof(long), 0)) {
+			perror("msgsnd() failed.");
+		}
+		*/
+		now = rvc_get_time_ms();
+
+		pthread_mutex_lock(&instance->tick_lock);
+
+		if(now - instance->wakeup_window_start >= 60 * 1000){
+			instance->wakeups_per_min = (unsigned int)((instance->wakeups - instance->wakeup_window_base) * 60 * 1000LL / (now - instance->wakeup_window_start));
+			instance->wakeup_window_base = instance->wakeups;
+			instance->wakeup_window_start = now;
+
+			dlog_print(DLOG_DEBUG, LOG_TAG, "telemetry: period %d ms, %u wakeups/min", instance->tx_period_ms, instance->wakeups_per_min);
+		}
+	}
+
+	pthread_mutex_unlock(&instance->tick_lock);
+
+	return NULL;
+}
+
+/**
+* This function starts the telemetry scheduler.
+*/
+static bool
+start_scheduler(_rvc_instance_s* instance)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&instance->tick_lock, NULL);
+	pthread_mutex_init(&instance->history_lock, NULL);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&instance->tick_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	instance->wakeup_window_start = rvc_get_time_ms();
+	instance->tick_run = true;
+
+	if(pthread_create(&instance->tick_thread, NULL, tick_thread_run, (void*)instance) != 0){
+		instance->tick_run = false;
+		dlog_print(DLOG_DEBUG, LOG_TAG, "tick_thread is failed!");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+* This function stops the telemetry scheduler.
+*/
+static void
+stop_scheduler(_rvc_instance_s* instance)
+{
+
+	if(instance->tick_run == false){
+		return;
+	}
+
+	pthread_mutex_lock(&instance->tick_lock);
+	instance->tick_run = false;
+	pthread_cond_signal(&instance->tick_cond);
+	pthread_mutex_unlock(&instance->tick_lock);
+
+	pthread_join(instance->tick_thread, NULL);
+}
+
+/**
+* This function makes the summary of a window which ends now.
+*/
+static void
+rvc_agg_format(const _rvc_agg_window_s* window, long long end, char* msg)
+{
+	const _rvc_agg_stat_s* left = &window->stats[RVC_AGG_WHEEL_LEFT];
+	const _rvc_agg_stat_s* right = &window->stats[RVC_AGG_WHEEL_RIGHT];
+	const _rvc_agg_stat_s* lin = &window->stats[RVC_AGG_LIN];
+	const _rvc_agg_stat_s* ang = &window->stats[RVC_AGG_ANG];
+
+	memset(msg, 0, RVC_JSON_SIZE);
+	snprintf(msg, RVC_JSON_SIZE, rvc_summary_object, window->period_ms, end, (end - window->start_us) / 1000, window->samples,
+			left->min, left->max, rvc_agg_stat_mean(left, window->start_us, end),
+			right->min, right->max, rvc_agg_stat_mean(right, window->start_us, end),
+			lin->min, lin->max, rvc_agg_stat_mean(lin, window->start_us, end),
+			ang->min, ang->max, rvc_agg_stat_mean(ang, window->start_us, end),
+			window->distance, window->rotation,
+			window->events[RVC_AGG_BUMPER], window->events[RVC_AGG_CLIFF], window->events[RVC_AGG_LIFT]);
+}
+
+/**
+* This function returns the windows which at least one client is subscribed to.
+*/
+static unsigned int
+rvc_agg_subscribed(_rvc_instance_s* instance)
+{
+	unsigned int mask = 0;
+	int i;
+
+	pthread_mutex_lock(&instance->client_lock);
+
+	for(i = 0; i < RVC_MAX_CLIENTS; i++){
+		if(instance->clients[i].in_use){
+			mask |= instance->clients[i].agg_mask;
+		}
+	}
+
+	pthread_mutex_unlock(&instance->client_lock);
+
+	return mask;
+}
+
+/**
+* This function returns the window of a length, or -1 when the windows no longer have it.
+* The windows are changed with both locks taken, so the client lock is enough to read them.
+*/
+static int
+rvc_agg_find(const _rvc_agg_s* agg, int period_ms)
+{
+	int i;
+
+	for(i = 0; i < agg->count; i++){
+		if(agg->windows[i].period_ms == period_ms){
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+* This function sends the summaries of the ended windows to their subscribers.
+* It sleeps while nobody is subscribed, a window nobody has received is restarted silently.
+* A summary goes to the subscribers of its window length, the windows may be changed before it is sent.
+*/
+static void*
+agg_thread_run(void *data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	_rvc_agg_s* agg = &instance->agg;
+	_rvc_agg_window_s* window = NULL;
+	_rvc_buf_s* bufs[RVC_AGG_MAX_WINDOWS] = {NULL,};
+	int periods[RVC_AGG_MAX_WINDOWS] = {0,};
+	unsigned int subscribed = 0;
+	unsigned int ready = 0;
+	unsigned int summaries = 0;
+	long long now = 0;
+	long long end = 0;
+	long long wait = 0;
+	int i, j, k;
+
+	rvc_thread_background();
+
+	pthread_mutex_lock(&agg->lock);
+
+	while(agg->run){
+		pthread_mutex_unlock(&agg->lock);
+		subscribed = rvc_agg_subscribed(instance);
+		pthread_mutex_lock(&agg->lock);
+
+		if(agg->kick == false){
+			wait = -1;
+			now = rvc_get_time_us();
+
+			for(i = 0; i < agg->count; i++){
+				end = agg->windows[i].start_us + agg->windows[i].period_ms * 1000LL;
+
+				if((subscribed & (1u << i)) && (wait < 0 || end - now < wait)){
+					wait = end - now;
+				}
+			}
+
+			if(wait < 0){
+				pthread_cond_wait(&agg->cond, &agg->lock);
+			}else if(wait > 0){
+				rvc_cond_wait_ms(&agg->cond, &agg->lock, (int)((wait + 999) / 1000));
+			}
+		}
+
+		agg->kick = false;
+
+		if(agg->run == false){
+			break;
+		}
+
+		ready = 0;
+		summaries = 0;
+		now = rvc_get_time_us();
+
+		for(i = 0; i < agg->count; i++){
+			window = &agg->windows[i];
+			end = window->start_us + window->period_ms * 1000LL;
+
+			if(end > now){
+				continue;
+			}
+
+			//a window which has ended long ago was not timed, nobody was subscribed to it
+			if((subscribed & (1u << i)) && now - end < window->period_ms * 1000LL){
+				bufs[i] = rvc_buf_get(&instance->pool);
+
+				if(bufs[i] != NULL){
+					rvc_agg_format(window, now, bufs[i]->data);
+					periods[i] = window->period_ms;
+					ready |= 1u << i;
+					summaries++;
+				}
+			}
+
+			rvc_agg_window_reset(window, &instance->tx_data, now);
+		}
+
+		pthread_mutex_unlock(&agg->lock);
+
+		if(ready){
+			rvc_count_wakeup(instance);
+
+			pthread_mutex_lock(&instance->client_lock);
+			for(i = 0; i < RVC_AGG_MAX_WINDOWS; i++){
+				if((ready & (1u << i)) == 0){
+					continue;
+				}
+
+				//the window was removed while the summary was made
+				k = rvc_agg_find(agg, periods[i]);
+				if(k < 0){
+					continue;
+				}
+
+				for(j = 0; j < RVC_MAX_CLIENTS; j++){
+					if(instance->clients[j].in_use && (instance->clients[j].agg_mask & (1u << k))){
+						rvc_client_put_buf(&instance->clients[j], RVC_FRAME_EVENT, bufs[i]);
+					}
+				}
+			}
+			pthread_mutex_unlock(&instance->client_lock);
+
+			for(i = 0; i < RVC_AGG_MAX_WINDOWS; i++){
+				if(ready & (1u << i)){
+					rvc_buf_unref(&instance->pool, bufs[i]);
+					bufs[i] = NULL;
+				}
+			}
+		}
+
+		pthread_mutex_lock(&agg->lock);
+		agg->sent += summaries;
+	}
+
+	pthread_mutex_unlock(&agg->lock);
+
+	return NULL;
+}
+
+/**
+* This function maps the subscriptions of a client to the windows after they are changed.
+* A subscription is kept when a window of the same length is still there.
+*/
+static unsigned int
+rvc_agg_remap(unsigned int mask, const int* old_ms, int old_count, const _rvc_agg_s* agg)
+{
+	unsigned int remapped = 0;
+	int i, j;
+
+	for(i = 0; i < old_count; i++){
+		if((mask & (1u << i)) == 0){
+			continue;
+		}
+
+		for(j = 0; j < agg->count; j++){
+			if(agg->windows[j].period_ms == old_ms[i]){
+				remapped |= 1u << j;
+			}
+		}
+	}
+
+	return remapped;
+}
+
+/**
+* This function replaces the aggregation windows with the lengths in ms of the array.
+*/
+static int
+rvc_agg_configure(_rvc_instance_s* instance, JsonArray* windows)
+{
+	_rvc_agg_s* agg = &instance->agg;
+	int old_ms[RVC_AGG_MAX_WINDOWS] = {0,};
+	int new_ms[RVC_AGG_MAX_WINDOWS] = {0,};
+	int old_count = 0;
+	int count = 0;
+	long long now = 0;
+	int i;
+
+	if(windows == NULL){
+		return -1;
+	}
+
+	count = json_array_get_length(windows);
+
+	if(count < 1 || count > RVC_AGG_MAX_WINDOWS){
+		return -1;
+	}
+
+	for(i = 0; i < count; i++){
+		new_ms[i] = (int)json_node_get_int(json_array_get_element(windows, i));
+
+		if(new_ms[i] < RVC_AGG_WINDOW_MIN_MS || new_ms[i] > RVC_AGG_WINDOW_MAX_MS){
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&instance->client_lock);
+	pthread_mutex_lock(&agg->lock);
+
+	old_count = agg->count;
+	for(i = 0; i < old_count; i++){
+		old_ms[i] = agg->windows[i].period_ms;
+	}
+
+	now = rvc_get_time_us();
+	agg->count = count;
+	for(i = 0; i < count; i++){
+		agg->windows[i].period_ms = new_ms[i];
+		rvc_agg_window_reset(&agg->windows[i], &instance->tx_data, now);
+	}
+
+	for(i = 0; i < RVC_MAX_CLIENTS; i++){
+		instance->clients[i].agg_mask = rvc_agg_remap(instance->clients[i].agg_mask, old_ms, old_count, agg);
+	}
+	for(i = 0; i < RVC_MAX_SESSIONS; i++){
+		instance->sessions[i].agg_mask = rvc_agg_remap(instance->sessions[i].agg_mask, old_ms, old_count, agg);
+	}
+
+	agg->kick = true;
+	pthread_cond_signal(&agg->cond);
+
+	pthread_mutex_unlock(&agg->lock);
+	pthread_mutex_unlock(&instance->client_lock);
+
+	return 0;
+}
+
+/**
+* This function subscribes a client to the windows whose lengths in ms are in the array.
+* An empty array ends the subscription.
+*/
+static int
+rvc_agg_subscribe(_rvc_client_s* client, JsonArray* windows)
+{
+	_rvc_instance_s* instance = client->instance;
+	_rvc_agg_s* agg = &instance->agg;
+	unsigned int mask = 0;
+	int period = 0;
+	int count = 0;
+	int found = 0;
+	int i, j;
+
+	if(windows == NULL){
+		return -1;
+	}
+
+	count = json_array_get_length(windows);
+
+	pthread_mutex_lock(&instance->client_lock);
+	pthread_mutex_lock(&agg->lock);
+
+	for(i = 0; i < count; i++){
+		period = (int)json_node_get_int(json_array_get_element(windows, i));
+		found = false;
+
+		for(j = 0; j < agg->count; j++){
+			if(agg->windows[j].period_ms == period){
+				mask |= 1u << j;
+				found = true;
+			}
+		}
+
+		if(found == false){
+			pthread_mutex_unlock(&agg->lock);
+			pthread_mutex_unlock(&instance->client_lock);
+			return -1;
+		}
+	}
+
+	client->agg_mask = mask;
+
+	agg->kick = true;
+	pthread_cond_signal(&agg->cond);
+
+	pthread_mutex_unlock(&agg->lock);
+	pthread_mutex_unlock(&instance->client_lock);
+
+	return 0;
+}
+
+/**
+* This function sends the aggregation windows and the subscriptions of a client.
+*/
+static void
+rvc_agg_reply(_rvc_client_s* client)
+{
+	_rvc_instance_s* instance = client->instance;
+	_rvc_agg_s* agg = &instance->agg;
+	char windows[RVC_AGG_MAX_WINDOWS * 12] = {0,};
+	char subscribed[RVC_AGG_MAX_WINDOWS * 12] = {0,};
+	unsigned int mask = 0;
+	unsigned int sent = 0;
+	int wlen = 0;
+	int slen = 0;
+	int i;
+
+	pthread_mutex_lock(&instance->client_lock);
+	mask = client->agg_mask;
+	pthread_mutex_unlock(&instance->client_lock);
+
+	pthread_mutex_lock(&agg->lock);
+
+	for(i = 0; i < agg->count; i++){
+		wlen += snprintf(windows + wlen, sizeof(windows) - wlen, "%s%d", wlen ? "," : "", agg->windows[i].period_ms);
+
+		if(mask & (1u << i)){
+			slen += snprintf(subscribed + slen, sizeof(subscribed) - slen, "%s%d", slen ? "," : "", agg->windows[i].period_ms);
+		}
+	}
+	sent = agg->sent;
+
+	pthread_mutex_unlock(&agg->lock);
+
+	rvc_client_send(client, rvc_aggregate_object, windows, subscribed, sent);
+}
+
+/**
+* This function starts the aggregation with the default windows.
+* It must be started before the callbacks, which feed it.
+*/
+static void
+start_aggregate(_rvc_instance_s* instance)
+{
+	_rvc_agg_s* agg = &instance->agg;
+	pthread_condattr_t attr;
+	long long now = rvc_get_time_us();
+
+	pthread_mutex_init(&agg->lock, NULL);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&agg->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	agg->windows[0].period_ms = RVC_AGG_WINDOW_SHORT_MS;
+	agg->windows[1].period_ms = RVC_AGG_WINDOW_LONG_MS;
+	agg->count = 2;
+	rvc_agg_window_reset(&agg->windows[0], &instance->tx_data, now);
+	rvc_agg_window_reset(&agg->windows[1], &instance->tx_data, now);
+
+	agg->run = true;
+
+	if(pthread_create(&agg->thread, NULL, agg_thread_run, (void*)instance) != 0){
+		agg->run = false;
+		dlog_print(DLOG_DEBUG, LOG_TAG, "agg_thread is failed!");
+	}
+}
+
+/**
+* This function stops the aggregation thread. The windows are still fed by the callbacks.
+*/
+static void
+stop_aggregate(_rvc_instance_s* instance)
+{
+	_rvc_agg_s* agg = &instance->agg;
+
+	if(agg->run == false){
+		return;
+	}
+
+	pthread_mutex_lock(&agg->lock);
+	agg->run = false;
+	pthread_cond_signal(&agg->cond);
+	pthread_mutex_unlock(&agg->lock);
+
+	pthread_join(agg->thread, NULL);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "aggregate: %u summaries", agg->sent);
+}
+
+static void wav_play_completed (int id, void *user_data) {
+	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: wav play done");
+}
+
+static void progress_cb(int download_id, unsigned long long received, void *user_data);
+static  void download_cb (int download_id, download_state_e state, void *user_data) {
+	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG DOWNLOAD:%d", state);
+	if (state != DOWNLOAD_STATE_COMPLETED) {
+		return;
+	}
+	int wav_id;
+	int res = wav_player_start("/tmp/voice.wav", SOUND_TYPE_MEDIA, wav_play_completed, NULL, &wav_id);
+	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: wav_id %d, res %d", wav_id, res);
+}
+
+static void progress_cb(int download_id, unsigned long long received, void *user_data) {
+	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG DOWNLOAD PROG:%f", received/1000.0);
+}
+
+/**
+* This function downloads a wav file and plays it when it is complete.
+*/
+static int
+rvc_wav_download(const char* uri)
+{
+	int down_id;
+	download_create(&down_id);
+	download_set_url(down_id, uri);
+	download_set_destination(down_id, "/tmp");
+	download_set_file_name(down_id, "voice.wav");
+	download_set_state_changed_cb (down_id, download_cb, NULL);
+	download_set_progress_cb(down_id, progress_cb, NULL);
+	int res = download_start(down_id);
+	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: DOWN START: %d", res);
+	return res;
+}
+
+typedef struct {
+	char *language;
+	int voice_type;
+} tts_voice_s;
+
+typedef struct {
+	char *text;
+	int utt_id;
+} tts_text_s;
+
+static tts_h g_tts;
+static GList *g_tts_voice_list = NULL;
+static tts_voice_s *g_current_voice = NULL;
+static tts_state_e g_current_state;
+static GList *g_tts_text_list = NULL;
+static bool g_tts_play_pending = false;
+//the state and the pending play are changed by the TTS callback and by the command threads
+static pthread_mutex_t g_tts_play_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t g_tts_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_tts_init_result = 0;	/* 0: not initialized, 1: ready, -1: failed */
+static long long g_tts_init_ms = -1;
+
+static void
+__tts_state_changed_cb(tts_h tts, tts_state_e previous, tts_state_e current, void* user_data)
+{
+	bool play = false;
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "== State is changed (%d) to (%d)", previous, current);
+
+	pthread_mutex_lock(&g_tts_play_lock);
+	g_current_state = current;
+	if (TTS_STATE_CREATED == previous && TTS_STATE_READY == current) {
+		//play the text which has been added while tts_prepare was in progress
+		play = g_tts_play_pending;
+		g_tts_play_pending = false;
+	}
+	pthread_mutex_unlock(&g_tts_play_lock);
+
+	if (play && 0 != tts_play(g_tts)) {
+		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to start");
+	}
+}
+
+static void
+__tts_utterance_completed_cb(tts_h tts, int utt_id, void* user_data)
+{
+
+}
+
+static void __supported_voice (tts_h tts, const char *language, int voice_type, void *user_data) {
+	dlog_print(DLOG_DEBUG, LOG_TAG, "Lang support: %s, type: %d", language, voice_type);
+}
+
+static int
+init_tts(void *ad)
+{
+	if (0 != tts_create(&g_tts)) {
+		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to tts create");
+		return -1;
+	}
+
+	if (0 != tts_set_state_changed_cb(g_tts, __tts_state_changed_cb, ad)) {
+		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to set state changed cb");
+		tts_destroy(g_tts);
+		return -1;
+	}
+
+	if (0 != tts_set_utterance_completed_cb(g_tts, __tts_utterance_completed_cb, ad)) {
+		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to set utt completed cb");
+		tts_destroy(g_tts);
+		return -1;
+	}
+
+	char *language = NULL;
+	int voice_type;
+
+
+	tts_foreach_supported_voices (g_tts, __supported_voice, NULL);
+	if (0 != tts_get_default_voice(g_tts, &language, &voice_type)) {
+		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to get default voice");
+		tts_destroy(g_tts);
+		return -1;
+	}
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "language: %s", language);
+	free(language);
+	language = "ko_KR";
+	if (NULL != language) {
+		g_current_voice = (tts_voice_s *)calloc(1, sizeof(tts_voice_s));
+		if (NULL == g_current_voice) {
+			dlog_print(DLOG_ERROR, LOG_TAG, "Fail to memory allocation");
+		} else {
+			g_current_voice->language = strdup(language);
+			g_current_voice->voice_type = voice_type;
+		}
+	}
+
+	if (0 != tts_prepare(g_tts)) {
+		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to tts prepare");
+		tts_destroy(g_tts);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+deinit_tts(void *ad)
+{
+   // Destroy TTS handle (service disconnect is included)
+   if (0 != tts_destroy(g_tts))
+   {
+      // Do something
+   }
+}
+
+static void
+__tts_add_text(const char* text, const char* lang)
+{
+	if (NULL != text) {
+		dlog_print(DLOG_DEBUG, LOG_TAG, "Add text (%s)", text);
+		int utt_id;
+		if (NULL != g_current_voice) {
+			if (NULL != g_current_voice->language) {
+				if (0 != tts_add_text(g_tts, text, lang, g_current_voice->voice_type, TTS_SPEED_AUTO, &utt_id)) {
+					dlog_print(DLOG_DEBUG, LOG_TAG, "Fail to add text");
+				} else {
+					tts_text_s *tmp = (tts_text_s *)calloc(1, sizeof(tts_text_s));
+					if (NULL == tmp) {
+						dlog_print(DLOG_ERROR, LOG_TAG, "Fail to memory allocation");
+					} else {
+						tmp->text = strdup(text);
+						tmp->utt_id = utt_id;
+						g_tts_text_list = g_list_append(g_tts_text_list, tmp);
+					}
+				}
+			}
+		}
+	}
+}
+
+static void
+__tts_play() {
+	bool play = false;
+
+	pthread_mutex_lock(&g_tts_play_lock);
+	if (TTS_STATE_READY == g_current_state || TTS_STATE_PAUSED == g_current_state) {
+		play = true;
+	} else if (TTS_STATE_CREATED == g_current_state) {
+		g_tts_play_pending = true;
+	}
+	pthread_mutex_unlock(&g_tts_play_lock);
+
+	if (play && 0 != tts_play(g_tts)) {
+		dlog_print(DLOG_ERROR, LOG_TAG, "Fail to start");
+	}
+}
+
+/**
+* This function initializes TTS once, by the startup thread or by the first tts command.
+* A caller which comes while the initialization is in progress waits for it.
+*/
+static int
+rvc_tts_ensure(void *ad)
+{
+	long long start = 0;
+	int result = 0;
+
+	pthread_mutex_lock(&g_tts_lock);
+
+	if (g_tts_init_result == 0) {
+		start = rvc_get_time_ms();
+		g_tts_init_result = (init_tts(ad) == 0) ? 1 : -1;
+		g_tts_init_ms = rvc_get_time_ms() - start;
+
+		dlog_print(DLOG_DEBUG, LOG_TAG, "init_tts = %d, %lld ms", g_tts_init_result, g_tts_init_ms);
+	}
+
+	result = g_tts_init_result;
+
+	pthread_mutex_unlock(&g_tts_lock);
+
+	return result;
+}
+
+/**
+* This function finds a clip of the bank. The audio lock must be held.
+*/
+static _rvc_clip_s*
+rvc_audio_find(_rvc_audio_s* audio, const char* name)
+{
+	int i;
+
+	for(i = 0; i < RVC_AUDIO_MAX_CLIPS; i++){
+		if(audio->clips[i].pcm != NULL && strcmp(audio->clips[i].name, name) == 0){
+			return &audio->clips[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+* This function reads a little endian integer of a wav header.
+*/
+static unsigned int
+rvc_wav_le(const unsigned char* p, int bytes)
+{
+	unsigned int value = 0;
+
+	while(bytes-- > 0){
+		value = (value << 8) | p[bytes];
+	}
+
+	return value;
+}
+
+/**
+* This function reads a frame of a PCM wav file as a 16 bit mono sample.
+*/
+static int
+rvc_wav_sample(const unsigned char* p, int channels, int bits)
+{
+	int sum = 0;
+	int c;
+
+	for(c = 0; c < channels; c++){
+		if(bits == 16){
+			sum += (short)rvc_wav_le(p + c * 2, 2);
+		}else{
+			sum += ((int)p[c] - 128) << 8;
+		}
+	}
+
+	return sum / channels;
+}
+
+/**
+* This function decodes a PCM wav file to the format of the mixer.
+* 8 and 16 bit, mono and stereo files of any rate are converted to 16 bit mono at RVC_AUDIO_RATE.
+* It returns the number of samples, or -1 when the file is not supported or does not fit in max_bytes.
+*/
+static int
+rvc_wav_decode(const char* path, short** pcm, int max_bytes)
+{
+	FILE* fp = NULL;
+	unsigned char* file = NULL;
+	unsigned char* p = NULL;
+	unsigned char* data = NULL;
+	long size = 0;
+	unsigned int chunk = 0;
+	unsigned int data_len = 0;
+	int format = 0, channels = 0, rate = 0, bits = 0;
+	int frame = 0, frames = 0, samples = 0;
+	int i;
+
+	*pcm = NULL;
+
+	fp = fopen(path, "rb");
+	if(fp == NULL){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "wav %s: open failed, errno = %d", path, errno);
+		return -1;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if(size < 12 || size > RVC_AUDIO_MAX_FILE){
+		fclose(fp);
+		dlog_print(DLOG_DEBUG, LOG_TAG, "wav %s: bad size %ld", path, size);
+		return -1;
+	}
+
+	file = (unsigned char*)malloc(size);
+	if(file == NULL || fread(file, 1, size, fp) != (size_t)size){
+		fclose(fp);
+		free(file);
+		return -1;
+	}
+	fclose(fp);
+
+	if(memcmp(file, "RIFF", 4) != 0 || memcmp(file + 8, "WAVE", 4) != 0){
+		free(file);
+		dlog_print(DLOG_DEBUG, LOG_TAG, "wav %s: not a wave file", path);
+		return -1;
+	}
+
+	//walk the chunks, only "fmt " and "data" are used
+	for(p = file + 12; p + 8 <= file + size; p += 8 + chunk + (chunk & 1)){
+		chunk = rvc_wav_le(p + 4, 4);
+		if(chunk > (unsigned int)(file + size - p - 8)){
+			chunk = file + size - p - 8;
+		}
+
+		if(memcmp(p, "fmt ", 4) == 0 && chunk >= 16){
+			format = rvc_wav_le(p + 8, 2);
+			channels = rvc_wav_le(p + 10, 2);
+			rate = rvc_wav_le(p + 12, 4);
+			bits = rvc_wav_le(p + 22, 2);
+		}else if(memcmp(p, "data", 4) == 0){
+			data = p + 8;
+			data_len = chunk;
+		}
+	}
+
+	if(format != 1 || (bits != 8 && bits != 16) || channels < 1 || channels > 2 || rate < RVC_AUDIO_MIN_RATE || rate > RVC_AUDIO_MAX_RATE || data == NULL){
+		free(file);
+		dlog_print(DLOG_DEBUG, LOG_TAG, "wav %s: unsupported format %d, %d bits, %d ch, %d Hz", path, format, bits, channels, rate);
+		return -1;
+	}
+
+	frame = channels * bits / 8;
+	frames = data_len / frame;
+	samples = (int)((long long)frames * RVC_AUDIO_RATE / rate);
+
+	if(samples <= 0 || samples * (int)sizeof(short) > max_bytes){
+		free(file);
+		dlog_print(DLOG_DEBUG, LOG_TAG, "wav %s: %d samples do not fit in %d bytes", path, samples, max_bytes);
+		return -1;
+	}
+
+	*pcm = (short*)malloc(samples * sizeof(short));
+	if(*pcm == NULL){
+		free(file);
+		return -1;
+	}
+
+	//downmix and resample linearly, the source position is 16.16 fixed point
+	for(i = 0; i < samples; i++){
+		long long pos = ((long long)i * rate << 16) / RVC_AUDIO_RATE;
+		int idx = (int)(pos >> 16);
+		int frac = (int)(pos & 0xffff);
+		int s0 = rvc_wav_sample(data + idx * frame, channels, bits);
+		int s1 = (idx + 1 < frames) ? rvc_wav_sample(data + (idx + 1) * frame, channels, bits) : s0;
+
+		(*pcm)[i] = (short)(s0 + (long long)(s1 - s0) * frac / 65536);
+	}
+
+	free(file);
+
+	return samples;
+}
+
+/**
+* This function loads a clip into the bank, a loaded clip is kept as it is.
+*/
+static int
+rvc_audio_load(_rvc_audio_s* audio, const char* name, const char* path)
+{
+	_rvc_clip_s* clip = NULL;
+	short* pcm = NULL;
+	int samples = 0;
+	int free_bytes = 0;
+	int i;
+
+	if(name == NULL || path == NULL || strlen(name) >= sizeof(clip->name)){
+		return -1;
+	}
+
+	pthread_mutex_lock(&audio->lock);
+	if(rvc_audio_find(audio, name) != NULL){
+		pthread_mutex_unlock(&audio->lock);
+		return 0;
+	}
+	free_bytes = audio->budget - audio->used;
+	pthread_mutex_unlock(&audio->lock);
+
+	//decoding takes a while, the mixer keeps running
+	samples = rvc_wav_decode(path, &pcm, free_bytes);
+	if(samples < 0){
+		return -1;
+	}
+
+	pthread_mutex_lock(&audio->lock);
+
+	for(i = 0; i < RVC_AUDIO_MAX_CLIPS; i++){
+		if(audio->clips[i].pcm == NULL){
+			clip = &audio->clips[i];
+			break;
+		}
+	}
+
+	//the bank may have changed while decoding
+	if(clip == NULL || rvc_audio_find(audio, name) != NULL || audio->used + samples * (int)sizeof(short) > audio->budget){
+		pthread_mutex_unlock(&audio->lock);
+		free(pcm);
+		return -1;
+	}
+
+	snprintf(clip->name, sizeof(clip->name), "%s", name);
+	clip->pcm = pcm;
+	clip->samples = samples;
+	audio->used += samples * sizeof(short);
+
+	pthread_mutex_unlock(&audio->lock);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "clip %s loaded from %s, %d samples", name, path, samples);
+
+	return 0;
+}
+
+/**
+* This function removes a clip from the bank. Its voices are stopped.
+*/
+static int
+rvc_audio_unload(_rvc_audio_s* audio, const char* name)
+{
+	_rvc_clip_s* clip = NULL;
+	int i;
+
+	pthread_mutex_lock(&audio->lock);
+
+	clip = rvc_audio_find(audio, name);
+	if(clip == NULL){
+		pthread_mutex_unlock(&audio->lock);
+		return -1;
+	}
+
+	for(i = 0; i < RVC_AUDIO_MAX_VOICES; i++){
+		if(audio->voices[i].clip == clip){
+			audio->voices[i].clip = NULL;
+			audio->active--;
+		}
+	}
+
+	audio->used -= clip->samples * sizeof(short);
+	free(clip->pcm);
+	memset(clip, 0, sizeof(_rvc_clip_s));
+
+	pthread_mutex_unlock(&audio->lock);
+
+	return 0;
+}
+
+/**
+* This function loads a clip from a file of the clip directory. The file is named by a client,
+* a name with a directory part is refused so that no other file can be read.
+*/
+static int
+rvc_audio_load_file(_rvc_audio_s* audio, const char* name, const char* file)
+{
+	char path[256] = {0,};
+
+	if(file == NULL || file[0] == '\0' || file[0] == '.' || strchr(file, '/') != NULL){
+		return -1;
+	}
+
+	if(snprintf(path, sizeof(path), "%s/%s", RVC_AUDIO_DIR, file) >= (int)sizeof(path)){
+		return -1;
+	}
+
+	return rvc_audio_load(audio, name, path);
+}
+
+/**
+* This function starts a clip on a free voice of the mixer.
+* A clip of the default set is loaded on its first use.
+*/
+static int
+rvc_audio_play(_rvc_audio_s* audio, const char* name, int gain)
+{
+	_rvc_clip_s* clip = NULL;
+	int i;
+
+	if(audio->run == false || name == NULL){
+		return -1;
+	}
+
+	//a larger gain overflows the product in the mixer
+	if(gain < 0){
+		gain = 0;
+	}else if(gain > RVC_AUDIO_MAX_GAIN){
+		gain = RVC_AUDIO_MAX_GAIN;
+	}
+
+	pthread_mutex_lock(&audio->lock);
+	clip = rvc_audio_find(audio, name);
+	pthread_mutex_unlock(&audio->lock);
+
+	if(clip == NULL){
+		for(i = 0; rvc_audio_clips[i].name != NULL; i++){
+			if(strcmp(rvc_audio_clips[i].name, name) == 0){
+				rvc_audio_load(audio, name, rvc_audio_clips[i].path);
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&audio->lock);
+
+	clip = rvc_audio_find(audio, name);
+	if(clip == NULL || audio->out == NULL){
+		pthread_mutex_unlock(&audio->lock);
+		return -1;
+	}
+
+	for(i = 0; i < RVC_AUDIO_MAX_VOICES; i++){
+		if(audio->voices[i].clip == NULL){
+			audio->voices[i].clip = clip;
+			audio->voices[i].pos = 0;
+			audio->voices[i].gain = gain * 256 / 100;
+			audio->voices[i].start_us = rvc_get_time_us();
+			audio->active++;
+
+			pthread_cond_signal(&audio->cond);
+			pthread_mutex_unlock(&audio->lock);
+			return 0;
+		}
+	}
+
+	pthread_mutex_unlock(&audio->lock);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "clip %s: no free voice", name);
+
+	return -1;
+}
+
+/**
+* This function splits an http url into host, port and path.
+*/
+static bool
+rvc_url_parse(const char* url, char* host, int host_len, int* port, const char** path)
+{
+	const char* p = NULL;
+	const char* end = NULL;
+	int len = 0;
+
+	if(url == NULL || strncmp(url, "http://", 7) != 0){
+		return false;
+	}
+
+	p = url + 7;
+	end = p + strcspn(p, ":/");
+	len = end - p;
+
+	if(len == 0 || len >= host_len){
+		return false;
+	}
+
+	memcpy(host, p, len);
+	host[len] = '\0';
+
+	*port = 80;
+	if(*end == ':'){
+		*port = atoi(end + 1);
+		end += strcspn(end, "/");
+	}
+
+	*path = (*end == '/') ? end : "/";
+
+	return *port > 0 && *port < 65536;
+}
+
+/**
+* This function connects to the server of a stream and sends the request.
+* It returns the socket, or -1 on failure.
+*/
+static int
+rvc_stream_connect(const char* url)
+{
+	char host[128] = {0,};
+	char service[8] = {0,};
+	char request[RVC_STREAM_HEADER_SIZE] = {0,};
+	const char* path = NULL;
+	struct addrinfo hints;
+	struct addrinfo* res = NULL;
+	struct timeval tv = {RVC_STREAM_TIMEOUT_MS / 1000, (RVC_STREAM_TIMEOUT_MS % 1000) * 1000};
+	int port = 0;
+	int sock = -1;
+	int len = 0;
+
+	if(rvc_url_parse(url, host, sizeof(host), &port, &path) == false){
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+
+	if(getaddrinfo(host, service, &hints, &res) != 0 || res == NULL){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "stream: cannot resolve %s", host);
+		return -1;
+	}
+
+	sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if(sock != -1){
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		if(connect(sock, res->ai_addr, res->ai_addrlen) == -1){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "stream: connect to %s:%d failed, errno = %d", host, port, errno);
+			close(sock);
+			sock = -1;
+		}
+	}
+
+	freeaddrinfo(res);
+
+	if(sock == -1){
+		return -1;
+	}
+
+	//http 1.0, the body is neither chunked nor kept alive
+	len = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\nAccept: audio/wav\r\n\r\n", path, host);
+
+	if(len >= (int)sizeof(request) || send(sock, request, len, MSG_NOSIGNAL) != len){
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/**
+* This function puts a sample into the ring of the stream, it waits while the ring is full.
+* The audio lock must be held. It returns false when the stream is stopped.
+*/
+static bool
+rvc_stream_put(_rvc_audio_s* audio, short sample)
+{
+	_rvc_stream_s* stream = &audio->stream;
+
+	while(stream->count == RVC_STREAM_RING && stream->run){
+		//a full ring is always enough to start
+		if(stream->playing == false){
+			stream->playing = true;
+			pthread_cond_signal(&audio->cond);
+		}
+		pthread_cond_wait(&stream->space, &audio->lock);
+	}
+
+	if(stream->run == false){
+		return false;
+	}
+
+	stream->ring[(stream->head + stream->count) % RVC_STREAM_RING] = sample;
+	stream->count++;
+
+	return true;
+}
+
+/**
+* This function resamples the frames received from the stream into the ring.
+* It returns the number of bytes used, a partial frame is left for the next call.
+*/
+static int
+rvc_stream_feed(_rvc_audio_s* audio, const unsigned char* data, int len)
+{
+	_rvc_stream_s* stream = &audio->stream;
+	int frame = stream->channels * stream->bits / 8;
+	int used = 0;
+	int x = 0;
+
+	pthread_mutex_lock(&audio->lock);
+
+	for(used = 0; used + frame <= len; used += frame){
+		x = rvc_wav_sample(data + used, stream->channels, stream->bits);
+
+		//the phase is the position between the previous and this frame, 16.16 fixed point
+		while(stream->phase < 65536){
+			if(rvc_stream_put(audio, (short)(stream->prev + (long long)(x - stream->prev) * stream->phase / 65536)) == false){
+				pthread_mutex_unlock(&audio->lock);
+				return -1;
+			}
+			stream->phase += stream->step;
+		}
+
+		stream->phase -= 65536;
+		stream->prev = x;
+	}
+
+	if(stream->playing == false && stream->count >= stream->prebuffer){
+		stream->playing = true;
+		pthread_cond_signal(&audio->cond);
+	}
+
+	pthread_mutex_unlock(&audio->lock);
+
+	return used;
+}
+
+/**
+* This function parses the http and wav headers at the start of a stream.
+* It returns the offset of the first sample in buf, 0 when more data is needed, or -1 on error.
+*/
+static int
+rvc_stream_header(_rvc_stream_s* stream, const unsigned char* buf, int len)
+{
+	const unsigned char* body = NULL;
+	const unsigned char* p = NULL;
+	unsigned int chunk = 0;
+	int rate = 0;
+
+	for(p = buf; p + 4 <= buf + len && body == NULL; p++){
+		if(memcmp(p, "\r\n\r\n", 4) == 0){
+			body = p;
+		}
+	}
+
+	if(body == NULL){
+		return 0;
+	}
+
+	if(len < 12 || strncmp((const char*)buf, "HTTP/1.", 7) != 0 || strncmp((const char*)buf + 9, "200", 3) != 0){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "stream: bad response %.12s", buf);
+		return -1;
+	}
+
+	body += 4;
+
+	if(buf + len - body < 12){
+		return 0;
+	}
+
+	if(memcmp(body, "RIFF", 4) != 0 || memcmp(body + 8, "WAVE", 4) != 0){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "stream: not a wave file");
+		return -1;
+	}
+
+	for(p = body + 12; p + 8 <= buf + len; p += 8 + chunk + (chunk & 1)){
+		chunk = rvc_wav_le(p + 4, 4);
+
+		if(memcmp(p, "data", 4) == 0){
+			//the 16.16 step of a rate out of the range would not fit
+			if(stream->format != 1 || (stream->bits != 8 && stream->bits != 16) || stream->channels < 1 || stream->channels > 2
+					|| rate < RVC_AUDIO_MIN_RATE || rate > RVC_AUDIO_MAX_RATE){
+				dlog_print(DLOG_DEBUG, LOG_TAG, "stream: unsupported format %d, %d bits, %d ch, %d Hz",
+						stream->format, stream->bits, stream->channels, rate);
+				return -1;
+			}
+
+			stream->step = (int)(((long long)rate << 16) / RVC_AUDIO_RATE);
+			return p + 8 - buf;
+		}
+
+		if(p + 8 + chunk > buf + len){
+			return 0;
+		}
+
+		if(memcmp(p, "fmt ", 4) == 0 && chunk >= 16){
+			stream->format = rvc_wav_le(p + 8, 2);
+			stream->channels = rvc_wav_le(p + 10, 2);
+			rate = rvc_wav_le(p + 12, 4);
+			stream->bits = rvc_wav_le(p + 22, 2);
+		}
+	}
+
+	return 0;
+}
+
+/**
+* This function reads a remote wav file and feeds the mixer while it is received.
+* When the stream cannot be played, the file is downloaded and played as before.
+*/
+static void*
+stream_thread_run(void *data)
+{
+	_rvc_audio_s* audio = (_rvc_audio_s*)data;
+	_rvc_stream_s* stream = &audio->stream;
+	unsigned char buf[RVC_STREAM_HEADER_SIZE];
+	int fill = 0;
+	int offset = 0;
+	int used = 0;
+	int len = 0;
+	int sock = -1;
+
+	rvc_thread_background();
+
+	sock = rvc_stream_connect(stream->url);
+
+	//the socket is shut down by rvc_stream_stop
+	pthread_mutex_lock(&audio->lock);
+	stream->socket = sock;
+	pthread_mutex_unlock(&audio->lock);
+
+	while(sock != -1 && stream->run){
+		len = recv(sock, buf + fill, sizeof(buf) - fill, 0);
+
+		if(len <= 0){
+			if(len < 0){
+				dlog_print(DLOG_DEBUG, LOG_TAG, "stream: recv failed, errno = %d", errno);
+			}
+			break;
+		}
+
+		fill += len;
+		stream->received += len;
+
+		if(stream->step == 0){
+			offset = rvc_stream_header(stream, buf, fill);
+
+			if(offset < 0 || (offset == 0 && fill == sizeof(buf))){
+				break;
+			}
+			if(offset == 0){
+				continue;
+			}
+
+			fill -= offset;
+			memmove(buf, buf + offset, fill);
+		}
+
+		used = rvc_stream_feed(audio, buf, fill);
+		if(used < 0){
+			break;
+		}
+
+		fill -= used;
+		memmove(buf, buf + used, fill);
+	}
+
+	pthread_mutex_lock(&audio->lock);
+
+	if(sock != -1){
+		close(sock);
+	}
+
+	stream->eof = true;
+	stream->socket = -1;
+
+	//a short file is played when it is complete
+	if(stream->count > 0){
+		stream->playing = true;
+		pthread_cond_signal(&audio->cond);
+	}
+
+	pthread_mutex_unlock(&audio->lock);
+
+	if(stream->step == 0 && stream->run){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "stream: %s cannot be streamed, downloading it", stream->url);
+		rvc_wav_download(stream->url);
+	}
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "stream: %lld bytes received, %u underruns", stream->received, stream->underruns);
+
+	return NULL;
+}
+
+/**
+* This function stops the stream being played.
+*/
+static void
+rvc_stream_stop(_rvc_audio_s* audio)
+{
+	_rvc_stream_s* stream = &audio->stream;
+
+	pthread_mutex_lock(&audio->lock);
+
+	if(stream->started == false){
+		pthread_mutex_unlock(&audio->lock);
+		return;
+	}
+
+	stream->run = false;
+	stream->playing = false;
+	pthread_cond_signal(&stream->space);
+
+	//wake the reader up from recv
+	if(stream->socket != -1){
+		shutdown(stream->socket, SHUT_RDWR);
+	}
+
+	pthread_mutex_unlock(&audio->lock);
+
+	pthread_join(stream->thread, NULL);
+
+	pthread_mutex_lock(&audio->lock);
+	stream->started = false;
+	stream->count = 0;
+	pthread_mutex_unlock(&audio->lock);
+}
+
+/**
+* This function starts to play a remote wav file, the previous stream is stopped.
+*/
+static int
+rvc_stream_start(_rvc_audio_s* audio, const char* url)
+{
+	_rvc_stream_s* stream = &audio->stream;
+
+	if(audio->run == false || audio->out == NULL || stream->ring == NULL || strlen(url) >= sizeof(stream->url)){
+		return -1;
+	}
+
+	rvc_stream_stop(audio);
+
+	pthread_mutex_lock(&audio->lock);
+
+	snprintf(stream->url, sizeof(stream->url), "%s", url);
+	stream->socket = -1;
+	stream->head = 0;
+	stream->count = 0;
+	stream->prebuffer = RVC_STREAM_PREBUFFER_MS * RVC_AUDIO_RATE / 1000;
+	stream->phase = 0;
+	stream->step = 0;
+	stream->prev = 0;
+	stream->format = 0;
+	stream->channels = 0;
+	stream->bits = 0;
+	stream->eof = false;
+	stream->playing = false;
+	stream->underruns = 0;
+	stream->received = 0;
+	stream->start_us = rvc_get_time_us();
+	stream->first_sound_us = -1;
+	stream->run = true;
+	stream->started = true;
+
+	if(pthread_create(&stream->thread, NULL, stream_thread_run, (void*)audio) != 0){
+		stream->run = false;
+		stream->started = false;
+		pthread_mutex_unlock(&audio->lock);
+		dlog_print(DLOG_DEBUG, LOG_TAG, "stream_thread is failed!");
+		return -1;
+	}
+
+	pthread_mutex_unlock(&audio->lock);
+
+	return 0;
+}
+
+/**
+* This function stops every voice of the mixer.
+*/
+static void
+rvc_audio_stop_all(_rvc_audio_s* audio)
+{
+	int i;
+
+	pthread_mutex_lock(&audio->lock);
+
+	for(i = 0; i < RVC_AUDIO_MAX_VOICES; i++){
+		audio->voices[i].clip = NULL;
+	}
+	audio->active = 0;
+
+	pthread_mutex_unlock(&audio->lock);
+
+	rvc_stream_stop(audio);
+}
+
+/**
+* This function mixes one period of the stream. The audio lock must be held.
+* On an underrun the stream is buffered again, the missing part of the period is silent.
+*/
+static void
+rvc_stream_mix(_rvc_audio_s* audio, int* acc)
+{
+	_rvc_stream_s* stream = &audio->stream;
+	int n;
+
+	if(stream->playing == false){
+		return;
+	}
+
+	if(stream->first_sound_us < 0){
+		stream->first_sound_us = rvc_get_time_us() - stream->start_us;
+		dlog_print(DLOG_DEBUG, LOG_TAG, "stream: first sound after %lld ms", stream->first_sound_us / 1000);
+	}
+
+	for(n = 0; n < RVC_AUDIO_PERIOD && stream->count > 0; n++){
+		acc[n] += stream->ring[stream->head];
+		stream->head = (stream->head + 1) % RVC_STREAM_RING;
+		stream->count--;
+	}
+
+	if(stream->count == 0){
+		stream->playing = false;
+
+		if(stream->eof == false){
+			stream->underruns++;
+			dlog_print(DLOG_DEBUG, LOG_TAG, "stream: underrun %u", stream->underruns);
+		}
+	}
+
+	pthread_cond_signal(&stream->space);
+}
+
+/**
+* This function mixes one period of the active voices. The audio lock must be held.
+*/
+static void
+rvc_audio_mix(_rvc_audio_s* audio, short* out)
+{
+	int acc[RVC_AUDIO_PERIOD] = {0,};
+	_rvc_voice_s* voice = NULL;
+	int i, n, s;
+
+	for(i = 0; i < RVC_AUDIO_MAX_VOICES; i++){
+		voice = &audio->voices[i];
+
+		if(voice->clip == NULL){
+			continue;
+		}
+
+		if(voice->pos == 0){
+			audio->latency_last_us = rvc_get_time_us() - voice->start_us;
+			if(audio->latency_last_us > audio->latency_max_us){
+				audio->latency_max_us = audio->latency_last_us;
+			}
+		}
+
+		for(n = 0; n < RVC_AUDIO_PERIOD && voice->pos < voice->clip->samples; n++){
+			acc[n] += voice->clip->pcm[voice->pos++] * voice->gain >> 8;
+		}
+
+		if(voice->pos >= voice->clip->samples){
+			voice->clip = NULL;
+			audio->active--;
+			audio->played++;
+		}
+	}
+
+	rvc_stream_mix(audio, acc);
+
+	for(n = 0; n < RVC_AUDIO_PERIOD; n++){
+		s = acc[n];
+		out[n] = (short)(s > 32767 ? 32767 : (s < -32768 ? -32768 : s));
+	}
+}
+
+/**
+* This function feeds the audio output with the mixed voices.
+* The output is prepared only while a voice is active, the write paces the loop.
+*/
+static void*
+mixer_thread_run(void *data)
+{
+	_rvc_audio_s* audio = (_rvc_audio_s*)data;
+	short out[RVC_AUDIO_PERIOD];
+	audio_out_h handle = NULL;
+	int ret = 0;
+
+	rvc_thread_background();
+
+	pthread_mutex_lock(&audio->lock);
+
+	while(audio->run){
+		if(audio->active == 0 && audio->stream.playing == false){
+			if(audio->prepared){
+				audio_out_unprepare(audio->out);
+				audio->prepared = false;
+			}
+
+			pthread_cond_wait(&audio->cond, &audio->lock);
+			continue;
+		}
+
+		if(audio->prepared == false){
+			ret = audio_out_prepare(audio->out);
+			if(ret != AUDIO_IO_ERROR_NONE){
+				dlog_print(DLOG_DEBUG, LOG_TAG, "audio_out_prepare failed! ret = %d", ret);
+				memset(audio->voices, 0, sizeof(audio->voices));
+				audio->active = 0;
+				audio->stream.playing = false;
+				continue;
+			}
+			audio->prepared = true;
+		}
+
+		rvc_audio_mix(audio, out);
+		handle = audio->out;
+
+		pthread_mutex_unlock(&audio->lock);
+		ret = audio_out_write(handle, out, sizeof(out));
+		pthread_mutex_lock(&audio->lock);
+
+		if(ret < 0){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "audio_out_write failed! ret = %d", ret);
+		}
+	}
+
+	if(audio->prepared){
+		audio_out_unprepare(audio->out);
+		audio->prepared = false;
+	}
+
+	pthread_mutex_unlock(&audio->lock);
+
+	return NULL;
+}
+
+/**
+* This function opens the audio output and preloads the default clips.
+* It is called by the init thread, the control port does not wait for it.
+*/
+static void
+rvc_audio_preload(_rvc_audio_s* audio)
+{
+	audio_out_h handle = NULL;
+	int ret = 0;
+	int i;
+
+	ret = audio_out_create_new(RVC_AUDIO_RATE, AUDIO_CHANNEL_MONO, AUDIO_SAMPLE_TYPE_S16_LE, &handle);
+	if(ret != AUDIO_IO_ERROR_NONE){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "audio_out_create_new failed! ret = %d", ret);
+		return;
+	}
+
+	pthread_mutex_lock(&audio->lock);
+	audio->out = handle;
+	pthread_mutex_unlock(&audio->lock);
+
+	for(i = 0; rvc_audio_clips[i].name != NULL; i++){
+		rvc_audio_load(audio, rvc_audio_clips[i].name, rvc_audio_clips[i].path);
+	}
+}
+
+/**
+* This function starts the mixer of the clip bank.
+*/
+static void
+start_audio(_rvc_instance_s* instance)
+{
+	_rvc_audio_s* audio = &instance->audio;
+
+	pthread_mutex_init(&audio->lock, NULL);
+	pthread_cond_init(&audio->cond, NULL);
+	pthread_cond_init(&audio->stream.space, NULL);
+
+	audio->stream.ring = (short*)malloc(RVC_STREAM_RING * sizeof(short));
+	audio->stream.socket = -1;
+	audio->budget = RVC_AUDIO_BUDGET;
+	audio->run = true;
+
+	if(pthread_create(&audio->thread, NULL, mixer_thread_run, (void*)audio) != 0){
+		audio->run = false;
+		dlog_print(DLOG_DEBUG, LOG_TAG, "mixer_thread is failed!");
+	}
+}
+
+/**
+* This function stops the mixer and frees the clip bank.
+*/
+static void
+stop_audio(_rvc_instance_s* instance)
+{
+	_rvc_audio_s* audio = &instance->audio;
+	int i;
+
+	if(audio->run == false){
+		return;
+	}
+
+	rvc_stream_stop(audio);
+
+	pthread_mutex_lock(&audio->lock);
+	audio->run = false;
+	pthread_cond_signal(&audio->cond);
+	pthread_mutex_unlock(&audio->lock);
+
+	pthread_join(audio->thread, NULL);
+
+	if(audio->out != NULL){
+		audio_out_destroy(audio->out);
+		audio->out = NULL;
+	}
+
+	for(i = 0; i < RVC_AUDIO_MAX_CLIPS; i++){
+		free(audio->clips[i].pcm);
+	}
+	memset(audio->clips, 0, sizeof(audio->clips));
+	audio->used = 0;
+
+	free(audio->stream.ring);
+	audio->stream.ring = NULL;
+}
+
+/**
+* This function sends an event to the client which owns the path, if it is still connected.
+*/
+static void
+rvc_path_notify(_rvc_path_s* path, const char* state)
+{
+	_rvc_client_s* owner = path->owner;
+
+	if(owner != NULL && owner->in_use && owner->serial == path->owner_serial){
+		rvc_client_send(owner, rvc_path_event_object, state, path->target, path->count, path->remaining);
+	}
+}
+
+/**
+* This function finds the lookahead point of pure pursuit on the path.
+* path->target is the end point of the segment being followed, it only moves forward.
+*/
+static void
+rvc_path_lookahead(_rvc_path_s* path, float x, float y, float* gx, float* gy)
+{
+	_rvc_point_s* a = NULL;
+	_rvc_point_s* b = NULL;
+	float dx, dy, fx, fy;
+	float qa, qb, qc, disc, t;
+
+	while(path->target < path->count){
+		b = &path->points[path->target];
+
+		//the segment end is still out of the circle, the lookahead point is on this segment
+		if(hypotf(b->x - x, b->y - y) >= path->lookahead || path->target == path->count - 1){
+			break;
+		}
+
+		path->target++;
+	}
+
+	b = &path->points[path->target];
+	*gx = b->x;
+	*gy = b->y;
+
+	if(path->target == 0){
+		return;
+	}
+
+	a = &path->points[path->target - 1];
+
+	//far intersection of the segment a-b and the circle around the robot
+	dx = b->x - a->x;
+	dy = b->y - a->y;
+	fx = a->x - x;
+	fy = a->y - y;
+
+	qa = dx * dx + dy * dy;
+	qb = 2 * (fx * dx + fy * dy);
+	qc = fx * fx + fy * fy - path->lookahead * path->lookahead;
+	disc = qb * qb - 4 * qa * qc;
+
+	if(qa > 0 && disc >= 0){
+		t = (-qb + sqrtf(disc)) / (2 * qa);
+
+		if(t >= 0 && t <= 1){
+			*gx = a->x + t * dx;
+			*gy = a->y + t * dy;
+		}
+	}
+}
+
+/**
+* This function follows the path with pure pursuit at a fixed rate.
+*/
+static void*
+path_thread_run(void *data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	_rvc_path_s* path = &instance->path;
+	_rvc_tx_s* tx = &instance->tx_data;
+	_rvc_point_s* goal = NULL;
+	long long start = 0;
+	long long last_progress = 0;
+	int last_target = -1;
+	float x, y, q, gx, gy, lx, ly, dist, curvature;
+	float lin = 0;
+	float ang = 0;
+	int i;
+
+	while(true){
+		start = rvc_get_time_ms();
+
+		pthread_mutex_lock(&path->lock);
+
+		if(path->run == false){
+			pthread_mutex_unlock(&path->lock);
+			break;
+		}
+
+		x = tx->pose_x;
+		y = tx->pose_y;
+		q = tx->pose_q;
+
+		goal = &path->points[path->count - 1];
+		dist = hypotf(goal->x - x, goal->y - y);
+
+		if(dist <= path->tolerance){
+			path->run = false;
+			path->remaining = 0;
+			rvc_path_notify(path, "done");
+			pthread_mutex_unlock(&path->lock);
+
+			rvc_motion_set_lin_ang(instance, 0, 0);
+			break;
+		}
+
+		rvc_path_lookahead(path, x, y, &gx, &gy);
+
+		//the lookahead point in the robot frame
+		lx = cosf(q) * (gx - x) + sinf(q) * (gy - y);
+		ly = -sinf(q) * (gx - x) + cosf(q) * (gy - y);
+
+		if(lx <= 0){
+			//the point is behind, turn in place first
+			lin = 0;
+			ang = (ly >= 0) ? RVC_PATH_MAX_ANG : -RVC_PATH_MAX_ANG;
+		}else{
+			curvature = 2 * ly / (lx * lx + ly * ly);
+			lin = (dist < path->speed) ? fmaxf(dist, path->tolerance) : path->speed;
+			ang = fmaxf(-RVC_PATH_MAX_ANG, fminf(RVC_PATH_MAX_ANG, lin * curvature));
+		}
+
+		path->remaining = hypotf(path->points[path->target].x - x, path->points[path->target].y - y);
+		for(i = path->target + 1; i < path->count; i++){
+			path->remaining += hypotf(path->points[i].x - path->points[i - 1].x, path->points[i].y - path->points[i - 1].y);
+		}
+
+		if(path->target != last_target || start - last_progress >= RVC_PATH_PROGRESS_MS){
+			rvc_path_notify(path, "progress");
+			last_target = path->target;
+			last_progress = start;
+		}
+
+		pthread_mutex_unlock(&path->lock);
+
+		rvc_motion_set_lin_ang(instance, lin, ang);
+
+		usleep((useconds_t)(fmaxf(0, RVC_PATH_PERIOD_MS - (rvc_get_time_ms() - start)) * 1000));
+	}
+
+	return NULL;
+}
+
+/**
+* This function makes the path thread end by itself without waiting for it.
+* It is used on the callback path, the thread is joined by the next start or stop.
+*/
+static void
+rvc_path_abort(_rvc_instance_s* instance, const char* reason)
+{
+	_rvc_path_s* path = &instance->path;
+
+	pthread_mutex_lock(&path->lock);
+
+	if(path->run){
+		path->run = false;
+		rvc_path_notify(path, reason);
+	}
+
+	pthread_mutex_unlock(&path->lock);
+}
+
+/**
+* This function stops the path being followed and notifies the owner with the reason.
+*/
+static void
+rvc_path_stop(_rvc_instance_s* instance, const char* reason)
+{
+	_rvc_path_s* path = &instance->path;
+	bool was_running = false;
+
+	pthread_mutex_lock(&path->ctl_lock);
+	pthread_mutex_lock(&path->lock);
+
+	was_running = path->run;
+	path->run = false;
+
+	if(was_running){
+		rvc_path_notify(path, reason);
+	}
+
+	pthread_mutex_unlock(&path->lock);
+
+	if(path->started){
+		pthread_join(path->thread, NULL);
+		path->started = false;
+	}
+
+	if(was_running){
+		rvc_motion_set_lin_ang(instance, 0, 0);
+	}
+
+	pthread_mutex_unlock(&path->ctl_lock);
+}
+
+/**
+* This function returns a positive length member of the path command in m or m/s, or -1 when it is not valid.
+*/
+static float
+rvc_path_param(JsonObject* obj, const char* name, float value)
+{
+	double param = value;
+
+	if(json_object_has_member(obj, name)){
+		param = json_object_get_double_member(obj, name);
+	}
+
+	if(isfinite(param) == false || param <= 0 || param > RVC_STATE_POS_MAX){
+		return -1;
+	}
+
+	return (float)param;
+}
+
+/**
+* This function reads a waypoint of the path command, it returns false when the point is not valid.
+*/
+static bool
+rvc_path_point(JsonObject* point, _rvc_point_s* out)
+{
+	double x, y;
+
+	if(point == NULL || json_object_has_member(point, "x") == false || json_object_has_member(point, "y") == false){
+		return false;
+	}
+
+	x = json_object_get_double_member(point, "x");
+	y = json_object_get_double_member(point, "y");
+
+	if(isfinite(x) == false || isfinite(y) == false || fabs(x) > RVC_STATE_POS_MAX || fabs(y) > RVC_STATE_POS_MAX){
+		return false;
+	}
+
+	out->x = (float)x;
+	out->y = (float)y;
+
+	return true;
+}
+
+/**
+* This function starts to follow the waypoints of the path command.
+* It returns -1 and keeps the current path when the command is not valid.
+*/
+static int
+rvc_path_start(_rvc_client_s* client, JsonObject* obj)
+{
+	_rvc_instance_s* instance = client->instance;
+	_rvc_path_s* path = &instance->path;
+	_rvc_point_s waypoints[RVC_PATH_MAX_POINTS];
+	JsonArray* points = NULL;
+	float speed, lookahead, tolerance;
+	int result = -1;
+	int count = 0;
+	int i;
+
+	if(json_object_has_member(obj, "points")){
+		points = json_object_get_array_member(obj, "points");
+	}
+	if(points != NULL){
+		count = (int)json_array_get_length(points);
+	}
+
+	if(count == 0 || count >= RVC_PATH_MAX_POINTS){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: invalid path %d", count);
+		return -1;
+	}
+
+	for(i = 0; i < count; i++){
+		if(rvc_path_point(json_array_get_object_element(points, i), &waypoints[i]) == false){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: invalid path point %d", i);
+			return -1;
+		}
+	}
+
+	speed = rvc_path_param(obj, "speed", RVC_PATH_SPEED);
+	lookahead = rvc_path_param(obj, "lookahead", RVC_PATH_LOOKAHEAD);
+	tolerance = rvc_path_param(obj, "tolerance", RVC_PATH_TOLERANCE);
+
+	if(speed < 0 || lookahead < 0 || tolerance < 0){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: invalid path parameters");
+		return -1;
+	}
+
+	rvc_path_stop(instance, "replaced");
+
+	pthread_mutex_lock(&path->ctl_lock);
+	pthread_mutex_lock(&path->lock);
+
+	//the path starts from the current pose
+	path->points[0].x = instance->tx_data.pose_x;
+	path->points[0].y = instance->tx_data.pose_y;
+	memcpy(&path->points[1], waypoints, count * sizeof(_rvc_point_s));
+
+	path->count = count + 1;
+	path->target = 1;
+	path->remaining = 0;
+	path->speed = fminf(speed, RVC_PATH_MAX_SPEED);
+	path->lookahead = lookahead;
+	path->tolerance = tolerance;
+	path->owner = client;
+	path->owner_serial = client->serial;
+	path->owner_token = instance->sessions[client->session].token;
+	path->run = true;
+
+	pthread_mutex_unlock(&path->lock);
+
+	if(pthread_create(&path->thread, NULL, path_thread_run, (void*)instance) != 0){
+		path->run = false;
+		dlog_print(DLOG_DEBUG, LOG_TAG, "path_thread is failed!");
+	}else{
+		path->started = true;
+		result = 0;
+		rvc_thread_control(path->thread, instance->ctl.priority, instance->ctl.cpu);
+
+		//the path follower commands the motion by itself
+		rvc_motion_watchdog_clear(instance);
+	}
+
+	pthread_mutex_unlock(&path->ctl_lock);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: path %d points", count);
+
+	return result;
+}
+
+/**
+* This function sets the reflex rules of the reflex command. The reflex lock must be held.
+*/
+static void
+rvc_reflex_set_rules(_rvc_reflex_s* reflex, JsonArray* rules)
+{
+	JsonObject* rule = NULL;
+	const char* name = NULL;
+	int count = (int)json_array_get_length(rules);
+	int trigger, action;
+	int i;
+
+	for(i = 0; i < count; i++){
+		rule = json_array_get_object_element(rules, i);
+
+		name = json_object_get_string_member(rule, "trigger");
+		for(trigger = 0; trigger < RVC_REFLEX_TRIGGER_MAX; trigger++){
+			if(g_strcmp0(name, rvc_reflex_trigger_names[trigger]) == 0){
+				break;
+			}
+		}
+
+		name = json_object_get_string_member(rule, "action");
+		for(action = 0; action < RVC_REFLEX_ACTION_MAX; action++){
+			if(g_strcmp0(name, rvc_reflex_action_names[action]) == 0){
+				break;
+			}
+		}
+
+		if(trigger == RVC_REFLEX_TRIGGER_MAX || action == RVC_REFLEX_ACTION_MAX){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: invalid reflex rule %d", i);
+			continue;
+		}
+
+		reflex->rules[trigger].action = (rvc_reflex_action_e)action;
+		reflex->rules[trigger].distance = json_object_has_member(rule, "dist") ? (float)json_object_get_double_member(rule, "dist") : 0;
+
+		//a released halt must not keep the robot halted
+		if(action != RVC_REFLEX_HALT){
+			reflex->halted &= ~(1 << trigger);
+		}
+	}
+}
+
+/**
+* This function executes a command of the rvc and returns the result of the rvc_set_* call.
+* The JSON commands of the clients are decoded to this one.
+*/
+static int
+rvc_cmd_exec(_rvc_instance_s* instance, const _rvc_cmd_s* cmd)
+{
+	int result = -1;
+
+	switch(cmd->type){
+	case RVC_CMD_MODE:
+		rvc_path_stop(instance, "canceled");
+		result = rvc_set_mode((rvc_mode_type_set_e)cmd->value);
+		break;
+	case RVC_CMD_CONTROL:
+		rvc_path_stop(instance, "canceled");
+		result = rvc_motion_set_control(instance, (rvc_control_dir_e)cmd->value);
+		if(result == 0){
+			rvc_motion_watchdog(instance, cmd->client, cmd->watchdog_ms, cmd->value != RVC_CONTROL_STOP);
+		}
+		break;
+	case RVC_CMD_TIME:
+		result = rvc_set_time((unsigned char)cmd->hour, (unsigned char)cmd->minute);
+		break;
+	case RVC_CMD_VOICE:
+		result = rvc_set_voice((rvc_voice_type_e)cmd->value);
+		break;
+	case RVC_CMD_LIN_ANG_VEL:
+		rvc_path_stop(instance, "canceled");
+		result = rvc_motion_set_lin_ang(instance, cmd->lin, cmd->ang);
+		if(result == 0){
+			rvc_motion_watchdog(instance, cmd->client, cmd->watchdog_ms, cmd->lin != 0 || cmd->ang != 0);
+		}
+		break;
+	case RVC_CMD_SUCTION:
+		result = rvc_set_suction_state((rvc_suction_state_e)cmd->value);
+		break;
+	case RVC_CMD_WHEEL_VEL:
+		rvc_path_stop(instance, "canceled");
+		result = rvc_motion_set_wheel_vel(instance, (unsigned short)cmd->left, (unsigned short)cmd->right);
+		if(result == 0){
+			rvc_motion_watchdog(instance, cmd->client, cmd->watchdog_ms, cmd->left != 0 || cmd->right != 0);
+		}
+		break;
+	case RVC_CMD_RESERVE:
+		if(cmd->on == 0){
+			result = rvc_set_reserve_cancel((unsigned char)cmd->value);
+		}else{
+			result = rvc_set_reserve((unsigned char)cmd->value, (unsigned char)cmd->hour, (unsigned char)cmd->minute);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return result;
+}
+
+/**
+* This function returns the upper bound in us of the bucket which has the given percentile
+* of the command latencies. The control lock must be held.
+*/
+static long long
+rvc_ctl_percentile(const _rvc_ctl_s* ctl, int percent)
+{
+	unsigned long long seen = 0;
+	int i;
+
+	if(ctl->cmds == 0){
+		return 0;
+	}
+
+	for(i = 0; i < RVC_CTL_HIST_BUCKETS - 1; i++){
+		seen += ctl->hist[i];
+
+		if(seen * 100 >= (unsigned long long)ctl->cmds * percent){
+			return 1LL << (i + 1);
+		}
+	}
+
+	return ctl->latency_max_us;
+}
+
+/**
+* This function executes the queued commands on the real time priority.
+*/
+static void*
+control_thread_run(void *data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	_rvc_ctl_s* ctl = &instance->ctl;
+	_rvc_ctl_req_s* req = NULL;
+	long long latency = 0;
+	int result = 0;
+	int bucket = 0;
+
+	pthread_mutex_lock(&ctl->lock);
+
+	//the waiting callers are served before the stop
+	while(ctl->run || ctl->count > 0){
+		if(ctl->count == 0){
+			pthread_cond_wait(&ctl->cond, &ctl->lock);
+			continue;
+		}
+
+		req = ctl->queue[ctl->head];
+		ctl->head = (ctl->head + 1) % RVC_CTL_QUEUE_LEN;
+		ctl->count--;
+
+		pthread_mutex_unlock(&ctl->lock);
+		result = rvc_cmd_exec(instance, req->cmd);
+		latency = rvc_get_time_us() - req->queued_us;
+		pthread_mutex_lock(&ctl->lock);
+
+		for(bucket = 0; bucket < RVC_CTL_HIST_BUCKETS - 1 && latency >= (2LL << bucket); bucket++);
+		ctl->hist[bucket]++;
+		ctl->cmds++;
+		if(latency > ctl->latency_max_us){
+			ctl->latency_max_us = latency;
+		}
+
+		req->result = result;
+		req->done = true;
+		pthread_cond_broadcast(&ctl->done);
+	}
+
+	pthread_mutex_unlock(&ctl->lock);
+
+	return NULL;
+}
+
+/**
+* This function executes a command on the control thread and returns its result.
+* The command is executed by the caller when the control thread is not running or is full.
+*/
+static int
+rvc_ctl_exec(_rvc_instance_s* instance, const _rvc_cmd_s* cmd)
+{
+	_rvc_ctl_s* ctl = &instance->ctl;
+	_rvc_ctl_req_s req;
+
+	req.cmd = cmd;
+	req.result = -1;
+	req.done = false;
+	req.queued_us = rvc_get_time_us();
+
+	pthread_mutex_lock(&ctl->lock);
+
+	if(ctl->run == false || ctl->count == RVC_CTL_QUEUE_LEN){
+		pthread_mutex_unlock(&ctl->lock);
+		return rvc_cmd_exec(instance, cmd);
+	}
+
+	ctl->queue[(ctl->head + ctl->count) % RVC_CTL_QUEUE_LEN] = &req;
+	ctl->count++;
+	pthread_cond_signal(&ctl->cond);
+
+	while(req.done == false){
+		pthread_cond_wait(&ctl->done, &ctl->lock);
+	}
+
+	pthread_mutex_unlock(&ctl->lock);
+
+	return req.result;
+}
+
+/**
+* This function applies the priority and the cpu of the control path to its threads.
+* The control lock must be held.
+*/
+static void
+rvc_ctl_apply(_rvc_instance_s* instance)
+{
+	_rvc_ctl_s* ctl = &instance->ctl;
+	_rvc_path_s* path = &instance->path;
+
+	if(ctl->run){
+		ctl->rt = rvc_thread_control(ctl->thread, ctl->priority, ctl->cpu);
+	}
+
+	//a reflex must not wait for the media either
+	if(instance->reflex.run){
+		rvc_thread_control(instance->reflex.thread, ctl->priority, ctl->cpu);
+	}
+
+	pthread_mutex_lock(&path->ctl_lock);
+	if(path->started){
+		rvc_thread_control(path->thread, ctl->priority, ctl->cpu);
+	}
+	pthread_mutex_unlock(&path->ctl_lock);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "control: priority %d, cpu %d, rt %d", ctl->priority, ctl->cpu, ctl->rt);
+}
+
+/**
+* This function sends the settings and the latency histogram of the control thread.
+*/
+static void
+rvc_ctl_reply(_rvc_client_s* client)
+{
+	_rvc_ctl_s* ctl = &client->instance->ctl;
+	char hist[RVC_CTL_HIST_BUCKETS * 11] = {0,};
+	int len = 0;
+	int i;
+
+	pthread_mutex_lock(&ctl->lock);
+
+	for(i = 0; i < RVC_CTL_HIST_BUCKETS; i++){
+		len += snprintf(hist + len, sizeof(hist) - len, "%s%u", i ? "," : "", ctl->hist[i]);
+	}
+
+	rvc_client_send(client, rvc_control_object, ctl->rt, ctl->priority, ctl->cpu, ctl->cmds,
+			rvc_ctl_percentile(ctl, 50), rvc_ctl_percentile(ctl, 99), ctl->latency_max_us, hist, rvc_logger.dropped);
+
+	pthread_mutex_unlock(&ctl->lock);
+}
+
+/**
+* This function starts the control thread.
+*/
+static void
+start_control(_rvc_instance_s* instance)
+{
+	_rvc_ctl_s* ctl = &instance->ctl;
+
+	rvc_mutex_init_pi(&ctl->lock);
+	pthread_cond_init(&ctl->cond, NULL);
+	pthread_cond_init(&ctl->done, NULL);
+
+	ctl->priority = RVC_CTL_PRIORITY;
+	ctl->cpu = RVC_CTL_CPU;
+	ctl->run = true;
+
+	if(pthread_create(&ctl->thread, NULL, control_thread_run, (void*)instance) != 0){
+		ctl->run = false;
+		dlog_print(DLOG_DEBUG, LOG_TAG, "control_thread is failed!");
+		return;
 	}
+
+	ctl->rt = rvc_thread_control(ctl->thread, ctl->priority, ctl->cpu);
 }
 
 /**
-* This function processes a JSON object from the received data.
+* This function stops the control thread, the later commands are executed by their callers.
 */
 static void
-parse_members(JsonObject* object, const gchar *member_name, JsonNode *member_node, gpointer user_data)
+stop_control(_rvc_instance_s* instance)
 {
-	_rvc_instance_s* instance = (_rvc_instance_s*)user_data;
+	_rvc_ctl_s* ctl = &instance->ctl;
 
-	if(instance == NULL){
+	if(ctl->run == false){
 		return;
 	}
-	dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG member_name:%s", member_name);
+
+	pthread_mutex_lock(&ctl->lock);
+	ctl->run = false;
+	pthread_cond_signal(&ctl->cond);
+	pthread_mutex_unlock(&ctl->lock);
+
+	pthread_join(ctl->thread, NULL);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "control: %u commands, p99 %lld us, max %lld us",
+			ctl->cmds, rvc_ctl_percentile(ctl, 99), ctl->latency_max_us);
+}
+
+/**
+* This function processes a member of a JSON object from the received data.
+* It returns the result of the command, 0 if the command has no result.
+*/
+static int
+parse_member(_rvc_client_s* client, const gchar *member_name, JsonNode *member_node)
+{
+	_rvc_cmd_s cmd;
+	int result = 0;
+
+	memset(&cmd, 0, sizeof(cmd));
+
+	rvc_log(DLOG_DEBUG, "RVCMSG member_name:%s", member_name);
 	if(g_strcmp0(member_name, "mode") == 0){
-		int mode = (int)json_node_get_int(member_node);
+		cmd.type = RVC_CMD_MODE;
+		cmd.value = (int)json_node_get_int(member_node);
 
-		rvc_set_mode((rvc_mode_type_set_e)mode);
+		result = rvc_ctl_exec(client->instance, &cmd);
 	}else if(g_strcmp0(member_name, "control") == 0){
-		int control = (int)json_node_get_int(member_node);
+		cmd.type = RVC_CMD_CONTROL;
+		cmd.value = (int)json_node_get_int(member_node);
+		cmd.watchdog_ms = client->watchdog_ms;
+		cmd.client = client;
 
-		rvc_set_control((rvc_control_dir_e)control);
+		result = rvc_ctl_exec(client->instance, &cmd);
 	}else if(g_strcmp0(member_name, "time") == 0){
 		JsonObject* obj = json_node_get_object(member_node);
-		int hour = (int)json_node_get_int(json_object_get_member(obj, "hour"));
-		int minute = (int)json_node_get_int(json_object_get_member(obj, "minute"));
 
-		rvc_set_time((unsigned char)hour, (unsigned char)minute);
+		cmd.type = RVC_CMD_TIME;
+		cmd.hour = (int)json_node_get_int(json_object_get_member(obj, "hour"));
+		cmd.minute = (int)json_node_get_int(json_object_get_member(obj, "minute"));
+
+		result = rvc_ctl_exec(client->instance, &cmd);
 	}else if(g_strcmp0(member_name, "voice") == 0){
-		int voice = (int)json_node_get_int(member_node);
+		cmd.type = RVC_CMD_VOICE;
+		cmd.value = (int)json_node_get_int(member_node);
 
-		rvc_set_voice((rvc_voice_type_e)voice);
+		result = rvc_ctl_exec(client->instance, &cmd);
 	}else if(g_strcmp0(member_name, "lin_ang_vel") == 0){
 		JsonObject* obj = json_node_get_object(member_node);
-		float lin = (float)json_node_get_double(json_object_get_member(obj, "lin"));
-		float ang = (float)json_node_get_double(json_object_get_member(obj, "ang"));
 
-		dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: lin %f, ang %f", lin, ang);
+		cmd.type = RVC_CMD_LIN_ANG_VEL;
+		cmd.lin = (float)json_node_get_double(json_object_get_member(obj, "lin"));
+		cmd.ang = (float)json_node_get_double(json_object_get_member(obj, "ang"));
+		cmd.watchdog_ms = client->watchdog_ms;
+		cmd.client = client;
 
-		rvc_set_lin_ang(lin, ang);
+		rvc_log(DLOG_DEBUG, "RVCMSG: lin %f, ang %f", cmd.lin, cmd.ang);
+
+		result = rvc_ctl_exec(client->instance, &cmd);
 	}else if(g_strcmp0(member_name, "suction") == 0){
-		int suction = (int)json_node_get_int(member_node);
+		cmd.type = RVC_CMD_SUCTION;
+		cmd.value = (int)json_node_get_int(member_node);
 
-		rvc_set_suction_state((rvc_suction_state_e)suction);
+		result = rvc_ctl_exec(client->instance, &cmd);
 	}else if(g_strcmp0(member_name, "wheel_vel") == 0){
 		JsonObject* obj = json_node_get_object(member_node);
 
-		int lin = (int)json_node_get_int(json_object_get_member(obj, "left"));
-		int ang = (int)json_node_get_int(json_object_get_member(obj, "right"));
+		cmd.type = RVC_CMD_WHEEL_VEL;
+		cmd.left = (int)json_node_get_int(json_object_get_member(obj, "left"));
+		cmd.right = (int)json_node_get_int(json_object_get_member(obj, "right"));
+		cmd.watchdog_ms = client->watchdog_ms;
+		cmd.client = client;
 
-		rvc_set_wheel_vel((unsigned short)lin, (unsigned short)ang);
+		result = rvc_ctl_exec(client->instance, &cmd);
 	}else if(g_strcmp0(member_name, "reserve") == 0){
 		JsonObject* obj = json_node_get_object(member_node);
-		int type = (int)json_node_get_int(json_object_get_member(obj, "type"));
-		int on = (int)json_node_get_int(json_object_get_member(obj, "on"));
-		int hour = (int)json_node_get_int(json_object_get_member(obj, "hour"));
-		int minute = (int)json_node_get_int(json_object_get_member(obj, "minute"));
 
-		if(on == 0){
-			rvc_set_reserve_cancel((unsigned char)type);
-		}else{
-			rvc_set_reserve((unsigned char)type, (unsigned char)hour, (unsigned char)minute);
-		}
+		cmd.type = RVC_CMD_RESERVE;
+		cmd.value = (int)json_node_get_int(json_object_get_member(obj, "type"));
+		cmd.on = (int)json_node_get_int(json_object_get_member(obj, "on"));
+		cmd.hour = (int)json_node_get_int(json_object_get_member(obj, "hour"));
+		cmd.minute = (int)json_node_get_int(json_object_get_member(obj, "minute"));
+
+		result = rvc_ctl_exec(client->instance, &cmd);
 	}else if(g_strcmp0(member_name, "wav_play") == 0) {
 		JsonObject* obj = json_node_get_object(member_node);
 		char* uri = (char *)json_node_get_string(json_object_get_member(obj, "url"));
-		dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: URI: %s", uri);
-		int down_id;
-		download_create(&down_id);
-		download_set_url(down_id, uri);
-		download_set_destination(down_id, "/tmp");
-		download_set_file_name(down_id, "voice.wav");
-		download_set_state_changed_cb (down_id, download_cb, NULL);
-		download_set_progress_cb(down_id, progress_cb, NULL);
-		int res = download_start(down_id);
-		dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: DOWN START: %d", res);
+		rvc_log(DLOG_DEBUG, "RVCMSG: URI: %s", uri);
+
+		//http is played while it is received, anything else is downloaded first
+		if(uri == NULL || rvc_stream_start(&client->instance->audio, uri) != 0){
+			result = rvc_wav_download(uri);
+		}
 	} else if(g_strcmp0(member_name, "tts") == 0) {
 		JsonObject* obj = json_node_get_object(member_node);
 		char* text = (char *)json_node_get_string(json_object_get_member(obj, "text"));
 		char* lang = (char *)json_node_get_string(json_object_get_member(obj, "lang"));
 		if (lang == NULL) lang = "ko_KR";
-		__tts_add_text(text, lang);
-		__tts_play();
+		if (rvc_tts_ensure(client->instance) > 0) {
+			__tts_add_text(text, lang);
+			__tts_play();
+		} else {
+			result = -1;
+		}
+
+	} else if(g_strcmp0(member_name, "alarm_play") == 0) {
+		//the clip bank starts at once, the wav player is the fallback
+		if(rvc_audio_play(&client->instance->audio, "alarm", 100) != 0){
+			int wav_id;
+			int res = wav_player_start("/tmp/alarm.wav", SOUND_TYPE_MEDIA, wav_play_completed, NULL, &wav_id);
+			rvc_log(DLOG_DEBUG, "RVCMSG: wav_id %d, res %d", wav_id, res);
+		}
+	} else if(g_strcmp0(member_name, "sound") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		_rvc_audio_s* audio = &client->instance->audio;
+		int clips = 0;
+		int i;
+
+		if(json_object_has_member(obj, "budget")){
+			gint64 budget = json_object_get_int_member(obj, "budget");
+
+			if(budget < 0 || budget > RVC_AUDIO_MAX_BUDGET){
+				result = -1;
+			}else{
+				pthread_mutex_lock(&audio->lock);
+				audio->budget = (int)budget;
+				pthread_mutex_unlock(&audio->lock);
+			}
+		}
+
+		if(json_object_has_member(obj, "unload") && result == 0){
+			result = rvc_audio_unload(audio, json_object_get_string_member(obj, "unload"));
+		}
+
+		if(json_object_has_member(obj, "load") && result == 0){
+			result = rvc_audio_load_file(audio, json_object_get_string_member(obj, "load"), json_object_get_string_member(obj, "path"));
+		}
+
+		if(json_object_has_member(obj, "stop")){
+			rvc_audio_stop_all(audio);
+		}
+
+		if(json_object_has_member(obj, "play") && result == 0){
+			int gain = 100;
+
+			if(json_object_has_member(obj, "gain")){
+				gain = (int)json_object_get_int_member(obj, "gain");
+			}
+
+			result = rvc_audio_play(audio, json_object_get_string_member(obj, "play"), gain);
+		}
+
+		pthread_mutex_lock(&audio->lock);
+		for(i = 0; i < RVC_AUDIO_MAX_CLIPS; i++){
+			if(audio->clips[i].pcm != NULL){
+				clips++;
+			}
+		}
+		rvc_client_send(client, rvc_sound_object, clips, audio->used, audio->budget, audio->active, audio->played,
+				audio->latency_last_us, audio->latency_max_us, audio->stream.playing, audio->stream.count * 1000 / RVC_AUDIO_RATE,
+				audio->stream.received, audio->stream.underruns, audio->stream.first_sound_us / 1000);
+		pthread_mutex_unlock(&audio->lock);
+	} else if(g_strcmp0(member_name, "multicast") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		const char* group = RVC_MCAST_GROUP;
+		int port = RVC_MCAST_PORT;
+		int on = (int)json_node_get_int(json_object_get_member(obj, "on"));
+
+		if(json_object_has_member(obj, "group")){
+			group = json_node_get_string(json_object_get_member(obj, "group"));
+		}
+		if(json_object_has_member(obj, "port")){
+			port = (int)json_node_get_int(json_object_get_member(obj, "port"));
+		}
+
+		//the group must be a string, json_node_get_string gives NULL for anything else
+		if(on != 0 && (group == NULL || port <= 0 || port > 65535)){
+			result = -1;
+		}else{
+			pthread_mutex_lock(&client->instance->mcast_lock);
+			if(on == 0){
+				stop_mcast(client->instance);
+			}else if(start_mcast(client->instance, group, port) == false){
+				result = -1;
+			}
+			pthread_mutex_unlock(&client->instance->mcast_lock);
+		}
+	} else if(g_strcmp0(member_name, "path") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+
+		if(json_object_has_member(obj, "cancel")){
+			rvc_path_stop(client->instance, "canceled");
+		}else{
+			result = rvc_path_start(client, obj);
+		}
+	} else if(g_strcmp0(member_name, "reflex") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		_rvc_reflex_s* reflex = &client->instance->reflex;
+
+		pthread_mutex_lock(&reflex->lock);
+
+		if(json_object_has_member(obj, "enable")){
+			reflex->enable = (int)json_object_get_int_member(obj, "enable");
+		}
+
+		if(json_object_has_member(obj, "rules")){
+			rvc_reflex_set_rules(reflex, json_object_get_array_member(obj, "rules"));
+		}
+
+		rvc_client_send(client, rvc_reflex_object, reflex->enable, reflex->fired, reflex->rejected, reflex->latency_last_us,
+				reflex->latency_max_us, reflex->fired ? reflex->latency_sum_us / reflex->fired : 0);
+
+		pthread_mutex_unlock(&reflex->lock);
+	} else if(g_strcmp0(member_name, "nogo") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		_rvc_nogo_s* nogo = &client->instance->nogo;
+		_rvc_nogo_index_s* index = NULL;
+
+		if(json_object_has_member(obj, "enable")){
+			nogo->enable = (int)json_object_get_int_member(obj, "enable");
+		}
+
+		if(json_object_has_member(obj, "zones") || json_object_has_member(obj, "walls")){
+			result = rvc_nogo_set(client->instance, obj);
+		}
+
+		pthread_mutex_lock(&nogo->lock);
+		index = nogo->index;
+		rvc_client_send(client, rvc_nogo_object, nogo->enable, index ? index->zones : 0, index ? index->walls : 0,
+				index ? index->cols * index->rows : 0, nogo->checks, nogo->check_max_us, nogo->rejected, nogo->stopped);
+		pthread_mutex_unlock(&nogo->lock);
+	} else if(g_strcmp0(member_name, "session") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+
+		pthread_mutex_lock(&client->lock);
+		if(json_object_has_member(obj, "heartbeat_ms")){
+			client->heartbeat_ms = rvc_session_ms(json_object_get_int_member(obj, "heartbeat_ms"), RVC_HEARTBEAT_MIN_MS);
+		}
+		if(json_object_has_member(obj, "idle_ms")){
+			client->idle_ms = rvc_session_ms(json_object_get_int_member(obj, "idle_ms"), RVC_IDLE_MIN_MS);
+		}
+		//the tx thread sleeps for the new times
+		pthread_cond_signal(&client->cond);
+		pthread_mutex_unlock(&client->lock);
+
+		rvc_client_send(client, rvc_session_object, client->instance->sessions[client->session].token, 0,
+				client->heartbeat_ms, client->idle_ms);
+	} else if(g_strcmp0(member_name, "resume") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		long long since = json_object_has_member(obj, "ts") ? json_object_get_int_member(obj, "ts") : 0;
+
+		result = rvc_session_resume(client, json_object_get_string_member(obj, "token"), since);
+		if(result != 0){
+			rvc_client_send(client, rvc_session_object, client->instance->sessions[client->session].token, 0,
+					client->heartbeat_ms, client->idle_ms);
+		}
+	} else if(g_strcmp0(member_name, "ping") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		long long t0 = 0;
+
+		//the client keeps t0 and its own receive time t3 to get the offset and the round trip
+		if(json_object_has_member(obj, "t0")){
+			t0 = json_object_get_int_member(obj, "t0");
+		}
+
+		//the offset the client has got from a previous exchange, it maps the ts of its motion commands
+		if(json_object_has_member(obj, "offset_us")){
+			long long offset_us = json_object_get_int_member(obj, "offset_us");
+
+			if(offset_us > RVC_MOTION_MAX_CLOCK_US || offset_us < -RVC_MOTION_MAX_CLOCK_US){
+				result = -1;
+			}else{
+				client->clock_offset_us = offset_us;
+			}
+		}
+
+		rvc_client_send(client, rvc_pong_object, t0, client->rx_us, rvc_get_time_us());
+	} else if(g_strcmp0(member_name, "motion") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		gint64 ttl_ms = json_object_has_member(obj, "ttl_ms") ? json_object_get_int_member(obj, "ttl_ms") : client->motion_ttl_ms;
+		gint64 offset_us = json_object_has_member(obj, "offset_us") ? json_object_get_int_member(obj, "offset_us") : client->clock_offset_us;
+		gint64 watchdog_ms = json_object_has_member(obj, "watchdog_ms") ? json_object_get_int_member(obj, "watchdog_ms") : client->watchdog_ms;
+
+		//nothing is changed when a value is out of its range
+		if(ttl_ms < RVC_MOTION_TTL_MIN_MS || ttl_ms > RVC_MOTION_TTL_MAX_MS
+				|| offset_us > RVC_MOTION_MAX_CLOCK_US || offset_us < -RVC_MOTION_MAX_CLOCK_US
+				|| (watchdog_ms != 0 && (watchdog_ms < RVC_WATCHDOG_MIN_MS || watchdog_ms > RVC_WATCHDOG_MAX_MS))){
+			result = -1;
+		}else{
+			client->motion_ttl_ms = (int)ttl_ms;
+			client->clock_offset_us = offset_us;
+			client->watchdog_ms = (int)watchdog_ms;
+
+			if(client->watchdog_ms == 0){
+				rvc_motion_watchdog(client->instance, client, 0, false);
+			}
+		}
+
+		rvc_client_send(client, rvc_motion_object, client->motion_ttl_ms, client->watchdog_ms, client->clock_offset_us,
+				client->motion_stale, client->motion_reordered, client->instance->reflex.watchdog_stops);
+	} else if(g_strcmp0(member_name, "realtime") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		_rvc_ctl_s* ctl = &client->instance->ctl;
+		gint64 priority = 0;
+		gint64 cpu = 0;
+
+		if(json_object_has_member(obj, "priority") || json_object_has_member(obj, "cpu")){
+			pthread_mutex_lock(&ctl->lock);
+
+			priority = json_object_has_member(obj, "priority") ? json_object_get_int_member(obj, "priority") : ctl->priority;
+			cpu = json_object_has_member(obj, "cpu") ? json_object_get_int_member(obj, "cpu") : ctl->cpu;
+
+			if(cpu < -1 || cpu >= sysconf(_SC_NPROCESSORS_ONLN)){
+				result = -1;
+			}else{
+				ctl->priority = priority < 0 ? 0 : priority > RVC_CTL_PRIORITY_MAX ? RVC_CTL_PRIORITY_MAX : (int)priority;
+				ctl->cpu = (int)cpu;
+
+				rvc_ctl_apply(client->instance);
+
+				//a requested priority which is not allowed is reported as a failure
+				result = (ctl->priority > 0 && ctl->rt == false) ? -1 : 0;
+			}
+
+			pthread_mutex_unlock(&ctl->lock);
+		}
+
+		if(json_object_has_member(obj, "reset")){
+			pthread_mutex_lock(&ctl->lock);
+			ctl->cmds = 0;
+			ctl->latency_max_us = 0;
+			memset(ctl->hist, 0, sizeof(ctl->hist));
+			pthread_mutex_unlock(&ctl->lock);
+		}
+
+		rvc_ctl_reply(client);
+	} else if(g_strcmp0(member_name, "aggregate") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+
+		if(json_object_has_member(obj, "windows")){
+			result = rvc_agg_configure(client->instance, json_object_get_array_member(obj, "windows"));
+		}
+
+		if(json_object_has_member(obj, "subscribe") && result == 0){
+			result = rvc_agg_subscribe(client, json_object_get_array_member(obj, "subscribe"));
+		}
+
+		rvc_agg_reply(client);
+	} else if(g_strcmp0(member_name, "telemetry") == 0) {
+		_rvc_instance_s* instance = client->instance;
+		int used, used_max;
+		unsigned int exhausted;
+
+		pthread_mutex_lock(&instance->pool.lock);
+		used = instance->pool.used;
+		used_max = instance->pool.used_max;
+		exhausted = instance->pool.exhausted;
+		pthread_mutex_unlock(&instance->pool.lock);
+
+		rvc_client_send(client, rvc_telemetry_object, instance->tx_period_ms, instance->wakeups, instance->wakeups_per_min,
+				RVC_FRAME_POOL, used, used_max, exhausted);
+	} else if(g_strcmp0(member_name, "startup") == 0) {
+		_rvc_startup_s* st = &client->instance->startup;
+
+		rvc_client_send(client, rvc_startup_object, st->hal_ms, st->callback_ms, st->socket_ms, st->msgq_ms,
+				st->ready_ms, st->info_ms, st->volume_ms, st->tts_ms, st->total_ms);
+	} else if(g_strcmp0(member_name, "compress") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		char msg[RVC_JSON_SIZE] = {0,};
+		rvc_zstream_e zstream = RVC_ZSTREAM_KEEP;
+		int on = client->z_on;
+		long long level = Z_DEFAULT_COMPRESSION;
+
+		if(json_object_has_member(obj, "on")){
+			on = (int)json_object_get_int_member(obj, "on");
+		}
+
+		pthread_mutex_lock(&client->lock);
+		if(json_object_has_member(obj, "level")){
+			level = json_object_get_int_member(obj, "level");
+
+			//deflateInit2 would fail after the reply has told the client to inflate
+			if(level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION){
+				on = client->z_on;
+				result = -1;
+			}else{
+				client->z_level = (int)level;
+			}
+		}
+
+		//the reply is the last raw frame or the last compressed frame
+		if(on && client->z_on == false){
+			zstream = RVC_ZSTREAM_START;
+		}else if(on == false && client->z_on){
+			zstream = RVC_ZSTREAM_END;
+		}
+
+		snprintf(msg, RVC_JSON_SIZE, rvc_compress_object, on, client->raw_bytes, client->wire_bytes,
+				client->wire_bytes ? (double)client->raw_bytes / client->wire_bytes : 1.0);
+		pthread_mutex_unlock(&client->lock);
+
+		rvc_client_queue_frame(client, RVC_FRAME_EVENT, msg, zstream);
+	} else if(g_strcmp0(member_name, "tx_policy") == 0) {
+		JsonObject* obj = json_node_get_object(member_node);
+		long long policy = RVC_SLOW_POLICY_DISCONNECT;
+		long long timeout = RVC_SLOW_CLIENT_TIMEOUT_MS;
+
+		pthread_mutex_lock(&client->lock);
+		policy = client->slow_policy;
+		timeout = client->slow_timeout_ms;
+
+		if(json_object_has_member(obj, "policy")){
+			policy = json_node_get_int(json_object_get_member(obj, "policy"));
+		}
+		if(json_object_has_member(obj, "timeout_ms")){
+			timeout = json_node_get_int(json_object_get_member(obj, "timeout_ms"));
+		}
+
+		//nothing is changed when one of the values is not valid
+		if((policy != RVC_SLOW_POLICY_DISCONNECT && policy != RVC_SLOW_POLICY_DROP) || timeout <= 0 || timeout > INT_MAX){
+			result = -1;
+		}else{
+			client->slow_policy = (rvc_slow_policy_e)policy;
+			client->slow_timeout_ms = (int)timeout;
+		}
+		pthread_mutex_unlock(&client->lock);
+
+		rvc_log(DLOG_DEBUG, "RVCMSG: tx_policy %d, timeout %d", client->slow_policy, client->slow_timeout_ms);
+	} else {
+		result = RVC_RESULT_UNKNOWN;
+	}
+
+	return result;
+}
+
+/**
+* This function copies a member name into a JSON string, the quotes, backslashes and control characters are escaped.
+*/
+static void
+rvc_json_escape(const char* in, char* out, int size)
+{
+	int len = 0;
+
+	for(; *in != '\0' && len < size - 7; in++){
+		if(*in == '"' || *in == '\\'){
+			out[len++] = '\\';
+			out[len++] = *in;
+		}else if((unsigned char)*in < 0x20){
+			len += snprintf(out + len, size - len, "\\u%04x", (unsigned char)*in);
+		}else{
+			out[len++] = *in;
+		}
+	}
+
+	out[len] = '\0';
+}
+
+/**
+* This function checks the deadline of a motion command. It returns false when the command is
+* past its time to live or older than the last one executed, the user has already left it behind then.
+*/
+static bool
+rvc_motion_fresh(_rvc_client_s* client, const _rvc_parse_ctx_s* ctx)
+{
+	long long sent = 0;
+	int ttl_ms = 0;
+
+	//a command without a ts is always executed
+	if(ctx->has_ts == false){
+		return true;
+	}
+
+	//the sum below cannot overflow then
+	if(ctx->ts > RVC_MOTION_MAX_CLOCK_US || ctx->ts < -RVC_MOTION_MAX_CLOCK_US){
+		client->motion_stale++;
+		return false;
+	}
+
+	sent = ctx->ts + client->clock_offset_us;
+	ttl_ms = ctx->ttl_ms > 0 ? ctx->ttl_ms : client->motion_ttl_ms;
+
+	if(sent < client->motion_ts){
+		client->motion_reordered++;
+		return false;
+	}
+
+	if(rvc_get_time_us() - sent > ttl_ms * 1000LL){
+		client->motion_stale++;
+		return false;
+	}
+
+	client->motion_ts = sent;
+
+	return true;
+}
+
+/**
+* This function processes a JSON object from the received data.
+* When the command has an id, every member is answered with an ack or a nack.
+*/
+static void
+parse_members(JsonObject* object, const gchar *member_name, JsonNode *member_node, gpointer user_data)
+{
+	_rvc_parse_ctx_s* ctx = (_rvc_parse_ctx_s*)user_data;
+	char name[RVC_ACK_NAME_SIZE] = {0,};
+	long long start = 0;
+	int result = 0;
+
+	if(ctx == NULL || ctx->client == NULL){
+		return;
+	}
+
+	if(g_strcmp0(member_name, "id") == 0 || g_strcmp0(member_name, "ts") == 0 || g_strcmp0(member_name, "ttl_ms") == 0){
+		return;
+	}
+
+	start = rvc_get_time_us();
+
+	if((g_strcmp0(member_name, "lin_ang_vel") == 0 || g_strcmp0(member_name, "wheel_vel") == 0 || g_strcmp0(member_name, "control") == 0)
+			&& rvc_motion_fresh(ctx->client, ctx) == false){
+		result = RVC_RESULT_STALE;
+	}else{
+		result = parse_member(ctx->client, member_name, member_node);
+	}
+
+	if(ctx->has_id){
+		rvc_json_escape(member_name, name, sizeof(name));
+		rvc_client_send(ctx->client, rvc_ack_object, (result == 0) ? "ack" : "nack", ctx->id, name, result, rvc_get_time_us() - start);
+	}
+}
+
+/**
+* This function processes a JSON object from the received data.
+*/
+static void
+parse_cmd(_rvc_client_s* client, char* msg)
+{
+	JsonParser *jsonParser = NULL;
+	GError *error = NULL;
+
+	rvc_log(DLOG_DEBUG, "parse_cmd:%s", msg);
+
+	if(client == NULL){
+		return;
+	}
+
+	rvc_tx_activity(client->instance);
+
+	jsonParser = json_parser_new();
+
+	if(jsonParser != NULL){
+		if(json_parser_load_from_data(jsonParser, msg, -1, &error)){
+			JsonNode *root = NULL;
+			JsonObject *object = NULL;
+
+			root = json_parser_get_root(jsonParser);
+
+			if (JSON_NODE_TYPE (root) == JSON_NODE_OBJECT) {
+				object = json_node_get_object (root);
+
+				if(object != NULL){
+					_rvc_parse_ctx_s ctx = {0,};
+
+					ctx.client = client;
+					if(json_object_has_member(object, "id")){
+						ctx.has_id = true;
+						ctx.id = (long long)json_object_get_int_member(object, "id");
+					}
+					if(json_object_has_member(object, "ts")){
+						ctx.has_ts = true;
+						ctx.ts = (long long)json_object_get_int_member(object, "ts");
+					}
+					if(json_object_has_member(object, "ttl_ms")){
+						ctx.ttl_ms = (int)json_object_get_int_member(object, "ttl_ms");
+					}
+
+					json_object_foreach_member(object, parse_members, &ctx);
+				}
+			}
+		}
+
+		if(error != NULL){
+			g_error_free (error);
+		}
+
+		if(jsonParser != NULL){
+			g_object_unref(jsonParser);
+		}
+	}
+}
+
+/**
+* This function finds the length of the JSON object at the start of msg, -1 if it is not complete.
+*/
+static int
+rvc_json_object_len(const char* msg, int len)
+{
+	int depth = 0;
+	bool in_string = false;
+	int i;
+
+	for(i = 0; i < len; i++){
+		if(in_string){
+			if(msg[i] == '\\'){
+				i++;
+			}else if(msg[i] == '"'){
+				in_string = false;
+			}
+		}else if(msg[i] == '"'){
+			in_string = true;
+		}else if(msg[i] == '{'){
+			depth++;
+		}else if(msg[i] == '}'){
+			if(--depth == 0){
+				return i + 1;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/**
+* This function processes every complete command in the received data.
+* Commands can come padded to RVC_JSON_SIZE, delimited or back to back, so that a
+* client can pipeline them. It returns the length of the incomplete rest.
+*/
+static int
+parse_cmds(_rvc_client_s* client, char* msg, int len)
+{
+	int pos = 0;
+	int cmd_len = 0;
+	char saved;
+
+	while(pos < len){
+		//skip the padding, white spaces and delimiters between the commands
+		if(msg[pos] != '{'){
+			pos++;
+			continue;
+		}
+
+		cmd_len = rvc_json_object_len(msg + pos, len - pos);
+
+		if(cmd_len == -1){
+			break;
+		}
+
+		saved = msg[pos + cmd_len];
+		msg[pos + cmd_len] = '\0';
+		parse_cmd(client, msg + pos);
+		msg[pos + cmd_len] = saved;
+
+		pos += cmd_len;
+	}
 
-	} else if(g_strcmp0(member_name, "alarm_play") == 0) {
-		JsonObject* obj = json_node_get_object(member_node);
+	if(pos == 0 && len == RVC_RX_BUFF_SIZE){
+		rvc_log(DLOG_DEBUG, "too long command is dropped!");
+		return 0;
+	}
 
-		int wav_id;
-		int res = wav_player_start("/tmp/alarm.wav", SOUND_TYPE_MEDIA, wav_play_completed, NULL, &wav_id);
-		dlog_print(DLOG_DEBUG, LOG_TAG, "RVCMSG: wav_id %d, res %d", wav_id, res);
+	memmove(msg, msg + pos, len - pos);
+
+	return len - pos;
+}
+
+/**
+* This function takes a free client slot for the accepted socket.
+*/
+static _rvc_client_s*
+rvc_client_acquire(_rvc_instance_s* instance, int socket)
+{
+	_rvc_client_s* client = NULL;
+	int i;
+
+	pthread_mutex_lock(&instance->client_lock);
+
+	for(i = 0; i < RVC_MAX_CLIENTS; i++){
+		if(instance->clients[i].in_use == false){
+			client = &instance->clients[i];
+
+			pthread_mutex_lock(&client->lock);
+			client->instance = instance;
+			client->socket = socket;
+			client->tx_run = true;
+			client->q_head = 0;
+			client->q_count = 0;
+			client->head_sent = 0;
+			client->state_slot = -1;
+			client->wire_data = NULL;
+			client->z_on = false;
+			client->z_level = Z_DEFAULT_COMPRESSION;
+			client->raw_bytes = 0;
+			client->wire_bytes = 0;
+			client->slow_policy = RVC_SLOW_POLICY_DISCONNECT;
+			client->slow_timeout_ms = RVC_SLOW_CLIENT_TIMEOUT_MS;
+			client->overflow = false;
+			client->last_progress = rvc_get_time_ms();
+			client->state_replaced = 0;
+			client->events_dropped = 0;
+			client->rx_us = rvc_get_time_us();
+			client->tx_ms = rvc_get_time_ms();
+			client->heartbeat_ms = RVC_HEARTBEAT_MS;
+			client->idle_ms = 0;
+			client->session = rvc_session_new(instance);
+			client->agg_mask = 0;
+			client->clock_offset_us = 0;
+			client->motion_ttl_ms = RVC_MOTION_TTL_MS;
+			client->watchdog_ms = 0;
+			client->motion_ts = 0;
+			client->motion_stale = 0;
+			client->motion_reordered = 0;
+			client->serial++;
+			client->in_use = true;
+			pthread_mutex_unlock(&client->lock);
+			break;
+		}
 	}
+
+	pthread_mutex_unlock(&instance->client_lock);
+
+	return client;
 }
 
 /**
-* This function processes a JSON object from the received data.
+* This function gives the client slot back.
 */
 static void
-parse_cmd(_rvc_instance_s* instance, char* msg)
+rvc_client_release(_rvc_client_s* client)
 {
-	JsonParser *jsonParser = NULL;
-	GError *error = NULL;
+	_rvc_instance_s* instance = client->instance;
 
-	dlog_print(DLOG_DEBUG, LOG_TAG, "parse_cmd:%s", msg);
+	pthread_mutex_lock(&instance->client_lock);
 
-	if(instance == NULL){
-		return;
+	if(client->z_on){
+		deflateEnd(&client->zs);
+		client->z_on = false;
 	}
 
-	jsonParser = json_parser_new();
+	rvc_session_detach(client);
 
-	if(jsonParser != NULL){
-		if(json_parser_load_from_data(jsonParser, msg, -1, &error)){
-			JsonNode *root = NULL;
-			JsonObject *object = NULL;
+	//the frames which were not sent give their buffers back
+	pthread_mutex_lock(&client->lock);
+	while(client->q_count > 0){
+		rvc_buf_unref(&instance->pool, client->queue[client->q_head].buf);
+		client->queue[client->q_head].buf = NULL;
+		client->q_head = (client->q_head + 1) % RVC_TX_QUEUE_LEN;
+		client->q_count--;
+	}
+	client->state_slot = -1;
+	client->head_sent = 0;
+	client->wire_data = NULL;
+	pthread_mutex_unlock(&client->lock);
 
-			root = json_parser_get_root(jsonParser);
+	close(client->socket);
+	client->socket = 0;
+	client->in_use = false;
 
-			if (JSON_NODE_TYPE (root) == JSON_NODE_OBJECT) {
-				object = json_node_get_object (root);
+	pthread_mutex_unlock(&instance->client_lock);
+}
 
-				if(object != NULL){
-					json_object_foreach_member(object, parse_members, instance);
-				}
-			}
-		}
+/**
+* This function receives the commands of a client.
+*/
+static void*
+rx_thread_run(void *data)
+{
+	_rvc_client_s* client = (_rvc_client_s*)data;
+	int rx_recv_size = 0;
+	int rx_len = 0;
+	char msg[RVC_RX_BUFF_SIZE+1] = {0,};
 
-		if(error != NULL){
-			g_error_free (error);
-		}
+	if(client == NULL){
+		service_app_exit();
+		return NULL;
+	}
 
-		if(jsonParser != NULL){
-			g_object_unref(jsonParser);
+	if(pthread_create(&client->tx_thread, NULL, tx_thread_run, (void*)client) != 0){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "tx_thread is failed!");
+		rvc_client_release(client);
+		return NULL;
+	}
+
+	while(true){
+		rx_recv_size = read(client->socket, msg + rx_len, RVC_RX_BUFF_SIZE - rx_len);
+		client->rx_us = rvc_get_time_us();
+
+		if(rx_recv_size > 0){
+			rx_len = parse_cmds(client, msg, rx_len + rx_recv_size);
+		}else if(rx_recv_size == -1 && errno == EINTR){
+			continue;
+		}else{
+			//0 means the peer has closed the connection
+			break;
 		}
 	}
+
+	pthread_mutex_lock(&client->lock);
+	client->tx_run = false;
+	pthread_cond_signal(&client->cond);
+	pthread_mutex_unlock(&client->lock);
+
+	pthread_join(client->tx_thread, NULL);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "client %d is closed, state replaced %u, events dropped %u, raw %llu, wire %llu",
+			client->socket, client->state_replaced, client->events_dropped, client->raw_bytes, client->wire_bytes);
+
+	rvc_client_release(client);
+
+	return NULL;
 }
 
-/***/
+/**
+* This function accepts the connections of mobiles.
+*/
 static void*
-rx_thread_run(void *data)
+accept_thread_run(void *data)
 {
 	_rvc_instance_s* instance = (_rvc_instance_s*)data;
 	struct sockaddr_in client_addr = {0,};
-	int rx_recv_size = 0;
-    int status = 0;
-    socklen_t client_addr_size = 0;
-    char msg[RVC_JSON_SIZE+1] = {0,};
+	socklen_t client_addr_size = 0;
+	_rvc_client_s* client = NULL;
+	int client_socket = 0;
 
 	if(instance == NULL){
 		service_app_exit();
 		return NULL;
 	}
 
-	while(true){
-		if(listen(instance->server_socket, 5) == -1){
-			service_app_exit();
-			break;
-		}
+	if(listen(instance->server_socket, 5) == -1){
+		service_app_exit();
+		return NULL;
+	}
 
+	while(instance->rx_run){
 		client_addr_size = sizeof(client_addr);
-		instance->client_socket = accept(instance->server_socket, (struct sockaddr*)&client_addr, &client_addr_size);
+		client_socket = accept(instance->server_socket, (struct sockaddr*)&client_addr, &client_addr_size);
+
+		if(client_socket == -1){
+			if(errno == EINTR){
+				continue;
+			}
 
-		if(instance->client_socket==-1){
-			service_app_exit();
+			if(instance->rx_run){
+				service_app_exit();
+			}
 			break;
 		}
 
-		instance->tx_run = true;
+		client = rvc_client_acquire(instance, client_socket);
 
-	    if(pthread_create(&instance->tx_thread, NULL, tx_thread_run, (void*)instance) < 0){
-	    	instance->tx_run = false;
-	   	    dlog_print(DLOG_DEBUG, LOG_TAG, "tx_thread is failed!");
-            service_app_exit();
-            break;
-        }
-
-	    while(instance->tx_run == true){
-	    	memset(msg, 0, RVC_JSON_SIZE);
-		    rx_recv_size = read(instance->client_socket, msg, RVC_JSON_SIZE);
+		if(client == NULL){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "too many clients!");
+			close(client_socket);
+			continue;
+		}
 
-		    if(rx_recv_size > 0){
-                parse_cmd(instance, msg);
-		    }else if(rx_recv_size == -1){
-			    instance->tx_run = false;
+		rvc_socket_keepalive(client_socket);
 
-			    if(instance->client_socket!=0){
-			        close(instance->client_socket);
-			        instance->client_socket = 0;
-			    }
+		//the token lets the client resume the session after a reconnect
+		rvc_client_send(client, rvc_session_object, instance->sessions[client->session].token, 0,
+				client->heartbeat_ms, client->idle_ms);
 
-			    if(instance->tx_thread != 0){
-			        pthread_join(instance->tx_thread, (void **)&status);
-			    }
-		    }
+		if(pthread_create(&client->rx_thread, NULL, rx_thread_run, (void*)client) != 0){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "rx_thread is failed!");
+			rvc_client_release(client);
+			continue;
 		}
+
+		pthread_detach(client->rx_thread);
+
+		//the new client gets the state at once
+		instance->last_activity_ms = rvc_get_time_ms();
+		rvc_tx_kick(instance);
 	}
 
-    return NULL;
+	return NULL;
 }
 
 /**
@@ -893,11 +7089,28 @@ static bool
 start_server_socket(_rvc_instance_s* instance)
 {
 	struct sockaddr_in server_addr = {0,};
+	pthread_condattr_t attr;
+	int i;
 
 	if(instance == NULL){
 		return false;
 	}
 
+	pthread_mutex_init(&instance->client_lock, NULL);
+	pthread_mutex_init(&instance->mcast_lock, NULL);
+	pthread_mutex_init(&instance->path.ctl_lock, NULL);
+	pthread_mutex_init(&instance->path.lock, NULL);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	for(i = 0; i < RVC_MAX_CLIENTS; i++){
+		pthread_mutex_init(&instance->clients[i].lock, NULL);
+		pthread_cond_init(&instance->clients[i].cond, &attr);
+	}
+
+	pthread_condattr_destroy(&attr);
+
 	instance->server_socket = socket( PF_INET, SOCK_STREAM, 0);
 
 	if(instance->server_socket == -1){
@@ -917,7 +7130,7 @@ start_server_socket(_rvc_instance_s* instance)
 
     instance->rx_run = true;
 
-    if(pthread_create(&instance->rx_thread, NULL, rx_thread_run, (void*)instance) < 0){
+    if(pthread_create(&instance->rx_thread, NULL, accept_thread_run, (void*)instance) < 0){
     	instance->rx_run = false;
    	    dlog_print(DLOG_DEBUG, LOG_TAG, "rx_thread is failed!");
    	    return false;
@@ -951,26 +7164,390 @@ _camera_completed_cb(void *user_data)
     g_enable_focus = true;
 }
 
+/**
+* This function checks the credentials of a local client.
+* Only root and the user of the service may control the robot.
+*/
+static bool
+rvc_local_allowed(int socket)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if(getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "local: SO_PEERCRED failed, errno = %d", errno);
+		return false;
+	}
+
+	if(cred.uid != 0 && cred.uid != geteuid()){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "local: pid %d uid %d is refused", cred.pid, cred.uid);
+		return false;
+	}
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "local: pid %d uid %d is connected", cred.pid, cred.uid);
+
+	return true;
+}
+
+/**
+* This function runs a binary command with the executor of the JSON commands and replies to it.
+*/
+static void
+rvc_local_exec(_rvc_instance_s* instance, int socket, const _rvc_local_cmd_s* req, int len)
+{
+	_rvc_local_reply_s reply = {0,};
+	_rvc_cmd_s cmd = {RVC_CMD_NONE,};
+	long long start = rvc_get_time_us();
+
+	reply.result = -1;
+
+	if(len == sizeof(_rvc_local_cmd_s)){
+		cmd.type = (rvc_cmd_type_e)req->type;
+		cmd.value = req->value;
+		cmd.on = req->on;
+		cmd.hour = req->hour;
+		cmd.minute = req->minute;
+		cmd.left = req->left;
+		cmd.right = req->right;
+		cmd.lin = req->lin;
+		cmd.ang = req->ang;
+
+		reply.id = req->id;
+		reply.result = rvc_ctl_exec(instance, &cmd);
+
+		rvc_tx_activity(instance);
+		instance->local_cmds++;
+	}
+
+	reply.exec_us = rvc_get_time_us() - start;
+
+	if(send(socket, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(reply)){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "local: reply failed, errno = %d", errno);
+	}
+}
+
+/**
+* This function serves the local control socket. The listener and the clients are polled
+* by this thread only, a command is executed as soon as it is received.
+*/
+static void*
+local_thread_run(void *data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	struct pollfd fds[RVC_LOCAL_MAX_CLIENTS + 2];
+	_rvc_local_cmd_s req;
+	int count = 2;
+	int sock = 0;
+	int len = 0;
+	int i;
+
+	fds[0].fd = instance->local_pipe[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = instance->local_socket;
+	fds[1].events = POLLIN;
+
+	while(instance->local_run){
+		if(poll(fds, count, -1) == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			break;
+		}
+
+		if(fds[0].revents){
+			break;
+		}
+
+		for(i = count - 1; i >= 2; i--){
+			if(fds[i].revents == 0){
+				continue;
+			}
+
+			len = recv(fds[i].fd, &req, sizeof(req), MSG_TRUNC);
+
+			if(len > 0){
+				rvc_local_exec(instance, fds[i].fd, &req, len);
+			}else if(len == 0 || errno != EINTR){
+				close(fds[i].fd);
+				fds[i] = fds[--count];
+			}
+		}
+
+		if(fds[1].revents & POLLIN){
+			sock = accept(instance->local_socket, NULL, NULL);
+
+			if(sock == -1){
+				continue;
+			}
+
+			if(count == RVC_LOCAL_MAX_CLIENTS + 2 || rvc_local_allowed(sock) == false){
+				close(sock);
+				continue;
+			}
+
+			fds[count].fd = sock;
+			fds[count].events = POLLIN;
+			fds[count].revents = 0;
+			count++;
+		}
+	}
+
+	for(i = 2; i < count; i++){
+		close(fds[i].fd);
+	}
+
+	return NULL;
+}
+
+/**
+* This function checks that only the service can write the directory of the local socket.
+* Another user could replace the socket file in a shared directory.
+*/
+static bool
+rvc_local_dir_safe(void)
+{
+	struct stat st;
+
+	if(mkdir(RVC_LOCAL_SOCKET_DIR, 0750) == -1 && errno != EEXIST){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "local: mkdir failed, errno = %d", errno);
+		return false;
+	}
+
+	if(lstat(RVC_LOCAL_SOCKET_DIR, &st) == -1 || S_ISDIR(st.st_mode) == 0
+			|| st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "local: %s is not private to the service", RVC_LOCAL_SOCKET_DIR);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+* This function starts the local control socket.
+*/
+static bool
+start_local_socket(_rvc_instance_s* instance)
+{
+	struct sockaddr_un addr = {0,};
+
+	if(rvc_local_dir_safe() == false){
+		return false;
+	}
+
+	instance->local_socket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+	if(instance->local_socket == -1){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "local: create failed!");
+		return false;
+	}
+
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", RVC_LOCAL_SOCKET_PATH);
+
+	//a socket file of the previous run is left behind
+	unlink(RVC_LOCAL_SOCKET_PATH);
+
+	if(bind(instance->local_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1
+			|| chmod(RVC_LOCAL_SOCKET_PATH, 0660) == -1
+			|| listen(instance->local_socket, RVC_LOCAL_MAX_CLIENTS) == -1
+			|| pipe(instance->local_pipe) == -1){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "local: bind failed, errno = %d", errno);
+		close(instance->local_socket);
+		instance->local_socket = 0;
+		return false;
+	}
+
+	instance->local_run = true;
+
+	if(pthread_create(&instance->local_thread, NULL, local_thread_run, (void*)instance) != 0){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "local_thread is failed!");
+		instance->local_run = false;
+		close(instance->local_socket);
+		close(instance->local_pipe[0]);
+		close(instance->local_pipe[1]);
+		instance->local_socket = 0;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+* This function stops the local control socket.
+*/
+static void
+stop_local_socket(_rvc_instance_s* instance)
+{
+	if(instance->local_run == false){
+		return;
+	}
+
+	instance->local_run = false;
+
+	//wake the thread up from poll
+	if(write(instance->local_pipe[1], "q", 1) != 1){
+		dlog_print(DLOG_DEBUG, LOG_TAG, "local: wake failed, errno = %d", errno);
+	}
+
+	pthread_join(instance->local_thread, NULL);
+
+	close(instance->local_socket);
+	close(instance->local_pipe[0]);
+	close(instance->local_pipe[1]);
+	instance->local_socket = 0;
+
+	unlink(RVC_LOCAL_SOCKET_PATH);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "local: %u commands", instance->local_cmds);
+}
+
+/**
+* This function closes every client and waits until their threads are finished.
+*/
+static void
+rvc_close_clients(_rvc_instance_s* instance)
+{
+	int i;
+	int remain = 0;
+	int retry = 100;
+
+	pthread_mutex_lock(&instance->client_lock);
+	for(i = 0; i < RVC_MAX_CLIENTS; i++){
+		if(instance->clients[i].in_use){
+			shutdown(instance->clients[i].socket, SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(&instance->client_lock);
+
+	//rx threads are detached, they release their slot by themselves
+	do{
+		remain = 0;
+
+		pthread_mutex_lock(&instance->client_lock);
+		for(i = 0; i < RVC_MAX_CLIENTS; i++){
+			remain += instance->clients[i].in_use;
+		}
+		pthread_mutex_unlock(&instance->client_lock);
+
+		if(remain > 0){
+			usleep(10 * 1000);
+		}
+	}while(remain > 0 && --retry > 0);
+}
+
+/**
+* This function does the slow part of the startup after the control port is live.
+*/
+static void*
+init_thread_run(void *data)
+{
+	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	_rvc_startup_s* st = &instance->startup;
+	long long begin = rvc_get_time_ms();
+	long long start = begin;
+
+	rvc_thread_background();
+
+	get_rvc_info(instance);
+	st->info_ms = rvc_get_time_ms() - start;
+
+	start = rvc_get_time_ms();
+	int max_vol;
+	sound_manager_get_max_volume (SOUND_TYPE_MEDIA, &max_vol);
+	dlog_print(DLOG_DEBUG, LOG_TAG, "MAX_VOL %d", max_vol);
+	int res = sound_manager_set_volume (SOUND_TYPE_MEDIA, max_vol);
+	dlog_print(DLOG_DEBUG, LOG_TAG, "VOL_CHANGE: %d", res);
+	st->volume_ms = rvc_get_time_ms() - start;
+
+	rvc_tts_ensure(data);
+	st->tts_ms = g_tts_init_ms;
+
+	start = rvc_get_time_ms();
+	rvc_audio_preload(&instance->audio);
+	dlog_print(DLOG_DEBUG, LOG_TAG, "clip bank: %d bytes, %lld ms", instance->audio.used, rvc_get_time_ms() - start);
+
+	st->total_ms = st->ready_ms + (rvc_get_time_ms() - begin);
+
+	dlog_print(DLOG_DEBUG, LOG_TAG, "startup: info %lld, volume %lld, tts %lld, total %lld ms",
+			st->info_ms, st->volume_ms, st->tts_ms, st->total_ms);
+
+	return NULL;
+}
+
 bool service_app_create(void *data)
 {
 	_rvc_instance_s* instance = (_rvc_instance_s*)data;
+	_rvc_startup_s* st = NULL;
+	long long begin = 0;
+	long long start = 0;
 
 	if(instance != NULL){
+		st = &instance->startup;
+		st->info_ms = st->volume_ms = st->tts_ms = st->total_ms = -1;
+
+		begin = start = rvc_get_time_ms();
 		if(rvc_initialize()!=RVC_USER_ERROR_NONE){
 			dlog_print(DLOG_DEBUG, LOG_TAG, "rvc_initialize is failed!");
 			return false;
 		}
+		st->hal_ms = rvc_get_time_ms() - start;
+
+		//the logs of the callbacks and the commands go through the log thread
+		start_log();
+
+		//the frames to the clients are made in buffers of the pool
+		rvc_pool_init(&instance->pool);
+
+		//a state frame which does not fit would break the framing of every client
+		if(rvc_format_check() == false){
+			dlog_print(DLOG_ERROR, LOG_TAG, "state frame does not fit in %d bytes!", RVC_JSON_SIZE);
+			return false;
+		}
+
+		start_control(instance);
 
+		//reflexes, no-go zones and the aggregation run on the callback path, they must be ready before the callbacks
+		start_reflex(instance);
+
+		pthread_mutex_init(&instance->nogo.lock, NULL);
+		instance->nogo.enable = true;
+
+		start_aggregate(instance);
+
+		//the mixer waits for the audio output of the init thread
+		start_audio(instance);
+
+		//callbacks first, the state is filled by the poll of the init thread as well
+		start = rvc_get_time_ms();
+		rvc_register_callback(instance);
+		st->callback_ms = rvc_get_time_ms() - start;
+
+		start = rvc_get_time_ms();
 		if(start_server_socket(instance) == false){
 			rvc_deinitialize();
 			dlog_print(DLOG_DEBUG, LOG_TAG, "start_server_socket is failed!");
 			return false;
 		}
+		if(start_scheduler(instance) == false){
+			rvc_deinitialize();
+			dlog_print(DLOG_DEBUG, LOG_TAG, "start_scheduler is failed!");
+			return false;
+		}
+
+		//the helpers on the device can work without it
+		start_local_socket(instance);
+		st->socket_ms = rvc_get_time_ms() - start;
 
+		start = rvc_get_time_ms();
 		if (-1 == (mqid = msgget((key_t)913, IPC_CREAT | 0666))) {
 			perror("msgget() failed.");
 			exit(1);
 		}
+		st->msgq_ms = rvc_get_time_ms() - start;
+		st->ready_ms = rvc_get_time_ms() - begin;
+
+		dlog_print(DLOG_DEBUG, LOG_TAG, "startup: hal %lld, callback %lld, socket %lld, msgq %lld, ready %lld ms",
+				st->hal_ms, st->callback_ms, st->socket_ms, st->msgq_ms, st->ready_ms);
 /*
 		int error_code = 0;
 
@@ -994,15 +7571,12 @@ bool service_app_create(void *data)
 		error_code = camera_attr_set_image_quality(cam_data.g_camera, 100);
 		error_code = camera_start_preview(cam_data.g_camera);
 */
-		init_tts(data);
-		int max_vol;
-		sound_manager_get_max_volume (SOUND_TYPE_MEDIA, &max_vol);
-		dlog_print(DLOG_DEBUG, LOG_TAG, "MAX_VOL %d", max_vol);
-		int res = sound_manager_set_volume (SOUND_TYPE_MEDIA, max_vol);
-		dlog_print(DLOG_DEBUG, LOG_TAG, "VOL_CHANGE: %d", res);
 
-		get_rvc_info(instance);
-		rvc_register_callback(instance);
+		//TTS, audio and the full poll are not needed to serve the control port
+		if(pthread_create(&instance->init_thread, NULL, init_thread_run, (void*)instance) != 0){
+			dlog_print(DLOG_DEBUG, LOG_TAG, "init_thread is failed!");
+			init_thread_run(instance);
+		}
 	}else{
 		dlog_print(DLOG_DEBUG, LOG_TAG, "g_instance is null!");
 	}
@@ -1012,13 +7586,20 @@ bool service_app_create(void *data)
 
 void service_app_terminate(void *data)
 {
-	int status = 0;
 	_rvc_instance_s* instance = (_rvc_instance_s*)data;
 
 	if(instance!=NULL){
-		if(instance->client_socket!=0){
-		    close(instance->client_socket);
-		    instance->client_socket = 0;
+		if(instance->server_socket!=0){
+			instance->rx_run = false;
+			shutdown(instance->server_socket, SHUT_RDWR);
+		}
+
+		if(instance->rx_thread != 0){
+		    pthread_join(instance->rx_thread, NULL);
+		}
+
+		if(instance->init_thread != 0){
+		    pthread_join(instance->init_thread, NULL);
 		}
 
 		if(instance->server_socket!=0){
@@ -1026,15 +7607,31 @@ void service_app_terminate(void *data)
 		    instance->server_socket = 0;
 		}
 
-		if(instance->rx_thread != 0){
-			instance->rx_run = false;
-		    pthread_join(instance->rx_thread, (void **)&status);
-		}
+		stop_local_socket(instance);
 
-		if(instance->tx_thread != 0){
-			instance->tx_run = false;
-		    pthread_join(instance->tx_thread, (void **)&status);
-		}
+		//no more state frames for the clients
+		stop_scheduler(instance);
+		stop_aggregate(instance);
+
+		rvc_close_clients(instance);
+
+		//no more commands
+		stop_control(instance);
+
+		pthread_mutex_lock(&instance->mcast_lock);
+		stop_mcast(instance);
+		pthread_mutex_unlock(&instance->mcast_lock);
+
+		rvc_path_stop(instance, "canceled");
+
+		stop_reflex(instance);
+
+		rvc_nogo_free(instance->nogo.index);
+		instance->nogo.index = NULL;
+
+		stop_audio(instance);
+
+		stop_log();
 /*
 		int error_code;
 		error_code = camera_cancel_focusing(cam_data.g_camera);
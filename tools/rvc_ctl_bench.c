@@ -0,0 +1,295 @@
+/**
+* Host benchmark of the command latency of the control thread of the rvc service.
+*
+* A caller hands commands to a control thread through the same queue as rvc_ctl_exec,
+* while busy threads, standing in for the media, logging and telemetry, load the cpu.
+* Every thread is pinned to one cpu, so the control thread competes with them.
+* The latency is measured from the queueing to the end of the execution, like the
+* histogram of the "realtime" command.
+*
+*   gcc -O2 -o rvc_ctl_bench rvc_ctl_bench.c -lpthread
+*   ./rvc_ctl_bench [commands] [busy_threads] [priority] [cpu]
+*
+* A priority of 0 keeps the default scheduling, SCHED_FIFO needs root or CAP_SYS_NICE.
+*/
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//number of commands which can wait for the control thread
+#define BENCH_QUEUE_LEN 16
+
+//time in us a command spends in the HAL
+#define BENCH_EXEC_US 2
+
+//time in us between the commands of the caller
+#define BENCH_GAP_US 200
+
+/**
+* This struct is a command waiting for the control thread.
+*/
+typedef struct{
+	long long queued_us;
+	int done;
+}_bench_req_s;
+
+/**
+* This struct has the control thread and its queue.
+*/
+typedef struct{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done;
+	pthread_t thread;
+	int run;
+
+	_bench_req_s* queue[BENCH_QUEUE_LEN];
+	int head;
+	int count;
+
+	long long* latencies;
+	int measured;
+}_bench_ctl_s;
+
+static volatile int g_busy_run = true;
+
+/**
+* This function returns the monotonic time in us.
+*/
+static long long
+bench_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+* This function spins for the given time, it stands in for the HAL call of a command.
+*/
+static void
+bench_spin_us(long long us)
+{
+	long long end = bench_time_us() + us;
+
+	while(bench_time_us() < end);
+}
+
+/**
+* This function pins the calling thread to a cpu and sets its scheduling.
+*/
+static bool
+bench_thread_setup(int priority, int cpu)
+{
+	struct sched_param param = {0,};
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+		fprintf(stderr, "cpu %d cannot be set\n", cpu);
+		return false;
+	}
+
+	param.sched_priority = priority;
+	if(pthread_setschedparam(pthread_self(), priority > 0 ? SCHED_FIFO : SCHED_OTHER, &param) != 0){
+		fprintf(stderr, "SCHED_FIFO %d is not allowed\n", priority);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+* This struct has the settings of a thread.
+*/
+typedef struct{
+	_bench_ctl_s* ctl;
+	int priority;
+	int cpu;
+}_bench_arg_s;
+
+/**
+* This function loads the cpu until the end of the benchmark.
+*/
+static void*
+busy_thread_run(void *data)
+{
+	_bench_arg_s* arg = (_bench_arg_s*)data;
+
+	bench_thread_setup(0, arg->cpu);
+
+	while(g_busy_run);
+
+	return NULL;
+}
+
+/**
+* This function executes the queued commands.
+*/
+static void*
+control_thread_run(void *data)
+{
+	_bench_arg_s* arg = (_bench_arg_s*)data;
+	_bench_ctl_s* ctl = arg->ctl;
+	_bench_req_s* req = NULL;
+
+	bench_thread_setup(arg->priority, arg->cpu);
+
+	pthread_mutex_lock(&ctl->lock);
+
+	while(ctl->run || ctl->count > 0){
+		if(ctl->count == 0){
+			pthread_cond_wait(&ctl->cond, &ctl->lock);
+			continue;
+		}
+
+		req = ctl->queue[ctl->head];
+		ctl->head = (ctl->head + 1) % BENCH_QUEUE_LEN;
+		ctl->count--;
+
+		pthread_mutex_unlock(&ctl->lock);
+		bench_spin_us(BENCH_EXEC_US);
+		pthread_mutex_lock(&ctl->lock);
+
+		ctl->latencies[ctl->measured++] = bench_time_us() - req->queued_us;
+		req->done = true;
+		pthread_cond_broadcast(&ctl->done);
+	}
+
+	pthread_mutex_unlock(&ctl->lock);
+
+	return NULL;
+}
+
+/**
+* This function executes a command on the control thread, like rvc_ctl_exec.
+*/
+static void
+bench_ctl_exec(_bench_ctl_s* ctl)
+{
+	_bench_req_s req;
+
+	req.queued_us = bench_time_us();
+	req.done = false;
+
+	pthread_mutex_lock(&ctl->lock);
+
+	ctl->queue[(ctl->head + ctl->count) % BENCH_QUEUE_LEN] = &req;
+	ctl->count++;
+	pthread_cond_signal(&ctl->cond);
+
+	while(req.done == false){
+		pthread_cond_wait(&ctl->done, &ctl->lock);
+	}
+
+	pthread_mutex_unlock(&ctl->lock);
+}
+
+static int
+bench_compare(const void* a, const void* b)
+{
+	long long x = *(const long long*)a;
+	long long y = *(const long long*)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+* This function returns the latency of a percentile given in per mille.
+*/
+static long long
+bench_percentile(const long long* sorted, int count, int permille)
+{
+	int i = (int)((long long)count * permille / 1000);
+
+	return sorted[i < count ? i : count - 1];
+}
+
+int
+main(int argc, char *argv[])
+{
+	int commands = argc > 1 ? atoi(argv[1]) : 20000;
+	int busy = argc > 2 ? atoi(argv[2]) : 2;
+	int priority = argc > 3 ? atoi(argv[3]) : 10;
+	int cpu = argc > 4 ? atoi(argv[4]) : 0;
+	pthread_mutexattr_t attr;
+	pthread_t* busy_threads = NULL;
+	_bench_ctl_s ctl;
+	_bench_arg_s ctl_arg;
+	_bench_arg_s busy_arg;
+	int i;
+
+	if(commands < 1 || busy < 0 || priority < 0 || priority > sched_get_priority_max(SCHED_FIFO)
+			|| cpu < 0 || cpu >= sysconf(_SC_NPROCESSORS_ONLN)){
+		fprintf(stderr, "usage: %s [commands] [busy_threads] [priority] [cpu]\n", argv[0]);
+		return 1;
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.latencies = calloc(commands, sizeof(long long));
+	busy_threads = calloc(busy + 1, sizeof(pthread_t));
+	if(ctl.latencies == NULL || busy_threads == NULL){
+		return 1;
+	}
+
+	//the queue mutex of the service uses priority inheritance as well
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&ctl.lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_cond_init(&ctl.cond, NULL);
+	pthread_cond_init(&ctl.done, NULL);
+	ctl.run = true;
+
+	ctl_arg.ctl = &ctl;
+	ctl_arg.priority = priority;
+	ctl_arg.cpu = cpu;
+	busy_arg = ctl_arg;
+	busy_arg.priority = 0;
+
+	//the caller is an rx thread, it has the default scheduling
+	bench_thread_setup(0, cpu);
+
+	for(i = 0; i < busy; i++){
+		pthread_create(&busy_threads[i], NULL, busy_thread_run, &busy_arg);
+	}
+	pthread_create(&ctl.thread, NULL, control_thread_run, &ctl_arg);
+
+	for(i = 0; i < commands; i++){
+		bench_ctl_exec(&ctl);
+		usleep(BENCH_GAP_US);
+	}
+
+	pthread_mutex_lock(&ctl.lock);
+	ctl.run = false;
+	pthread_cond_signal(&ctl.cond);
+	pthread_mutex_unlock(&ctl.lock);
+	pthread_join(ctl.thread, NULL);
+
+	g_busy_run = false;
+	for(i = 0; i < busy; i++){
+		pthread_join(busy_threads[i], NULL);
+	}
+
+	qsort(ctl.latencies, ctl.measured, sizeof(long long), bench_compare);
+
+	printf("priority %d, cpu %d, %d busy threads, %d commands\n", priority, cpu, busy, ctl.measured);
+	printf("p50 %lld us, p99 %lld us, p99.9 %lld us, max %lld us\n",
+			bench_percentile(ctl.latencies, ctl.measured, 500), bench_percentile(ctl.latencies, ctl.measured, 990),
+			bench_percentile(ctl.latencies, ctl.measured, 999), ctl.latencies[ctl.measured - 1]);
+
+	free(busy_threads);
+	free(ctl.latencies);
+
+	return 0;
+}
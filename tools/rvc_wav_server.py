@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""
+HTTP stand-in server for the streamed wav_play of the robot.
+
+It serves the files of a directory at a throttled rate, given as a factor of
+the realtime byte rate of each wav file, so that the start of the playback,
+the underruns and the end of a stream can be checked without a real server.
+
+  python3 rvc_wav_server.py <dir> [port] [realtime_factor] [chunk_bytes]
+
+  0.6 : the file arrives slower than it plays, the player underruns
+  2.0 : the file arrives twice as fast as it plays
+
+A robot or a host build of the service plays it with
+  {"wav_play":"http://<host>:<port>/<file>.wav"}///
+"""
+import http.server
+import os
+import struct
+import sys
+import time
+
+
+def wav_byte_rate(data):
+	#byte rate of the fmt chunk, the plain size is sent unthrottled when it is not a wav file
+	pos = 12
+	while data[:4] == b"RIFF" and pos + 8 <= len(data):
+		chunk_id, size = data[pos:pos + 4], struct.unpack("<I", data[pos + 4:pos + 8])[0]
+		if chunk_id == b"fmt " and size >= 16:
+			return struct.unpack("<I", data[pos + 16:pos + 20])[0]
+		pos += 8 + size + (size & 1)
+	return 0
+
+
+class WavHandler(http.server.BaseHTTPRequestHandler):
+	root = "."
+	factor = 1.0
+	chunk = 4096
+
+	def do_GET(self):
+		path = os.path.join(self.root, os.path.basename(self.path))
+		try:
+			with open(path, "rb") as f:
+				data = f.read()
+		except OSError:
+			self.send_error(404)
+			return
+
+		byte_rate = wav_byte_rate(data) * self.factor
+
+		self.send_response(200)
+		self.send_header("Content-Type", "audio/wav")
+		self.send_header("Content-Length", str(len(data)))
+		self.end_headers()
+
+		start = time.monotonic()
+		for pos in range(0, len(data), self.chunk):
+			try:
+				self.wfile.write(data[pos:pos + self.chunk])
+				self.wfile.flush()
+			except OSError:
+				return
+			if byte_rate > 0:
+				delay = start + (pos + self.chunk) / byte_rate - time.monotonic()
+				if delay > 0:
+					time.sleep(delay)
+
+		self.log_message("%s sent in %.2f s", self.path, time.monotonic() - start)
+
+
+if __name__ == "__main__":
+	if len(sys.argv) < 2:
+		sys.stderr.write("usage: %s <dir> [port] [realtime_factor] [chunk_bytes]\n" % sys.argv[0])
+		sys.exit(1)
+
+	WavHandler.root = sys.argv[1]
+	port = int(sys.argv[2]) if len(sys.argv) > 2 else 8080
+	WavHandler.factor = float(sys.argv[3]) if len(sys.argv) > 3 else 1.0
+	WavHandler.chunk = int(sys.argv[4]) if len(sys.argv) > 4 else 4096
+
+	http.server.ThreadingHTTPServer(("0.0.0.0", port), WavHandler).serve_forever()